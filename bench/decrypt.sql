@@ -0,0 +1,3 @@
+-- decryption of a short value (see setup.sql)
+\set k random(1, least(:nkeys, 10000))
+SELECT pg_vault_decrypt(data, 'bench-' || :k, '') FROM bench_data WHERE id = :k;
@@ -0,0 +1,3 @@
+-- encryption of a short value with a random key
+\set k random(1, :nkeys)
+SELECT pg_vault_encrypt('some short value', 'bench-' || :k, 's2k-mode=1');
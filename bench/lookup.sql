@@ -0,0 +1,3 @@
+-- lookup of a random key
+\set k random(1, :nkeys)
+SELECT pg_vault_lookup('bench-' || :k);
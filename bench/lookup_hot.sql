@@ -0,0 +1,3 @@
+-- lookup of one of a few "hot" keys (mostly served by the backend cache)
+\set k random(1, least(:nkeys, 10))
+SELECT pg_vault_lookup('bench-' || :k);
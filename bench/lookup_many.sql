@@ -0,0 +1,4 @@
+-- lookup of 100 random keys at once
+\set k random(1, :nkeys)
+SELECT count(key) FROM pg_vault_lookup_many(
+	(SELECT array_agg('bench-' || ((:k + i) % :nkeys + 1)) FROM generate_series(1, 100) s(i)));
@@ -0,0 +1,5 @@
+-- many lookups in a single query, without the per-query overhead (so this
+-- measures mostly the lookup itself, including the backend cache)
+\set k random(1, :nkeys)
+SELECT count(pg_vault_lookup('bench-' || ((:k + i) % :nkeys + 1)))
+  FROM generate_series(1, 10000) s(i);
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Runs the pg_vault benchmarks, with a varying number of keys, clients and
+# rate of concurrent admin writes. Prints one CSV line per run:
+#
+#   script,nkeys,clients,write_rate,tps,p50_ms,p95_ms,p99_ms
+#
+# Needs a running instance with pg_vault loaded (shared_preload_libraries),
+# and a database with the extension created. Connects using the usual libpq
+# environment variables (PGHOST, PGPORT, PGUSER, ...), as a superuser. With
+# a million keys the vault needs ~100MB, so set pg_vault.max_size to that.
+#
+# Parameters (environment variables, with the defaults):
+#
+#   BENCH_DB          database to use (bench)
+#   BENCH_SCRIPTS     scripts to run (lookup lookup_hot lookup_many loop encrypt decrypt)
+#   BENCH_KEYS        numbers of keys (10 1000 100000 1000000)
+#   BENCH_CLIENTS     numbers of clients (1 8 32 128)
+#   BENCH_WRITES      rates of admin writes per second, 0 = none (0 10 100)
+#   BENCH_DURATION    duration of each run, in seconds (30)
+
+set -e
+
+BENCH_DB=${BENCH_DB:-bench}
+BENCH_SCRIPTS=${BENCH_SCRIPTS:-"lookup lookup_hot lookup_many loop encrypt decrypt"}
+BENCH_KEYS=${BENCH_KEYS:-"10 1000 100000 1000000"}
+BENCH_CLIENTS=${BENCH_CLIENTS:-"1 8 32 128"}
+BENCH_WRITES=${BENCH_WRITES:-"0 10 100"}
+BENCH_DURATION=${BENCH_DURATION:-30}
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+LOGDIR=$(mktemp -d)
+
+trap 'rm -rf "$LOGDIR"' EXIT
+
+# latency percentiles (in ms) from the pgbench transaction logs
+percentiles() {
+	cat "$LOGDIR"/bench.* | awk '{ print $3 }' | sort -n | awk '
+		function pct(p) { i = int(NR * p); return v[(i < 1) ? 1 : i] / 1000.0 }
+		{ v[NR] = $1 }
+		END { if (NR > 0) printf "%.3f,%.3f,%.3f", pct(0.50), pct(0.95), pct(0.99); else printf ",," }'
+}
+
+echo "script,nkeys,clients,write_rate,tps,p50_ms,p95_ms,p99_ms"
+
+for nkeys in $BENCH_KEYS; do
+
+	psql -q -X -v ON_ERROR_STOP=1 -v nkeys="$nkeys" -f "$DIR/setup.sql" "$BENCH_DB" > /dev/null
+
+	for script in $BENCH_SCRIPTS; do
+		for clients in $BENCH_CLIENTS; do
+			for rate in $BENCH_WRITES; do
+
+				rm -f "$LOGDIR"/bench.*
+
+				# the admin writes run in a separate pgbench, at a fixed rate
+				writer=
+				if [ "$rate" -gt 0 ]; then
+					pgbench -n -f "$DIR/write.sql" -c 1 -R "$rate" -T "$BENCH_DURATION" \
+						"$BENCH_DB" > /dev/null 2>&1 &
+					writer=$!
+				fi
+
+				tps=$(pgbench -n -f "$DIR/$script.sql" -D nkeys="$nkeys" \
+						-c "$clients" -j "$clients" -T "$BENCH_DURATION" \
+						-l --log-prefix="$LOGDIR/bench" "$BENCH_DB" 2>/dev/null |
+					  awk '/^tps/ { print $3; exit }')
+
+				if [ -n "$writer" ]; then
+					wait "$writer" || true
+				fi
+
+				echo "$script,$nkeys,$clients,$rate,$tps,$(percentiles)"
+			done
+		done
+	done
+done
@@ -0,0 +1,22 @@
+-- prepare the vault and data for the benchmarks (as superuser)
+--
+-- expects psql variable 'nkeys' - number of keys to add to the vault
+
+SELECT pg_vault_delete_keys();
+
+-- keys 'bench-1' ... 'bench-N' (32B each, like AES-256 keys)
+SELECT pg_vault_add_keys(
+	(SELECT array_agg('bench-' || i) FROM generate_series(1, :nkeys) s(i)),
+	(SELECT array_agg(decode(md5(i::text) || md5((-i)::text), 'hex')) FROM generate_series(1, :nkeys) s(i)),
+	NULL);
+
+-- encrypted values for the decrypt benchmark (one per key, at most 10k)
+DROP TABLE IF EXISTS bench_data;
+
+CREATE TABLE bench_data (id INT PRIMARY KEY, data BYTEA);
+
+INSERT INTO bench_data
+SELECT i, pg_vault_encrypt(md5(i::text), 'bench-' || i, 's2k-mode=1')
+  FROM generate_series(1, least(:nkeys, 10000)) s(i);
+
+VACUUM ANALYZE bench_data;
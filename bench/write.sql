@@ -0,0 +1,4 @@
+-- admin writes (adding and deleting a key), running concurrently with the
+-- lookups, at a fixed rate (see run.sh)
+SELECT pg_vault_add_key('bench-write-' || :client_id, '\x000102030405060708090a0b0c0d0e0f', NULL);
+SELECT pg_vault_delete_key('bench-write-' || :client_id);
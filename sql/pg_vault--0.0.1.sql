@@ -4,48 +4,280 @@ CREATE OR REPLACE FUNCTION pg_vault_add_key(id TEXT, key BYTEA, comment TEXT)
 	AS 'MODULE_PATHNAME', 'add_key'
 	LANGUAGE C;
 
--- removes a key with particular ID
+-- add many keys at once (all or nothing), comments may be NULL
+CREATE OR REPLACE FUNCTION pg_vault_add_keys(ids TEXT[], keys BYTEA[], comments TEXT[])
+	RETURNS void
+	AS 'MODULE_PATHNAME', 'add_keys'
+	LANGUAGE C;
+
+-- removes a key with particular ID (all versions of the key)
 CREATE OR REPLACE FUNCTION pg_vault_delete_key(id TEXT)
 	RETURNS void
 	AS 'MODULE_PATHNAME', 'delete_key'
 	LANGUAGE C;
 
+-- add a new version of a key (returns the new version, used for encryption)
+CREATE OR REPLACE FUNCTION pg_vault_rotate_key(id TEXT, key BYTEA, comment TEXT)
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'rotate_key'
+	LANGUAGE C;
+
+-- removes an older version of a key (returns false if there's no such version)
+CREATE OR REPLACE FUNCTION pg_vault_delete_key_version(id TEXT, version INT)
+	RETURNS bool
+	AS 'MODULE_PATHNAME', 'delete_key_version'
+	LANGUAGE C;
+
 -- lookup of a key by ID (returns the key data as bytea)
 CREATE OR REPLACE FUNCTION pg_vault_lookup(id TEXT)
 	RETURNS bytea
 	AS 'MODULE_PATHNAME', 'lookup_key'
-	LANGUAGE C;
+	LANGUAGE C STABLE PARALLEL SAFE;
 
--- lists all the keys (without the key data)
-CREATE OR REPLACE FUNCTION pg_vault_list_keys(OUT id TEXT, OUT length INT, OUT comment TEXT)
+-- handle of a key (addresses the key directly, valid until the key is deleted)
+CREATE OR REPLACE FUNCTION pg_vault_key_handle(id TEXT)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME', 'key_handle'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- lookup of a key by handle (returns the key data as bytea)
+CREATE OR REPLACE FUNCTION pg_vault_lookup(handle BIGINT)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'lookup_handle'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- lookup of many keys at once (returns rows with ID and key data)
+CREATE OR REPLACE FUNCTION pg_vault_lookup_many(ids TEXT[], OUT id TEXT, OUT key BYTEA)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'lookup_keys'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- lists all the keys, including all versions (without the key data)
+CREATE OR REPLACE FUNCTION pg_vault_list_keys(OUT id TEXT, OUT length INT, OUT comment TEXT,
+											  OUT version INT)
 	RETURNS SETOF record
 	AS 'MODULE_PATHNAME', 'list_keys'
 	LANGUAGE C;
 
+-- lists keys with IDs starting with the prefix, including all versions
+CREATE OR REPLACE FUNCTION pg_vault_list_keys(prefix TEXT, OUT id TEXT, OUT length INT,
+											  OUT comment TEXT, OUT version INT)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'list_keys'
+	LANGUAGE C STRICT;
+
 -- delete all the keys (overwrites the vault memory)
 CREATE OR REPLACE FUNCTION pg_vault_delete_keys()
 	RETURNS void
 	AS 'MODULE_PATHNAME', 'delete_keys'
 	LANGUAGE C;
 
-CREATE OR REPLACE FUNCTION pg_vault_encrypt(data text, id text, options text) returns bytea AS '
-	SELECT pgp_sym_encrypt($1, pg_vault_lookup($2)::text, $3);
-' LANGUAGE SQL SECURITY DEFINER;
+-- delete all the keys with IDs starting with the prefix (all versions)
+CREATE OR REPLACE FUNCTION pg_vault_delete_keys(prefix TEXT)
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'delete_keys_prefix'
+	LANGUAGE C STRICT;
+
+-- usage statistics of the vault (for the current database)
+CREATE OR REPLACE FUNCTION pg_vault_stats(OUT lookups BIGINT, OUT misses BIGINT,
+										  OUT cache_hits BIGINT, OUT cache_hit_ratio FLOAT8,
+										  OUT adds BIGINT, OUT deletes BIGINT,
+										  OUT lock_waits BIGINT, OUT lock_wait_time FLOAT8,
+										  OUT nkeys INT, OUT maxitems INT, OUT fill FLOAT8,
+										  OUT size BIGINT)
+	RETURNS record
+	AS 'MODULE_PATHNAME', 'vault_stats'
+	LANGUAGE C;
+
+-- number of uses of each key in the vault
+CREATE OR REPLACE FUNCTION pg_vault_key_stats(OUT id TEXT, OUT uses BIGINT)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME', 'key_stats'
+	LANGUAGE C;
+
+-- save all the keys into an encrypted wallet file (returns number of keys)
+CREATE OR REPLACE FUNCTION pg_vault_save_keys(passphrase TEXT)
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'save_keys'
+	LANGUAGE C STRICT;
+
+-- load all the keys from the encrypted wallet file (returns number of keys)
+CREATE OR REPLACE FUNCTION pg_vault_load_keys(passphrase TEXT)
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'load_keys'
+	LANGUAGE C STRICT;
+
+-- ship all the keys to the standbys, through WAL (returns number of keys)
+CREATE OR REPLACE FUNCTION pg_vault_replicate_keys()
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'replicate_keys'
+	LANGUAGE C STRICT;
+
+-- encryption / decryption using keys from the vault (calls pgcrypto directly)
+--
+-- The decryption (and lookups) are STABLE, as the key is resolved only once
+-- per statement (the vault may be modified concurrently). The encryption is
+-- VOLATILE, because pgcrypto uses a random salt (the result is different).
+-- All of them are PARALLEL SAFE - the vault is in shared memory, and each
+-- process (including parallel workers) copies the keys it needs.
+CREATE OR REPLACE FUNCTION pg_vault_encrypt(data text, id text, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_text'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_bytea(data bytea, id text, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_bytea'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt(data bytea, id text, options text)
+	RETURNS text
+	AS 'MODULE_PATHNAME', 'decrypt_text'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_bytea(data bytea, id text, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'decrypt_bytea'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- the same, using key handles (see pg_vault_key_handle)
+CREATE OR REPLACE FUNCTION pg_vault_encrypt(data text, handle bigint, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_text_handle'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_bytea(data bytea, handle bigint, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_bytea_handle'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt(data bytea, handle bigint, options text)
+	RETURNS text
+	AS 'MODULE_PATHNAME', 'decrypt_text_handle'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_bytea(data bytea, handle bigint, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'decrypt_bytea_handle'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- encryption / decryption of all elements of an array (resolving the key once)
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_many(data bytea[], id text, options text)
+	RETURNS bytea[]
+	AS 'MODULE_PATHNAME', 'encrypt_many'
+	LANGUAGE C STRICT PARALLEL SAFE;
 
-CREATE OR REPLACE FUNCTION pg_vault_encrypt_bytea(data bytea, id text, options text) returns bytea AS '
-	SELECT pgp_sym_encrypt_bytea($1, pg_vault_lookup($2)::text, $3);
-' LANGUAGE SQL SECURITY DEFINER;
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_many(data bytea[], id text, options text)
+	RETURNS bytea[]
+	AS 'MODULE_PATHNAME', 'decrypt_many'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_many(data bytea[], handle bigint, options text)
+	RETURNS bytea[]
+	AS 'MODULE_PATHNAME', 'encrypt_many_handle'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_many(data bytea[], handle bigint, options text)
+	RETURNS bytea[]
+	AS 'MODULE_PATHNAME', 'decrypt_many_handle'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- encryption / decryption of large objects in chunks (creates a new large object)
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_lo(lo oid, id text, options text)
+	RETURNS oid
+	AS 'MODULE_PATHNAME', 'encrypt_lo'
+	LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_lo(lo oid, id text, options text)
+	RETURNS oid
+	AS 'MODULE_PATHNAME', 'decrypt_lo'
+	LANGUAGE C STRICT;
+
+-- key derived from a master key for the context (HKDF-SHA256, see derive.c)
+CREATE OR REPLACE FUNCTION pg_vault_derive(master_id TEXT, context TEXT)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'derive_key'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- encryption / decryption using keys derived from a master key
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_derived(data text, master_id text, context text,
+													options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_text_derived'
+	LANGUAGE C STRICT PARALLEL SAFE;
 
-CREATE OR REPLACE FUNCTION pg_vault_decrypt(data bytea, id text, options text) returns text AS '
-	SELECT pgp_sym_decrypt($1, pg_vault_lookup($2)::text, $3);
-' LANGUAGE SQL SECURITY DEFINER;
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_bytea_derived(data bytea, master_id text,
+														  context text, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_bytea_derived'
+	LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_derived(data bytea, master_id text, context text,
+													options text)
+	RETURNS text
+	AS 'MODULE_PATHNAME', 'decrypt_text_derived'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_bytea_derived(data bytea, master_id text,
+														  context text, options text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'decrypt_bytea_derived'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- deterministic encryption (the same data gives the same result, so it may be
+-- indexed), STABLE as the result depends only on the data and the key
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_deterministic(data text, id text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_deterministic'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_encrypt_deterministic(data bytea, id text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'encrypt_deterministic'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_deterministic(data bytea, id text)
+	RETURNS text
+	AS 'MODULE_PATHNAME', 'decrypt_deterministic_text'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_decrypt_deterministic_bytea(data bytea, id text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'decrypt_deterministic_bytea'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- keyed blind index of the data (HMAC with a key derived from the vault key)
+CREATE OR REPLACE FUNCTION pg_vault_blind_index(data text, id text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'blind_index'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION pg_vault_blind_index(data bytea, id text)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME', 'blind_index'
+	LANGUAGE C STRICT STABLE PARALLEL SAFE;
 
-CREATE OR REPLACE FUNCTION pg_vault_decrypt_bytea(data bytea, id text, options text) returns bytea AS '
-	SELECT pgp_sym_decrypt_bytea($1, pg_vault_lookup($2)::text, $3);
-' LANGUAGE SQL SECURITY DEFINER;
+-- version of the key the data was encrypted with (to find data to re-encrypt)
+CREATE OR REPLACE FUNCTION pg_vault_key_version(data bytea)
+	RETURNS int
+	AS 'MODULE_PATHNAME', 'key_version'
+	LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
 
-REVOKE ALL ON FUNCTION pg_vault_add_key (TEXT, BYTEA, TEXT, BOOLEAN) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_add_key (TEXT, BYTEA, TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_add_keys (TEXT[], BYTEA[], TEXT[]) FROM public;
 REVOKE ALL ON FUNCTION pg_vault_delete_key (TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_rotate_key (TEXT, BYTEA, TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_delete_key_version (TEXT, INT) FROM public;
 REVOKE ALL ON FUNCTION pg_vault_lookup (TEXT) FROM public;
-REVOKE ALL ON FUNCTION pg_vault_list_keys (OUT TEXT, OUT INT, OUT TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_lookup (BIGINT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_lookup_many (TEXT[], OUT TEXT, OUT BYTEA) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_derive (TEXT, TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_list_keys (OUT TEXT, OUT INT, OUT TEXT, OUT INT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_list_keys (TEXT, OUT TEXT, OUT INT, OUT TEXT, OUT INT) FROM public;
 REVOKE ALL ON FUNCTION pg_vault_delete_keys () FROM public;
+REVOKE ALL ON FUNCTION pg_vault_delete_keys (TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_stats () FROM public;
+REVOKE ALL ON FUNCTION pg_vault_key_stats () FROM public;
+REVOKE ALL ON FUNCTION pg_vault_save_keys (TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_load_keys (TEXT) FROM public;
+REVOKE ALL ON FUNCTION pg_vault_replicate_keys () FROM public;
@@ -0,0 +1,855 @@
+/*
+ * backend.c
+ *
+ * External key backend (e.g. a remote KMS), with the vault acting as a
+ * cache in front of it.
+ *
+ * The backend is implemented by a separate library (pg_vault.backend), and
+ * only the backend worker talks to it - the regular backends never load the
+ * library, nor connect to the external service. When a key is not found in
+ * the vault, the backend puts a request into a queue in shared memory, and
+ * waits for the worker to fetch the key and add it to the vault. Requests
+ * for the same key are coalesced (the backends simply wait for the same
+ * request), and the worker fetches all the queued keys in a single batch,
+ * so that the library may pipeline the requests or use a batch API.
+ *
+ * Keys fetched from the backend expire after pg_vault.backend_ttl. The
+ * worker refreshes them a while before that, so lookups of keys in use
+ * don't need to wait for the backend at all, and deletes the expired ones
+ * (e.g. when the backend is not reachable, or the key was removed).
+ *
+ * Adding and deleting keys (pg_vault_add_key etc.) goes through the worker
+ * too, and the vault is only modified after the backend accepts the change.
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include <signal.h>
+
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "vault.h"
+
+/* max number of queued requests (and keys fetched in a single batch) */
+#define VAULT_BACKEND_QUEUE		64
+
+/* how often to check for expired keys (ms) */
+#define VAULT_BACKEND_NAPTIME	1000
+
+/* keys are refreshed when less than 1/4 of the TTL remains */
+#define VAULT_BACKEND_REFRESH	4
+
+/* max length of an error message reported back to the backend */
+#define VAULT_BACKEND_ERROR_LEN	256
+
+/* GUC variables */
+char	   *pgvault_backend = NULL;
+int			pgvault_backend_ttl = 300;
+
+typedef enum VaultRequestState
+{
+	VAULT_REQUEST_FREE = 0,		/* unused slot */
+	VAULT_REQUEST_PENDING,		/* waiting for the worker */
+	VAULT_REQUEST_RUNNING,		/* being processed by the worker */
+	VAULT_REQUEST_DONE			/* done, but some backends are still waiting */
+} VaultRequestState;
+
+typedef enum VaultRequestType
+{
+	VAULT_REQUEST_FETCH,
+	VAULT_REQUEST_STORE,
+	VAULT_REQUEST_REMOVE
+} VaultRequestType;
+
+/*
+ * A request for the worker. Each backend waiting for the request increments
+ * nwaiters (there may be many for a fetch), and the last one to notice the
+ * request is done releases the slot. Requests without waiters (e.g. when
+ * the backends got cancelled) are released by the worker.
+ */
+typedef struct VaultRequestData
+{
+	VaultRequestState	state;
+	VaultRequestType	type;
+	int			nwaiters;			/* backends waiting for the result */
+	Oid			dbid;				/* database of the key */
+	char		id[MAX_ID_LENGTH];	/* ID of the key */
+	bool		failed;				/* did the request fail? */
+	char		error[VAULT_BACKEND_ERROR_LEN];	/* why it failed */
+
+	/* key data and comment for store requests (wiped once processed) */
+	char		key[MAX_KEY_LENGTH];
+	bool		has_comment;
+	char		comment[MAX_COMMENT_LENGTH];
+} VaultRequestData;
+
+typedef VaultRequestData* VaultRequest;
+
+/* the request queue (in the main shared memory segment) */
+typedef struct VaultBackendData
+{
+	LWLock		   *lock;		/* guards the queue */
+	Latch		   *latch;		/* latch of the worker (or NULL) */
+	ConditionVariable	cv;		/* broadcast when requests get done */
+
+	VaultRequestData	requests[VAULT_BACKEND_QUEUE];
+} VaultBackendData;
+
+typedef VaultBackendData* VaultBackend;
+
+static VaultBackend vault_backend = NULL;
+
+/* requests a backend is waiting for (to clean up after a cancel) */
+typedef struct VaultBackendWait
+{
+	int		nslots;
+	int	   *slots;
+	bool   *done;
+} VaultBackendWait;
+
+/* a request (or a refresh of a key) being processed by the worker */
+typedef struct VaultBackendTask
+{
+	int			slot;			/* slot of the request (-1 for refreshes) */
+	VaultRequestData	request;	/* copy of the request */
+	VaultBackendKey	   *key;	/* the fetched key (for fetches) */
+} VaultBackendTask;
+
+/* arguments of fetch_cb (called through vault_backend_call) */
+typedef struct VaultBackendFetch
+{
+	int				nkeys;
+	VaultBackendKey *keys;
+} VaultBackendFetch;
+
+void vault_backend_main(Datum arg);
+
+static void vault_backend_run(VaultRequestType type, int nids, char **ids,
+							  VaultEntry *entry);
+static int vault_backend_enqueue(VaultRequestType type, const char *id,
+								 VaultEntry *entry);
+static void vault_backend_wait(VaultBackendWait *wait);
+static void vault_backend_cancel(int code, Datum arg);
+static void vault_backend_release(VaultRequest request);
+static bool vault_backend_process(TimestampTz *last_sweep);
+static bool vault_backend_call(void (*fn) (void *arg), void *arg, char *error);
+static void vault_backend_fetch_keys(void *arg);
+static void vault_backend_execute(void *arg);
+static void vault_backend_sigterm(SIGNAL_ARGS);
+static void vault_backend_sighup(SIGNAL_ARGS);
+static void vault_backend_exit(int code, Datum arg);
+
+static VaultBackendCallbacks vault_backend_callbacks;
+
+static volatile sig_atomic_t got_sigterm = false;
+static volatile sig_atomic_t got_sighup = false;
+
+/*
+ * size of the request queue
+ */
+Size
+vault_backend_shmem_size(void)
+{
+	return MAXALIGN(sizeof(VaultBackendData));
+}
+
+
+/*
+ * create (or attach to) the request queue (the caller holds the
+ * AddinShmemInitLock)
+ */
+void
+vault_backend_shmem_init(LWLock *lock)
+{
+	bool	found;
+
+	vault_backend = (VaultBackend) ShmemInitStruct("pgvault backend",
+												   vault_backend_shmem_size(),
+												   &found);
+
+	if (! found)
+	{
+		memset(vault_backend, 0, vault_backend_shmem_size());
+
+		vault_backend->lock = lock;
+		ConditionVariableInit(&vault_backend->cv);
+	}
+}
+
+
+/*
+ * register the backend worker (called from _PG_init, when pg_vault.backend
+ * is set)
+ */
+void
+vault_backend_register(void)
+{
+	BackgroundWorker	worker;
+
+	memset(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_vault backend");
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_vault");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "vault_backend_main");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * fetch keys (of the current database) from the backend into the vault
+ *
+ * Waits for the worker to process all the requests. Keys not found in the
+ * backend are simply not added to the vault, so the caller needs to look
+ * into the vault again.
+ */
+void
+vault_backend_fetch(int nids, char **ids)
+{
+	vault_backend_run(VAULT_REQUEST_FETCH, nids, ids, NULL);
+}
+
+
+/*
+ * add a key to the backend (and to the vault, once the backend accepts it)
+ */
+void
+vault_backend_store(VaultEntry *entry)
+{
+	vault_check_entry(entry);
+
+	vault_backend_run(VAULT_REQUEST_STORE, 1, &entry->id, entry);
+}
+
+
+/*
+ * delete a key from the backend (and from the vault)
+ */
+void
+vault_backend_remove(const char *id)
+{
+	char   *ids[1];
+
+	if (strlen(id) >= MAX_ID_LENGTH)
+		elog(ERROR, "key ID too long (max=%d len=%ld)", MAX_ID_LENGTH, strlen(id));
+
+	ids[0] = (char *) id;
+
+	vault_backend_run(VAULT_REQUEST_REMOVE, 1, ids, NULL);
+}
+
+
+/*
+ * submit requests for the IDs and wait for the worker to process them
+ *
+ * If the queue is full, we submit as many requests as possible, wait for
+ * those, and then continue with the rest. Errors out if any of the
+ * requests failed.
+ */
+static void
+vault_backend_run(VaultRequestType type, int nids, char **ids, VaultEntry *entry)
+{
+	int					next = 0;
+	VaultBackendWait	wait;
+
+	wait.slots = (int *) palloc(VAULT_BACKEND_QUEUE * sizeof(int));
+	wait.done = (bool *) palloc(VAULT_BACKEND_QUEUE * sizeof(bool));
+
+	while (next < nids)
+	{
+		Latch  *latch;
+
+		wait.nslots = 0;
+
+		LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+		while ((next < nids) && (wait.nslots < VAULT_BACKEND_QUEUE))
+		{
+			int		slot = vault_backend_enqueue(type, ids[next], entry);
+
+			if (slot < 0)
+				break;
+
+			wait.slots[wait.nslots] = slot;
+			wait.done[wait.nslots] = false;
+			wait.nslots++;
+
+			next++;
+		}
+
+		latch = vault_backend->latch;
+
+		LWLockRelease(vault_backend->lock);
+
+		if (latch != NULL)
+			SetLatch(latch);
+
+		/* with a full queue (and no slots), this waits for any request */
+		vault_backend_wait(&wait);
+	}
+
+	pfree(wait.slots);
+	pfree(wait.done);
+}
+
+
+/*
+ * add a request to the queue (the caller holds the lock in exclusive mode)
+ *
+ * A fetch of a key already requested (and not done yet) is coalesced with
+ * the existing request. Returns the slot, or -1 if the queue is full.
+ */
+static int
+vault_backend_enqueue(VaultRequestType type, const char *id, VaultEntry *entry)
+{
+	int				i;
+	int				slot = -1;
+	VaultRequest	request;
+
+	for (i = 0; i < VAULT_BACKEND_QUEUE; i++)
+	{
+		request = &vault_backend->requests[i];
+
+		if (request->state == VAULT_REQUEST_FREE)
+		{
+			if (slot < 0)
+				slot = i;
+
+			continue;
+		}
+
+		if ((type == VAULT_REQUEST_FETCH) &&
+			(request->type == VAULT_REQUEST_FETCH) &&
+			(request->state != VAULT_REQUEST_DONE) &&
+			(request->dbid == MyDatabaseId) &&
+			(strcmp(request->id, id) == 0))
+		{
+			request->nwaiters++;
+			return i;
+		}
+	}
+
+	if (slot < 0)
+		return -1;
+
+	request = &vault_backend->requests[slot];
+
+	memset(request, 0, sizeof(VaultRequestData));
+
+	request->state = VAULT_REQUEST_PENDING;
+	request->type = type;
+	request->nwaiters = 1;
+	request->dbid = MyDatabaseId;
+	strlcpy(request->id, id, MAX_ID_LENGTH);
+
+	if (entry != NULL)
+	{
+		memcpy(request->key, entry->key, VARSIZE_ANY(entry->key));
+
+		if (entry->comment != NULL)
+		{
+			request->has_comment = true;
+			strlcpy(request->comment, entry->comment, MAX_COMMENT_LENGTH);
+		}
+	}
+
+	return slot;
+}
+
+
+/*
+ * wait until the worker processes all the requests, and release them
+ *
+ * If we get cancelled while waiting, we stop waiting for the requests (the
+ * worker still processes them, and releases the slots).
+ */
+static void
+vault_backend_wait(VaultBackendWait *wait)
+{
+	int		i;
+	bool	failed = false;
+	char	error[VAULT_BACKEND_ERROR_LEN];
+
+	PG_ENSURE_ERROR_CLEANUP(vault_backend_cancel, PointerGetDatum(wait));
+	{
+		ConditionVariablePrepareToSleep(&vault_backend->cv);
+
+		while (true)
+		{
+			int		ndone = 0;
+
+			LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+			for (i = 0; i < wait->nslots; i++)
+			{
+				VaultRequest	request = &vault_backend->requests[wait->slots[i]];
+
+				if (! wait->done[i] && (request->state == VAULT_REQUEST_DONE))
+				{
+					if (request->failed && ! failed)
+					{
+						failed = true;
+						strlcpy(error, request->error, VAULT_BACKEND_ERROR_LEN);
+					}
+
+					wait->done[i] = true;
+
+					if (--request->nwaiters == 0)
+						vault_backend_release(request);
+				}
+
+				if (wait->done[i])
+					ndone++;
+			}
+
+			LWLockRelease(vault_backend->lock);
+
+			if ((wait->nslots > 0) && (ndone == wait->nslots))
+				break;
+
+			ConditionVariableSleep(&vault_backend->cv, PG_WAIT_EXTENSION);
+
+			/* with a full queue, we only wait for some request to get done */
+			if (wait->nslots == 0)
+				break;
+		}
+
+		ConditionVariableCancelSleep();
+	}
+	PG_END_ENSURE_ERROR_CLEANUP(vault_backend_cancel, PointerGetDatum(wait));
+
+	if (failed)
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+				 errmsg("key backend request failed: %s", error)));
+}
+
+
+/*
+ * stop waiting for the requests not done yet (after an error)
+ */
+static void
+vault_backend_cancel(int code, Datum arg)
+{
+	int					i;
+	VaultBackendWait   *wait = (VaultBackendWait *) DatumGetPointer(arg);
+
+	LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < wait->nslots; i++)
+	{
+		VaultRequest	request = &vault_backend->requests[wait->slots[i]];
+
+		if (wait->done[i])
+			continue;
+
+		wait->done[i] = true;
+
+		if ((--request->nwaiters == 0) && (request->state == VAULT_REQUEST_DONE))
+			vault_backend_release(request);
+	}
+
+	LWLockRelease(vault_backend->lock);
+}
+
+
+/*
+ * release a slot in the queue (wiping the key data)
+ */
+static void
+vault_backend_release(VaultRequest request)
+{
+	memset(request, 0, sizeof(VaultRequestData));
+
+	request->state = VAULT_REQUEST_FREE;
+}
+
+
+/*
+ * main loop of the backend worker
+ */
+void
+vault_backend_main(Datum arg)
+{
+	int					i;
+	VaultBackendInit	init;
+	MemoryContext		context;
+	TimestampTz			last_sweep = 0;
+
+	pqsignal(SIGTERM, vault_backend_sigterm);
+	pqsignal(SIGHUP, vault_backend_sighup);
+	BackgroundWorkerUnblockSignals();
+
+	init = (VaultBackendInit) load_external_function(pgvault_backend,
+													 "_PG_vault_backend_init",
+													 true, NULL);
+
+	memset(&vault_backend_callbacks, 0, sizeof(VaultBackendCallbacks));
+	init(&vault_backend_callbacks);
+
+	if (vault_backend_callbacks.fetch_cb == NULL)
+		elog(ERROR, "key backend \"%s\" does not define fetch_cb", pgvault_backend);
+
+	if (vault_backend_callbacks.startup_cb != NULL)
+		vault_backend_callbacks.startup_cb();
+
+	before_shmem_exit(vault_backend_exit, (Datum) 0);
+
+	/* requests interrupted by a restart of the worker are processed again */
+	LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+	vault_backend->latch = MyLatch;
+
+	for (i = 0; i < VAULT_BACKEND_QUEUE; i++)
+		if (vault_backend->requests[i].state == VAULT_REQUEST_RUNNING)
+			vault_backend->requests[i].state = VAULT_REQUEST_PENDING;
+
+	LWLockRelease(vault_backend->lock);
+
+	context = AllocSetContextCreate(TopMemoryContext,
+									"pg_vault backend",
+									ALLOCSET_DEFAULT_SIZES);
+
+	while (! got_sigterm)
+	{
+		bool	processed;
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		MemoryContextSwitchTo(context);
+
+		processed = vault_backend_process(&last_sweep);
+
+		MemoryContextSwitchTo(TopMemoryContext);
+		MemoryContextReset(context);
+
+		/* there may be more requests queued in the meantime */
+		if (processed)
+		{
+			CHECK_FOR_INTERRUPTS();
+			continue;
+		}
+
+		if (WaitLatch(MyLatch,
+					  WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					  VAULT_BACKEND_NAPTIME, PG_WAIT_EXTENSION) & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		ResetLatch(MyLatch);
+	}
+
+	proc_exit(0);
+}
+
+
+/*
+ * process the queued requests, and refresh the keys expiring soon
+ *
+ * All the keys (both requested and refreshed) are fetched in a single call
+ * to fetch_cb, and then added to the vault one by one. Returns true if
+ * there were any queued requests.
+ */
+static bool
+vault_backend_process(TimestampTz *last_sweep)
+{
+	int					i;
+	int					ntasks = 0;
+	int					nrefresh = 0;
+	int					nrequests = 0;
+	VaultBackendKey	   *refresh = NULL;
+	VaultBackendTask   *tasks;
+	VaultBackendFetch	fetch;
+	TimestampTz			now = GetCurrentTimestamp();
+	char				error[VAULT_BACKEND_ERROR_LEN];
+
+	/* delete the expired keys, and find those to refresh */
+	if (TimestampDifferenceExceeds(*last_sweep, now, VAULT_BACKEND_NAPTIME))
+	{
+		TimestampTz	horizon;
+
+		horizon = TimestampTzPlusMilliseconds(now, (pgvault_backend_ttl * 1000L) /
+											  VAULT_BACKEND_REFRESH);
+
+		refresh = vault_expire_keys(now, horizon, &nrefresh);
+
+		*last_sweep = now;
+	}
+
+	tasks = (VaultBackendTask *) palloc0((VAULT_BACKEND_QUEUE + nrefresh) *
+										 sizeof(VaultBackendTask));
+
+	fetch.keys = (VaultBackendKey *) palloc0((VAULT_BACKEND_QUEUE + nrefresh) *
+											 sizeof(VaultBackendKey));
+	fetch.nkeys = 0;
+
+	/* take all the pending requests */
+	LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < VAULT_BACKEND_QUEUE; i++)
+	{
+		VaultRequest	request = &vault_backend->requests[i];
+
+		if (request->state != VAULT_REQUEST_PENDING)
+			continue;
+
+		request->state = VAULT_REQUEST_RUNNING;
+
+		tasks[ntasks].slot = i;
+		memcpy(&tasks[ntasks].request, request, sizeof(VaultRequestData));
+		ntasks++;
+	}
+
+	LWLockRelease(vault_backend->lock);
+
+	nrequests = ntasks;
+
+	for (i = 0; i < nrefresh; i++)
+	{
+		tasks[ntasks].slot = -1;
+		tasks[ntasks].request.type = VAULT_REQUEST_FETCH;
+		tasks[ntasks].request.dbid = refresh[i].dbid;
+		strlcpy(tasks[ntasks].request.id, refresh[i].id, MAX_ID_LENGTH);
+		ntasks++;
+	}
+
+	/* fetch all the keys in a single batch */
+	for (i = 0; i < ntasks; i++)
+	{
+		VaultBackendKey *key;
+
+		if (tasks[i].request.type != VAULT_REQUEST_FETCH)
+			continue;
+
+		key = &fetch.keys[fetch.nkeys++];
+
+		key->dbid = tasks[i].request.dbid;
+		strlcpy(key->id, tasks[i].request.id, MAX_ID_LENGTH);
+
+		tasks[i].key = key;
+	}
+
+	if ((fetch.nkeys > 0) &&
+		! vault_backend_call(vault_backend_fetch_keys, &fetch, error))
+	{
+		for (i = 0; i < ntasks; i++)
+		{
+			if (tasks[i].request.type != VAULT_REQUEST_FETCH)
+				continue;
+
+			tasks[i].request.failed = true;
+			strlcpy(tasks[i].request.error, error, VAULT_BACKEND_ERROR_LEN);
+		}
+	}
+
+	/* update the vault (and the backend, for stores/removes) */
+	for (i = 0; i < ntasks; i++)
+	{
+		if (tasks[i].request.failed)
+			continue;
+
+		if (! vault_backend_call(vault_backend_execute, &tasks[i], error))
+		{
+			tasks[i].request.failed = true;
+			strlcpy(tasks[i].request.error, error, VAULT_BACKEND_ERROR_LEN);
+		}
+	}
+
+	/* report the results */
+	LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < nrequests; i++)
+	{
+		VaultRequest	request = &vault_backend->requests[tasks[i].slot];
+
+		request->state = VAULT_REQUEST_DONE;
+		request->failed = tasks[i].request.failed;
+		strlcpy(request->error, tasks[i].request.error, VAULT_BACKEND_ERROR_LEN);
+
+		memset(request->key, 0, MAX_KEY_LENGTH);
+
+		if (request->nwaiters == 0)
+			vault_backend_release(request);
+	}
+
+	LWLockRelease(vault_backend->lock);
+
+	if (nrequests > 0)
+		ConditionVariableBroadcast(&vault_backend->cv);
+
+	/* wipe the keys (the memory context only gets reset) */
+	for (i = 0; i < fetch.nkeys; i++)
+		if (fetch.keys[i].key != NULL)
+			memset(fetch.keys[i].key, 0, VARSIZE_ANY(fetch.keys[i].key));
+
+	for (i = 0; i < ntasks; i++)
+		memset(tasks[i].request.key, 0, MAX_KEY_LENGTH);
+
+	return (nrequests > 0);
+}
+
+
+/*
+ * call a function, turning an error into a message for the backends
+ *
+ * The worker should not exit just because the external service failed
+ * (or because the vault is full), so we report the error back to the
+ * backends waiting for the request, and log it.
+ */
+static bool
+vault_backend_call(void (*fn) (void *arg), void *arg, char *error)
+{
+	MemoryContext	context = CurrentMemoryContext;
+	volatile bool	success = true;
+
+	PG_TRY();
+	{
+		fn(arg);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(context);
+
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		/* the vault may fail while holding the stripe locks */
+		LWLockReleaseAll();
+
+		strlcpy(error, edata->message, VAULT_BACKEND_ERROR_LEN);
+		FreeErrorData(edata);
+
+		elog(WARNING, "key backend request failed: %s", error);
+
+		success = false;
+	}
+	PG_END_TRY();
+
+	return success;
+}
+
+
+/*
+ * fetch a batch of keys from the backend
+ */
+static void
+vault_backend_fetch_keys(void *arg)
+{
+	VaultBackendFetch  *fetch = (VaultBackendFetch *) arg;
+
+	vault_backend_callbacks.fetch_cb(fetch->nkeys, fetch->keys);
+}
+
+
+/*
+ * apply a single request to the backend and the vault
+ *
+ * Keys not found in the backend (e.g. when refreshing) are removed from
+ * the vault.
+ */
+static void
+vault_backend_execute(void *arg)
+{
+	VaultBackendTask   *task = (VaultBackendTask *) arg;
+	VaultRequest		request = &task->request;
+	VaultEntry			entry;
+
+	entry.id = request->id;
+	entry.comment = request->has_comment ? request->comment : NULL;
+	entry.expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												pgvault_backend_ttl * 1000L);
+	entry.version = 0;
+
+	switch (request->type)
+	{
+		case VAULT_REQUEST_FETCH:
+
+			if (task->key->key == NULL)
+			{
+				vault_uncache_key(request->dbid, request->id, 0);
+				break;
+			}
+
+			entry.key = task->key->key;
+			vault_check_entry(&entry);
+
+			vault_cache_keys(request->dbid, &entry, 1);
+			break;
+
+		case VAULT_REQUEST_STORE:
+
+			if (vault_backend_callbacks.store_cb == NULL)
+				elog(ERROR, "key backend \"%s\" does not support adding keys", pgvault_backend);
+
+			entry.key = (bytea *) request->key;
+
+			vault_backend_callbacks.store_cb(request->dbid, &entry);
+
+			vault_cache_keys(request->dbid, &entry, 1);
+			break;
+
+		case VAULT_REQUEST_REMOVE:
+
+			if (vault_backend_callbacks.remove_cb == NULL)
+				elog(ERROR, "key backend \"%s\" does not support deleting keys", pgvault_backend);
+
+			vault_backend_callbacks.remove_cb(request->dbid, request->id);
+
+			vault_uncache_key(request->dbid, request->id, 0);
+			break;
+	}
+}
+
+
+static void
+vault_backend_sigterm(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+static void
+vault_backend_sighup(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+static void
+vault_backend_exit(int code, Datum arg)
+{
+	LWLockAcquire(vault_backend->lock, LW_EXCLUSIVE);
+	vault_backend->latch = NULL;
+	LWLockRelease(vault_backend->lock);
+
+	if (vault_backend_callbacks.shutdown_cb != NULL)
+		vault_backend_callbacks.shutdown_cb();
+}
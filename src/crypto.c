@@ -0,0 +1,1449 @@
+/*
+ * crypto.c
+ *
+ * Native implementation of the encrypt/decrypt functions, using keys from
+ * the vault. This does not implement any crypto on its own - we simply look
+ * up the key and call the pgcrypto functions directly (i.e. only the pgcrypto
+ * library needs to be installed, the extension does not need to be created
+ * in the database).
+ *
+ * Compared to SQL wrappers (pgp_sym_encrypt with pg_vault_lookup) this
+ * eliminates the overhead of SQL functions, which can't be inlined as they
+ * need to be SECURITY DEFINER (to prevent users from looking up the keys).
+ *
+ * The data is encrypted with the current version of the key, and the version
+ * is stored in the encrypted data (see VAULT_VERSION_MARKER), so that the
+ * decryption can pick the matching version. That allows rotating the key
+ * without re-encrypting all the data at once.
+ *
+ * There's also a deterministic encryption (see VAULT_SIV_LENGTH), and keyed
+ * blind indexes, so that encrypted columns can be searched for equality
+ * using regular indexes.
+ */
+#include "postgres.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+
+#include "catalog/pg_type.h"
+#include "libpq/libpq-fs.h"
+#include "mb/pg_wchar.h"
+#include "storage/large_object.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "vault.h"
+
+/* pgcrypto library, and the functions we need from it */
+#define PGCRYPTO_LIBRARY	"$libdir/pgcrypto"
+
+static PGFunction pgp_sym_encrypt_text_fn = NULL;
+static PGFunction pgp_sym_encrypt_bytea_fn = NULL;
+static PGFunction pgp_sym_decrypt_text_fn = NULL;
+static PGFunction pgp_sym_decrypt_bytea_fn = NULL;
+static PGFunction pg_hmac_fn = NULL;
+static PGFunction pg_encrypt_iv_fn = NULL;
+static PGFunction pg_decrypt_iv_fn = NULL;
+
+/*
+ * Data encrypted with a version of the key other than the first one starts
+ * with a small header - a marker byte and the version (4B, big endian) - and
+ * the PGP message follows. A PGP message always starts with a packet tag
+ * (with the highest bit set), so it can't be confused with the header. Data
+ * encrypted with the first version (e.g. by the original SQL wrappers,
+ * before the key got rotated) remains a plain pgcrypto message.
+ */
+#define VAULT_VERSION_MARKER	0x01
+#define VAULT_VERSION_HEADER	5
+
+/*
+ * Large objects are encrypted in chunks, each chunk being a separate PGP
+ * message (pgcrypto can't encrypt a message incrementally), so that we
+ * never need more memory than for a couple of chunks. The encrypted large
+ * object starts with a magic and a random nonce (16B), followed by the
+ * chunks, each prefixed with the length of the message (4B, big endian).
+ *
+ * The plaintext of each chunk starts with the sequence number of the chunk
+ * (8B, big endian), a flag marking the last chunk and the nonce of the
+ * object, so that reordered, duplicate or missing chunks are detected when
+ * decrypting, and so are chunks spliced from another object encrypted with
+ * the same key.
+ *
+ * With a version of the key other than the first one, the magic is
+ * VAULT_LO_MAGIC_VERSION, followed by the version (4B, big endian), and
+ * then by the nonce.
+ */
+#define VAULT_LO_MAGIC			"PGVLO01"
+#define VAULT_LO_MAGIC_VERSION	"PGVLO02"
+#define VAULT_LO_MAGIC_LEN		8
+#define VAULT_LO_CHUNK			(64 * 1024)
+#define VAULT_LO_NONCE_LEN		16
+#define VAULT_LO_CHUNK_HEADER	(9 + VAULT_LO_NONCE_LEN)
+
+/* maximum length of an encrypted chunk (pgcrypto adds a bit of overhead) */
+#define VAULT_LO_MAX_MESSAGE	(2 * VAULT_LO_CHUNK)
+
+/*
+ * The deterministic encryption is a synthetic IV construction, in the spirit
+ * of AES-SIV (RFC 5297), using the primitives pgcrypto provides. A 32-byte
+ * key is derived from the vault key (see derive.c), and split into a MAC key
+ * and an AES-128 key. The IV is HMAC-SHA256 of the plaintext (truncated to
+ * VAULT_SIV_LENGTH), and the plaintext is encrypted in CBC mode with that
+ * IV. So the same plaintext always gives the same result, and the IV also
+ * authenticates the plaintext after decryption.
+ *
+ * The result always starts with the version header (the version of the key
+ * matters even for the first version, as the data is compared as a whole),
+ * followed by the IV and the ciphertext.
+ *
+ * The blind index is HMAC-SHA256 of the plaintext, using another key derived
+ * from the vault key. It reveals which values are equal, but nothing else.
+ */
+#define VAULT_SIV_LENGTH		16
+#define VAULT_SIV_KEY_LENGTH	16
+#define VAULT_SIV_CIPHER		"aes-cbc/pad:pkcs"
+#define VAULT_SIV_CONTEXT		"pg_vault deterministic encryption"
+#define VAULT_BLIND_CONTEXT		"pg_vault blind index"
+
+static void load_pgcrypto(void);
+static const text *vault_passphrase(text *id, uint32 *version);
+static const text *vault_call_passphrase(FunctionCallInfo fcinfo, int argno, bool handle,
+										 uint32 *version);
+static bool vault_pgp_encrypts(PGFunction fn);
+static uint32 vault_version_get(bytea *data);
+static bytea *vault_version_add(bytea *message, uint32 version);
+static bytea *vault_version_strip(bytea *data, uint32 *version);
+static void vault_uint32_write(char *ptr, uint32 value);
+static uint32 vault_uint32_read(const char *ptr);
+static Datum vault_pgp_call(FunctionCallInfo fcinfo, PGFunction fn, bool handle);
+static Datum vault_pgp_call_many(FunctionCallInfo fcinfo, PGFunction fn, bool handle);
+static Datum vault_pgp_call_derived(FunctionCallInfo fcinfo, PGFunction fn);
+static bytea *vault_siv_encrypt(bytea *data, text *id);
+static bytea *vault_siv_decrypt(bytea *data, text *id);
+static bytea *vault_siv_key_part(bytea *key, int part);
+static bytea *vault_siv_mac(bytea *data, bytea *mackey);
+static void vault_lo_read(LargeObjectDesc *lo, char *buffer, int len, bool eof_ok,
+						  bool *eof);
+static void wipe_varlena(struct varlena *value);
+
+Datum encrypt_text(PG_FUNCTION_ARGS);
+Datum encrypt_bytea(PG_FUNCTION_ARGS);
+Datum decrypt_text(PG_FUNCTION_ARGS);
+Datum decrypt_bytea(PG_FUNCTION_ARGS);
+Datum encrypt_text_handle(PG_FUNCTION_ARGS);
+Datum encrypt_bytea_handle(PG_FUNCTION_ARGS);
+Datum decrypt_text_handle(PG_FUNCTION_ARGS);
+Datum decrypt_bytea_handle(PG_FUNCTION_ARGS);
+Datum encrypt_many(PG_FUNCTION_ARGS);
+Datum decrypt_many(PG_FUNCTION_ARGS);
+Datum encrypt_many_handle(PG_FUNCTION_ARGS);
+Datum decrypt_many_handle(PG_FUNCTION_ARGS);
+Datum encrypt_lo(PG_FUNCTION_ARGS);
+Datum decrypt_lo(PG_FUNCTION_ARGS);
+Datum key_version(PG_FUNCTION_ARGS);
+Datum encrypt_text_derived(PG_FUNCTION_ARGS);
+Datum encrypt_bytea_derived(PG_FUNCTION_ARGS);
+Datum decrypt_text_derived(PG_FUNCTION_ARGS);
+Datum decrypt_bytea_derived(PG_FUNCTION_ARGS);
+Datum encrypt_deterministic(PG_FUNCTION_ARGS);
+Datum decrypt_deterministic_text(PG_FUNCTION_ARGS);
+Datum decrypt_deterministic_bytea(PG_FUNCTION_ARGS);
+Datum blind_index(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(encrypt_text);
+PG_FUNCTION_INFO_V1(encrypt_bytea);
+PG_FUNCTION_INFO_V1(decrypt_text);
+PG_FUNCTION_INFO_V1(decrypt_bytea);
+PG_FUNCTION_INFO_V1(encrypt_text_handle);
+PG_FUNCTION_INFO_V1(encrypt_bytea_handle);
+PG_FUNCTION_INFO_V1(decrypt_text_handle);
+PG_FUNCTION_INFO_V1(decrypt_bytea_handle);
+PG_FUNCTION_INFO_V1(encrypt_many);
+PG_FUNCTION_INFO_V1(decrypt_many);
+PG_FUNCTION_INFO_V1(encrypt_many_handle);
+PG_FUNCTION_INFO_V1(decrypt_many_handle);
+PG_FUNCTION_INFO_V1(encrypt_lo);
+PG_FUNCTION_INFO_V1(decrypt_lo);
+PG_FUNCTION_INFO_V1(key_version);
+PG_FUNCTION_INFO_V1(encrypt_text_derived);
+PG_FUNCTION_INFO_V1(encrypt_bytea_derived);
+PG_FUNCTION_INFO_V1(decrypt_text_derived);
+PG_FUNCTION_INFO_V1(decrypt_bytea_derived);
+PG_FUNCTION_INFO_V1(encrypt_deterministic);
+PG_FUNCTION_INFO_V1(decrypt_deterministic_text);
+PG_FUNCTION_INFO_V1(decrypt_deterministic_bytea);
+PG_FUNCTION_INFO_V1(blind_index);
+
+/*
+ * encrypt text data using a key from the vault (pgp_sym_encrypt)
+ *
+ * - data (TEXT)
+ * - id (TEXT)
+ * - options (TEXT)
+ *
+ * Returns NULL when there's no key with the supplied ID, just like the
+ * original SQL wrapper did (pgp_sym_encrypt is strict).
+ */
+Datum
+encrypt_text(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_encrypt_text_fn, false);
+}
+
+
+/*
+ * encrypt bytea data using a key from the vault (pgp_sym_encrypt_bytea)
+ *
+ * - data (BYTEA)
+ * - id (TEXT)
+ * - options (TEXT)
+ */
+Datum
+encrypt_bytea(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_encrypt_bytea_fn, false);
+}
+
+
+/*
+ * decrypt data into text using a key from the vault (pgp_sym_decrypt)
+ *
+ * - data (BYTEA)
+ * - id (TEXT)
+ * - options (TEXT)
+ */
+Datum
+decrypt_text(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_decrypt_text_fn, false);
+}
+
+
+/*
+ * decrypt data into bytea using a key from the vault (pgp_sym_decrypt_bytea)
+ *
+ * - data (BYTEA)
+ * - id (TEXT)
+ * - options (TEXT)
+ */
+Datum
+decrypt_bytea(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_decrypt_bytea_fn, false);
+}
+
+
+/*
+ * The same functions, but with a key handle (BIGINT) instead of the ID.
+ */
+Datum
+encrypt_text_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_encrypt_text_fn, true);
+}
+
+
+Datum
+encrypt_bytea_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_encrypt_bytea_fn, true);
+}
+
+
+Datum
+decrypt_text_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_decrypt_text_fn, true);
+}
+
+
+Datum
+decrypt_bytea_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call(fcinfo, pgp_sym_decrypt_bytea_fn, true);
+}
+
+
+/*
+ * The same functions, but with a key derived from a master key in the vault
+ * (see derive.c), identified by the ID of the master key and the context.
+ *
+ * - data (TEXT / BYTEA)
+ * - master_id (TEXT)
+ * - context (TEXT)
+ * - options (TEXT)
+ */
+Datum
+encrypt_text_derived(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_derived(fcinfo, pgp_sym_encrypt_text_fn);
+}
+
+
+Datum
+encrypt_bytea_derived(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_derived(fcinfo, pgp_sym_encrypt_bytea_fn);
+}
+
+
+Datum
+decrypt_text_derived(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_derived(fcinfo, pgp_sym_decrypt_text_fn);
+}
+
+
+Datum
+decrypt_bytea_derived(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_derived(fcinfo, pgp_sym_decrypt_bytea_fn);
+}
+
+
+/*
+ * encrypt all elements of a bytea array using a key from the vault
+ * (pgp_sym_encrypt_bytea on each element)
+ *
+ * - data (BYTEA[])
+ * - id (TEXT)
+ * - options (TEXT)
+ *
+ * The key is resolved (and pgcrypto loaded, etc.) only once for the whole
+ * array, and the results are returned as an array of the same shape (NULL
+ * elements stay NULL).
+ */
+Datum
+encrypt_many(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_many(fcinfo, pgp_sym_encrypt_bytea_fn, false);
+}
+
+
+/*
+ * decrypt all elements of a bytea array using a key from the vault
+ * (pgp_sym_decrypt_bytea on each element)
+ *
+ * - data (BYTEA[])
+ * - id (TEXT)
+ * - options (TEXT)
+ */
+Datum
+decrypt_many(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_many(fcinfo, pgp_sym_decrypt_bytea_fn, false);
+}
+
+
+Datum
+encrypt_many_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_many(fcinfo, pgp_sym_encrypt_bytea_fn, true);
+}
+
+
+Datum
+decrypt_many_handle(PG_FUNCTION_ARGS)
+{
+	load_pgcrypto();
+
+	return vault_pgp_call_many(fcinfo, pgp_sym_decrypt_bytea_fn, true);
+}
+
+
+/*
+ * encrypt a large object using a key from the vault, in chunks
+ *
+ * - lo (OID)
+ * - id (TEXT)
+ * - options (TEXT)
+ *
+ * Creates a new large object with the encrypted data (see VAULT_LO_MAGIC
+ * for the format) and returns its OID, or NULL when there's no such key.
+ * Only a single chunk is kept in memory at a time.
+ */
+Datum
+encrypt_lo(PG_FUNCTION_ARGS)
+{
+	Oid				result;
+	const text	   *passphrase;
+	LargeObjectDesc *src,
+				   *dst;
+	bytea		   *chunk;
+	char			nonce[VAULT_LO_NONCE_LEN];
+	uint64			seqno = 0;
+	bool			last = false;
+	uint32			version = 0;
+	MemoryContext	tmpcontext,
+					oldcontext;
+
+	/* older releases don't check privileges in inv_open */
+#if (PG_VERSION_NUM < 110000)
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("encryption of large objects requires PostgreSQL 11 or newer")));
+#endif
+
+	load_pgcrypto();
+
+	if ((passphrase = vault_call_passphrase(fcinfo, 1, false, &version)) == NULL)
+		PG_RETURN_NULL();
+
+	/* before PG12, builds with --disable-strong-random don't have it */
+#if (PG_VERSION_NUM < 120000) && !defined(HAVE_STRONG_RANDOM)
+	if (true)
+#else
+	if (! pg_strong_random(nonce, VAULT_LO_NONCE_LEN))
+#endif
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not generate random nonce")));
+
+	src = inv_open(PG_GETARG_OID(0), INV_READ, CurrentMemoryContext);
+
+	result = inv_create(InvalidOid);
+	dst = inv_open(result, INV_WRITE, CurrentMemoryContext);
+
+	if (version > 1)
+	{
+		char	header[4];
+
+		vault_uint32_write(header, version);
+
+		inv_write(dst, VAULT_LO_MAGIC_VERSION, VAULT_LO_MAGIC_LEN);
+		inv_write(dst, header, 4);
+	}
+	else
+		inv_write(dst, VAULT_LO_MAGIC, VAULT_LO_MAGIC_LEN);
+
+	inv_write(dst, nonce, VAULT_LO_NONCE_LEN);
+
+	chunk = (bytea *) palloc(VARHDRSZ + VAULT_LO_CHUNK_HEADER + VAULT_LO_CHUNK);
+
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "pg_vault large object",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	/*
+	 * A short read means we're at the end. If the size is a multiple of the
+	 * chunk size, the last chunk is empty.
+	 */
+	while (! last)
+	{
+		char   *data = VARDATA(chunk);
+		int		len;
+		int		i;
+		bytea  *message;
+		char	header[4];
+
+		CHECK_FOR_INTERRUPTS();
+
+		len = inv_read(src, data + VAULT_LO_CHUNK_HEADER, VAULT_LO_CHUNK);
+		last = (len < VAULT_LO_CHUNK);
+
+		for (i = 0; i < 8; i++)
+			data[i] = (char) ((seqno >> (8 * (7 - i))) & 0xFF);
+
+		data[8] = last ? 1 : 0;
+
+		memcpy(data + 9, nonce, VAULT_LO_NONCE_LEN);
+
+		SET_VARSIZE(chunk, VARHDRSZ + VAULT_LO_CHUNK_HEADER + len);
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+
+		message = DatumGetByteaPP(DirectFunctionCall3(pgp_sym_encrypt_bytea_fn,
+													  PointerGetDatum(chunk),
+													  PointerGetDatum(passphrase),
+													  PG_GETARG_DATUM(2)));
+
+		MemoryContextSwitchTo(oldcontext);
+
+		len = VARSIZE_ANY_EXHDR(message);
+
+		vault_uint32_write(header, (uint32) len);
+
+		inv_write(dst, header, 4);
+		inv_write(dst, VARDATA_ANY(message), len);
+
+		MemoryContextReset(tmpcontext);
+
+		seqno++;
+	}
+
+	MemoryContextDelete(tmpcontext);
+
+	inv_close(src);
+	inv_close(dst);
+
+	wipe_varlena(chunk);
+
+	PG_RETURN_OID(result);
+}
+
+
+/*
+ * decrypt a large object encrypted by pg_vault_encrypt_lo, in chunks
+ *
+ * - lo (OID)
+ * - id (TEXT)
+ * - options (TEXT)
+ *
+ * Creates a new large object with the decrypted data and returns its OID,
+ * or NULL when there's no such key.
+ */
+Datum
+decrypt_lo(PG_FUNCTION_ARGS)
+{
+	Oid				result;
+	const text	   *passphrase;
+	LargeObjectDesc *src,
+				   *dst;
+	bytea		   *message;
+	char			magic[VAULT_LO_MAGIC_LEN];
+	char			nonce[VAULT_LO_NONCE_LEN];
+	uint64			seqno = 0;
+	bool			last = false;
+	bool			eof;
+	uint32			version = 1;
+	MemoryContext	tmpcontext,
+					oldcontext;
+
+	/* older releases don't check privileges in inv_open */
+#if (PG_VERSION_NUM < 110000)
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("encryption of large objects requires PostgreSQL 11 or newer")));
+#endif
+
+	load_pgcrypto();
+
+	src = inv_open(PG_GETARG_OID(0), INV_READ, CurrentMemoryContext);
+
+	vault_lo_read(src, magic, VAULT_LO_MAGIC_LEN, false, &eof);
+
+	if (memcmp(magic, VAULT_LO_MAGIC_VERSION, VAULT_LO_MAGIC_LEN) == 0)
+	{
+		char	header[4];
+
+		vault_lo_read(src, header, 4, false, &eof);
+		version = vault_uint32_read(header);
+	}
+	else if (memcmp(magic, VAULT_LO_MAGIC, VAULT_LO_MAGIC_LEN) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("large object %u was not encrypted by pg_vault_encrypt_lo",
+						PG_GETARG_OID(0))));
+
+	vault_lo_read(src, nonce, VAULT_LO_NONCE_LEN, false, &eof);
+
+	/* the version of the key the large object was encrypted with */
+	if ((passphrase = vault_call_passphrase(fcinfo, 1, false, &version)) == NULL)
+	{
+		inv_close(src);
+		PG_RETURN_NULL();
+	}
+
+	result = inv_create(InvalidOid);
+	dst = inv_open(result, INV_WRITE, CurrentMemoryContext);
+
+	message = (bytea *) palloc(VARHDRSZ + VAULT_LO_MAX_MESSAGE);
+
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "pg_vault large object",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	while (true)
+	{
+		unsigned char	header[4];
+		uint32			len;
+		uint64			chunk_seqno = 0;
+		int				i;
+		bytea		   *chunk;
+		char		   *data;
+
+		CHECK_FOR_INTERRUPTS();
+
+		vault_lo_read(src, (char *) header, 4, last, &eof);
+
+		/* the data has to end right after the last chunk */
+		if (eof)
+			break;
+
+		if (last)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("unexpected data after the last chunk")));
+
+		len = vault_uint32_read((char *) header);
+
+		if (len > VAULT_LO_MAX_MESSAGE)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid length of encrypted chunk (%u)", len)));
+
+		vault_lo_read(src, VARDATA(message), len, false, &eof);
+		SET_VARSIZE(message, VARHDRSZ + len);
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+
+		chunk = DatumGetByteaPP(DirectFunctionCall3(pgp_sym_decrypt_bytea_fn,
+													PointerGetDatum(message),
+													PointerGetDatum(passphrase),
+													PG_GETARG_DATUM(2)));
+
+		MemoryContextSwitchTo(oldcontext);
+
+		data = VARDATA_ANY(chunk);
+
+		if (VARSIZE_ANY_EXHDR(chunk) < VAULT_LO_CHUNK_HEADER)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("invalid encrypted chunk (too short)")));
+
+		for (i = 0; i < 8; i++)
+			chunk_seqno = (chunk_seqno << 8) | (unsigned char) data[i];
+
+		if (chunk_seqno != seqno)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("unexpected encrypted chunk (expected %lu, found %lu)",
+							(unsigned long) seqno, (unsigned long) chunk_seqno)));
+
+		/* the chunk has to come from this large object */
+		if (memcmp(data + 9, nonce, VAULT_LO_NONCE_LEN) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("encrypted chunk does not belong to the large object")));
+
+		last = (data[8] != 0);
+
+		inv_write(dst, data + VAULT_LO_CHUNK_HEADER,
+				  VARSIZE_ANY_EXHDR(chunk) - VAULT_LO_CHUNK_HEADER);
+
+		wipe_varlena((struct varlena *) chunk);
+		MemoryContextReset(tmpcontext);
+
+		seqno++;
+	}
+
+	if (! last)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("encrypted large object is truncated")));
+
+	MemoryContextDelete(tmpcontext);
+
+	inv_close(src);
+	inv_close(dst);
+
+	PG_RETURN_OID(result);
+}
+
+
+/*
+ * version of the key the data was encrypted with
+ *
+ * - data (BYTEA)
+ *
+ * Data encrypted before the key was rotated is version 1. Allows finding the
+ * rows to re-encrypt with the current version of the key.
+ */
+Datum
+key_version(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32((int32) vault_version_get(PG_GETARG_BYTEA_PP(0)));
+}
+
+
+/*
+ * encrypt data deterministically using a key from the vault (the same data
+ * always gives the same result, see VAULT_SIV_LENGTH)
+ *
+ * - data (TEXT / BYTEA)
+ * - id (TEXT)
+ *
+ * Used for both text and bytea data (the bytes are the same). Returns NULL
+ * when there's no key with the supplied ID.
+ */
+Datum
+encrypt_deterministic(PG_FUNCTION_ARGS)
+{
+	bytea  *result = vault_siv_encrypt(PG_GETARG_BYTEA_PP(0), PG_GETARG_TEXT_PP(1));
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+
+/*
+ * decrypt data encrypted by pg_vault_encrypt_deterministic into text
+ *
+ * - data (BYTEA)
+ * - id (TEXT)
+ */
+Datum
+decrypt_deterministic_text(PG_FUNCTION_ARGS)
+{
+	bytea  *result = vault_siv_decrypt(PG_GETARG_BYTEA_PP(0), PG_GETARG_TEXT_PP(1));
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+
+	/* the data might have been encrypted as bytea */
+	pg_verifymbstr(VARDATA(result), VARSIZE(result) - VARHDRSZ, false);
+
+	PG_RETURN_TEXT_P((text *) result);
+}
+
+
+/*
+ * decrypt data encrypted by pg_vault_encrypt_deterministic into bytea
+ *
+ * - data (BYTEA)
+ * - id (TEXT)
+ */
+Datum
+decrypt_deterministic_bytea(PG_FUNCTION_ARGS)
+{
+	bytea  *result = vault_siv_decrypt(PG_GETARG_BYTEA_PP(0), PG_GETARG_TEXT_PP(1));
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+
+/*
+ * keyed blind index of the data (HMAC-SHA256), using a key from the vault
+ *
+ * - data (TEXT / BYTEA)
+ * - id (TEXT)
+ *
+ * The key for the index is derived from the current version of the key, so
+ * after rotating the key, the index has to be rebuilt. Returns NULL when
+ * there's no key with the supplied ID.
+ */
+Datum
+blind_index(PG_FUNCTION_ARGS)
+{
+	bytea  *key;
+	bytea  *result;
+	uint32	version = 0;
+
+	key = vault_derive_key(text_to_cstring(PG_GETARG_TEXT_PP(1)),
+						   cstring_to_text(VAULT_BLIND_CONTEXT), &version);
+
+	if (key == NULL)
+		PG_RETURN_NULL();
+
+	result = vault_hmac(PG_GETARG_BYTEA_PP(0), key);
+
+	wipe_varlena((struct varlena *) key);
+	pfree(key);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+
+/*
+ * read exactly len bytes from a large object
+ *
+ * With eof_ok, we may also hit the end of the object before reading any
+ * data (which is reported in eof). Anything else is an error.
+ */
+static void
+vault_lo_read(LargeObjectDesc *lo, char *buffer, int len, bool eof_ok, bool *eof)
+{
+	int		nread = inv_read(lo, buffer, len);
+
+	*eof = (nread == 0) && (len > 0);
+
+	if ((nread == len) || (*eof && eof_ok))
+		return;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("encrypted large object is truncated")));
+}
+
+
+/*
+ * passphrase for the key identified by the argument (ID or handle)
+ *
+ * Returns the passphrase cached for the call site (valid until the end of
+ * the call, not to be modified), or NULL when there's no such key. So for
+ * calls with the same key there's no copying at all.
+ *
+ * The version requests a particular version of the key (0 - the current
+ * one), and the version of the key is set. A handle references a single
+ * version of the key, so it can't be used for data encrypted with other
+ * versions.
+ */
+static const text *
+vault_call_passphrase(FunctionCallInfo fcinfo, int argno, bool handle,
+					  uint32 *version)
+{
+	const text *passphrase;
+	uint32		requested = *version;
+
+	/* the same key as in the previous call in this statement */
+	if (vault_fn_cache_get(fcinfo, argno, handle, version,
+						   (const struct varlena **) &passphrase))
+		return passphrase;
+
+	if (handle)
+	{
+		text   *copy;
+
+		*version = 0;
+		copy = vault_get_passphrase_handle_version(PG_GETARG_INT64(argno), version);
+
+		if ((copy != NULL) && (requested != 0) && (*version != requested))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("data encrypted with version %u of the key, but the handle references version %u",
+							requested, *version),
+					 errhint("Use the key ID to decrypt data encrypted with other versions of the key.")));
+
+		passphrase = (const text *) vault_fn_cache_set(fcinfo, argno, true, *version,
+													   (struct varlena *) copy);
+
+		if (copy != NULL)
+			wipe_varlena((struct varlena *) copy);
+	}
+	else
+	{
+		passphrase = vault_passphrase(PG_GETARG_TEXT_PP(argno), version);
+
+		passphrase = (const text *) vault_fn_cache_set(fcinfo, argno, false, *version,
+													   (struct varlena *) passphrase);
+	}
+
+	return passphrase;
+}
+
+
+/*
+ * call the pgcrypto function with (data, passphrase, options), using the
+ * passphrase for the key identified by the second argument (ID or handle)
+ *
+ * The encryption uses the current version of the key (and adds the version
+ * to the result), the decryption uses the version from the data. Returns
+ * NULL when there's no such key (or version of the key).
+ */
+static Datum
+vault_pgp_call(FunctionCallInfo fcinfo, PGFunction fn, bool handle)
+{
+	Datum	result;
+	Datum	data = PG_GETARG_DATUM(0);
+	const text *passphrase;
+	uint32	version = 0;
+	bool	encrypt = vault_pgp_encrypts(fn);
+
+	if (! encrypt)
+		data = PointerGetDatum(vault_version_strip(PG_GETARG_BYTEA_PP(0), &version));
+
+	passphrase = vault_call_passphrase(fcinfo, 1, handle, &version);
+
+	if (passphrase == NULL)
+		PG_RETURN_NULL();
+
+	result = DirectFunctionCall3(fn,
+								 data,
+								 PointerGetDatum(passphrase),
+								 PG_GETARG_DATUM(2));
+
+	if (encrypt)
+		result = PointerGetDatum(vault_version_add(DatumGetByteaPP(result), version));
+
+	PG_RETURN_DATUM(result);
+}
+
+
+/*
+ * call the pgcrypto function (on bytea) for each element of the array in
+ * the first argument, with the same passphrase and options
+ *
+ * Each call runs in a temporary memory context (reset after each element),
+ * so that we don't accumulate the pgcrypto allocations for large arrays.
+ * Returns NULL when there's no such key. When decrypting, the elements may
+ * be encrypted with different versions of the key - elements with a version
+ * that is not in the vault anymore are NULL.
+ */
+static Datum
+vault_pgp_call_many(FunctionCallInfo fcinfo, PGFunction fn, bool handle)
+{
+	ArrayType	   *array = PG_GETARG_ARRAYTYPE_P(0);
+	Datum		   *elems;
+	bool		   *nulls;
+	int				nelems;
+	int				i;
+	const text	   *passphrase;
+	uint32			version = 0;
+	bool			encrypt = vault_pgp_encrypts(fn);
+	ArrayType	   *result;
+	MemoryContext	tmpcontext,
+					oldcontext;
+
+	if ((passphrase = vault_call_passphrase(fcinfo, 1, handle, &version)) == NULL)
+		PG_RETURN_NULL();
+
+	deconstruct_array(array, BYTEAOID, -1, false, 'i',
+					  &elems, &nulls, &nelems);
+
+	tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "pg_vault bulk crypto",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	for (i = 0; i < nelems; i++)
+	{
+		bytea  *value;
+
+		if (nulls[i])
+			continue;
+
+		CHECK_FOR_INTERRUPTS();
+
+		oldcontext = MemoryContextSwitchTo(tmpcontext);
+
+		if (encrypt)
+		{
+			value = DatumGetByteaPP(DirectFunctionCall3(fn,
+														elems[i],
+														PointerGetDatum(passphrase),
+														PG_GETARG_DATUM(2)));
+
+			value = vault_version_add(value, version);
+		}
+		else
+		{
+			uint32	elem_version;
+			bytea  *message;
+
+			message = vault_version_strip(DatumGetByteaPP(elems[i]), &elem_version);
+
+			/* a different version than the previous element */
+			if (elem_version != version)
+			{
+				version = elem_version;
+				passphrase = vault_call_passphrase(fcinfo, 1, handle, &version);
+			}
+
+			if (passphrase == NULL)
+			{
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(tmpcontext);
+
+				nulls[i] = true;
+				continue;
+			}
+
+			value = DatumGetByteaPP(DirectFunctionCall3(fn,
+														PointerGetDatum(message),
+														PointerGetDatum(passphrase),
+														PG_GETARG_DATUM(2)));
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+
+		/* copy the result out of the temporary context (it may be plaintext) */
+		elems[i] = PointerGetDatum(palloc(VARSIZE_ANY(value)));
+		memcpy(DatumGetPointer(elems[i]), value, VARSIZE_ANY(value));
+
+		wipe_varlena((struct varlena *) value);
+
+		MemoryContextReset(tmpcontext);
+	}
+
+	MemoryContextDelete(tmpcontext);
+
+	result = construct_md_array(elems, nulls, ARR_NDIM(array), ARR_DIMS(array),
+								ARR_LBOUND(array), BYTEAOID, -1, false, 'i');
+
+	PG_RETURN_ARRAYTYPE_P(result);
+}
+
+
+/*
+ * call the pgcrypto function with (data, passphrase, options), using the
+ * passphrase for the key derived from the master key (second argument) and
+ * the context (third argument)
+ *
+ * The versions work just like in vault_pgp_call, except that it's the
+ * version of the master key. The derived keys are cached in the backend
+ * (see derive.c), so there's no per-call-site cache - the context is likely
+ * different for each row anyway.
+ */
+static Datum
+vault_pgp_call_derived(FunctionCallInfo fcinfo, PGFunction fn)
+{
+	Datum	result;
+	Datum	data = PG_GETARG_DATUM(0);
+	text   *passphrase;
+	uint32	version = 0;
+	bool	encrypt = vault_pgp_encrypts(fn);
+
+	if (! encrypt)
+		data = PointerGetDatum(vault_version_strip(PG_GETARG_BYTEA_PP(0), &version));
+
+	passphrase = vault_derive_passphrase(text_to_cstring(PG_GETARG_TEXT_PP(1)),
+										 PG_GETARG_TEXT_PP(2), &version);
+
+	if (passphrase == NULL)
+		PG_RETURN_NULL();
+
+	result = DirectFunctionCall3(fn,
+								 data,
+								 PointerGetDatum(passphrase),
+								 PG_GETARG_DATUM(3));
+
+	wipe_varlena((struct varlena *) passphrase);
+	pfree(passphrase);
+
+	if (encrypt)
+		result = PointerGetDatum(vault_version_add(DatumGetByteaPP(result), version));
+
+	PG_RETURN_DATUM(result);
+}
+
+
+/*
+ * encrypt the data deterministically with the current version of the key
+ * (see VAULT_SIV_LENGTH for the format), or return NULL if there's no key
+ */
+static bytea *
+vault_siv_encrypt(bytea *data, text *id)
+{
+	bytea	   *key;
+	bytea	   *mackey;
+	bytea	   *enckey;
+	bytea	   *iv;
+	bytea	   *encrypted;
+	bytea	   *result;
+	uint32		version = 0;
+	Size		len;
+
+	key = vault_derive_key(text_to_cstring(id), cstring_to_text(VAULT_SIV_CONTEXT),
+						   &version);
+
+	if (key == NULL)
+		return NULL;
+
+	load_pgcrypto();
+
+	mackey = vault_siv_key_part(key, 0);
+	enckey = vault_siv_key_part(key, 1);
+
+	iv = vault_siv_mac(data, mackey);
+
+	encrypted = DatumGetByteaPP(DirectFunctionCall4(pg_encrypt_iv_fn,
+													PointerGetDatum(data),
+													PointerGetDatum(enckey),
+													PointerGetDatum(iv),
+													CStringGetTextDatum(VAULT_SIV_CIPHER)));
+
+	len = VARSIZE_ANY_EXHDR(encrypted);
+
+	result = (bytea *) palloc(VARHDRSZ + VAULT_VERSION_HEADER + VAULT_SIV_LENGTH + len);
+	SET_VARSIZE(result, VARHDRSZ + VAULT_VERSION_HEADER + VAULT_SIV_LENGTH + len);
+
+	VARDATA(result)[0] = VAULT_VERSION_MARKER;
+	vault_uint32_write(VARDATA(result) + 1, version);
+
+	memcpy(VARDATA(result) + VAULT_VERSION_HEADER, VARDATA(iv), VAULT_SIV_LENGTH);
+	memcpy(VARDATA(result) + VAULT_VERSION_HEADER + VAULT_SIV_LENGTH,
+		   VARDATA_ANY(encrypted), len);
+
+	wipe_varlena((struct varlena *) key);
+	wipe_varlena((struct varlena *) mackey);
+	wipe_varlena((struct varlena *) enckey);
+
+	return result;
+}
+
+
+/*
+ * decrypt data encrypted by vault_siv_encrypt, using the version of the key
+ * the data was encrypted with, and check the IV matches the plaintext
+ *
+ * Returns NULL if there's no such key (or version of the key).
+ */
+static bytea *
+vault_siv_decrypt(bytea *data, text *id)
+{
+	bytea	   *key;
+	bytea	   *mackey;
+	bytea	   *enckey;
+	bytea	   *iv;
+	bytea	   *encrypted;
+	bytea	   *result;
+	bytea	   *check;
+	uint32		version;
+	Size		len = VARSIZE_ANY_EXHDR(data);
+
+	if ((len <= VAULT_VERSION_HEADER + VAULT_SIV_LENGTH) ||
+		(((unsigned char *) VARDATA_ANY(data))[0] != VAULT_VERSION_MARKER))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid deterministically encrypted data")));
+
+	version = vault_uint32_read(VARDATA_ANY(data) + 1);
+
+	key = vault_derive_key(text_to_cstring(id), cstring_to_text(VAULT_SIV_CONTEXT),
+						   &version);
+
+	if (key == NULL)
+		return NULL;
+
+	load_pgcrypto();
+
+	mackey = vault_siv_key_part(key, 0);
+	enckey = vault_siv_key_part(key, 1);
+
+	len -= (VAULT_VERSION_HEADER + VAULT_SIV_LENGTH);
+
+	iv = (bytea *) palloc(VARHDRSZ + VAULT_SIV_LENGTH);
+	SET_VARSIZE(iv, VARHDRSZ + VAULT_SIV_LENGTH);
+	memcpy(VARDATA(iv), VARDATA_ANY(data) + VAULT_VERSION_HEADER, VAULT_SIV_LENGTH);
+
+	encrypted = (bytea *) palloc(VARHDRSZ + len);
+	SET_VARSIZE(encrypted, VARHDRSZ + len);
+	memcpy(VARDATA(encrypted),
+		   VARDATA_ANY(data) + VAULT_VERSION_HEADER + VAULT_SIV_LENGTH, len);
+
+	result = DatumGetByteaP(DirectFunctionCall4(pg_decrypt_iv_fn,
+												PointerGetDatum(encrypted),
+												PointerGetDatum(enckey),
+												PointerGetDatum(iv),
+												CStringGetTextDatum(VAULT_SIV_CIPHER)));
+
+	/* the IV is a MAC of the plaintext, so it detects a wrong key too */
+	check = vault_siv_mac(result, mackey);
+
+	wipe_varlena((struct varlena *) key);
+	wipe_varlena((struct varlena *) mackey);
+	wipe_varlena((struct varlena *) enckey);
+
+	if (memcmp(VARDATA(check), VARDATA(iv), VAULT_SIV_LENGTH) != 0)
+	{
+		wipe_varlena((struct varlena *) result);
+
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("wrong key or corrupt data")));
+	}
+
+	return result;
+}
+
+
+/*
+ * part of the key for the deterministic encryption (0 - MAC key, 1 - the
+ * encryption key)
+ */
+static bytea *
+vault_siv_key_part(bytea *key, int part)
+{
+	bytea  *result;
+
+	Assert(VARSIZE_ANY_EXHDR(key) == 2 * VAULT_SIV_KEY_LENGTH);
+
+	result = (bytea *) palloc(VARHDRSZ + VAULT_SIV_KEY_LENGTH);
+	SET_VARSIZE(result, VARHDRSZ + VAULT_SIV_KEY_LENGTH);
+
+	memcpy(VARDATA(result), VARDATA_ANY(key) + part * VAULT_SIV_KEY_LENGTH,
+		   VAULT_SIV_KEY_LENGTH);
+
+	return result;
+}
+
+
+/*
+ * the synthetic IV for the data (truncated HMAC-SHA256 of the plaintext)
+ */
+static bytea *
+vault_siv_mac(bytea *data, bytea *mackey)
+{
+	bytea  *mac = vault_hmac(data, mackey);
+
+	SET_VARSIZE(mac, VARHDRSZ + VAULT_SIV_LENGTH);
+
+	return mac;
+}
+
+
+/*
+ * encrypt arbitrary data with a passphrase (e.g. the wallet)
+ */
+bytea *
+vault_pgp_encrypt(bytea *data, text *passphrase)
+{
+	load_pgcrypto();
+
+	return DatumGetByteaP(DirectFunctionCall2(pgp_sym_encrypt_bytea_fn,
+											  PointerGetDatum(data),
+											  PointerGetDatum(passphrase)));
+}
+
+
+/*
+ * decrypt data encrypted by vault_pgp_encrypt
+ */
+bytea *
+vault_pgp_decrypt(bytea *data, text *passphrase)
+{
+	load_pgcrypto();
+
+	return DatumGetByteaP(DirectFunctionCall2(pgp_sym_decrypt_bytea_fn,
+											  PointerGetDatum(data),
+											  PointerGetDatum(passphrase)));
+}
+
+
+/*
+ * HMAC-SHA256 of the data, keyed by the key (pgcrypto hmac)
+ */
+bytea *
+vault_hmac(bytea *data, bytea *key)
+{
+	load_pgcrypto();
+
+	return DatumGetByteaP(DirectFunctionCall3(pg_hmac_fn,
+											  PointerGetDatum(data),
+											  PointerGetDatum(key),
+											  CStringGetTextDatum("sha256")));
+}
+
+
+/*
+ * lookup the pgcrypto functions (only the first time)
+ *
+ * The functions don't use flinfo, so we can call them using DirectFunctionCall
+ * (they're strict, but the SQL functions calling us are strict too).
+ */
+static void
+load_pgcrypto(void)
+{
+	if (pgp_sym_encrypt_text_fn != NULL)
+		return;
+
+	pgp_sym_encrypt_bytea_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pgp_sym_encrypt_bytea", true, NULL);
+
+	pgp_sym_decrypt_text_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pgp_sym_decrypt_text", true, NULL);
+
+	pgp_sym_decrypt_bytea_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pgp_sym_decrypt_bytea", true, NULL);
+
+	pg_hmac_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pg_hmac", true, NULL);
+
+	pg_encrypt_iv_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pg_encrypt_iv", true, NULL);
+
+	pg_decrypt_iv_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pg_decrypt_iv", true, NULL);
+
+	/* set this one last, as it marks the functions as loaded */
+	pgp_sym_encrypt_text_fn = (PGFunction)
+		load_external_function(PGCRYPTO_LIBRARY, "pgp_sym_encrypt_text", true, NULL);
+}
+
+
+/*
+ * lookup the passphrase for pgcrypto for the key with the given ID (and
+ * version, see vault_borrow_passphrase_version)
+ *
+ * The passphrase is cached along with the key in the backend, so repeated
+ * calls with the same key don't need to build it again. It's borrowed from
+ * the cache (see vault_borrow_passphrase), so the caller must not modify it.
+ *
+ * Note: pgcrypto still runs the S2K key derivation for each message, and
+ * we can't cache the result - with the default S2K modes the derivation
+ * is salted with a random value stored in each message. Use the s2k-mode
+ * option to make the derivation cheaper, if needed.
+ */
+static const text *
+vault_passphrase(text *id, uint32 *version)
+{
+	char   *cid = text_to_cstring(id);
+
+	return vault_borrow_passphrase_version(cid, version);
+}
+
+
+/*
+ * convert the key to a passphrase for pgcrypto
+ *
+ * The SQL wrappers passed the key to pgcrypto as pg_vault_lookup(id)::text,
+ * i.e. the output of byteaout with the default bytea_output = hex. We have
+ * to do the same conversion, otherwise we would not be able to decrypt data
+ * encrypted by the wrappers. We build the hex format explicitly, so that
+ * the passphrase does not depend on the bytea_output of the session (the
+ * result gets cached, so it might be used by other calls too).
+ */
+text *
+vault_key_passphrase(bytea *key)
+{
+	static const char hextbl[] = "0123456789abcdef";
+	unsigned char *src = (unsigned char *) VARDATA_ANY(key);
+	int		len = VARSIZE_ANY_EXHDR(key);
+	text   *passphrase;
+	char   *dst;
+	int		i;
+
+	passphrase = (text *) palloc(VARHDRSZ + 2 + 2 * len);
+	SET_VARSIZE(passphrase, VARHDRSZ + 2 + 2 * len);
+
+	dst = VARDATA(passphrase);
+	*dst++ = '\\';
+	*dst++ = 'x';
+
+	for (i = 0; i < len; i++)
+	{
+		*dst++ = hextbl[(src[i] >> 4) & 0xF];
+		*dst++ = hextbl[src[i] & 0xF];
+	}
+
+	return passphrase;
+}
+
+
+/*
+ * is the pgcrypto function an encryption (i.e. uses the current version of
+ * the key, and the result gets the version)?
+ */
+static bool
+vault_pgp_encrypts(PGFunction fn)
+{
+	return (fn == pgp_sym_encrypt_text_fn) || (fn == pgp_sym_encrypt_bytea_fn);
+}
+
+
+/*
+ * version of the key the data was encrypted with (see VAULT_VERSION_MARKER)
+ */
+static uint32
+vault_version_get(bytea *data)
+{
+	if ((VARSIZE_ANY_EXHDR(data) >= VAULT_VERSION_HEADER) &&
+		(((unsigned char *) VARDATA_ANY(data))[0] == VAULT_VERSION_MARKER))
+		return vault_uint32_read(VARDATA_ANY(data) + 1);
+
+	return 1;
+}
+
+
+/*
+ * add the version of the key to the encrypted message (for versions other
+ * than the first one, otherwise the message is returned as is)
+ */
+static bytea *
+vault_version_add(bytea *message, uint32 version)
+{
+	bytea  *data;
+	Size	len = VARSIZE_ANY_EXHDR(message);
+
+	if (version <= 1)
+		return message;
+
+	data = (bytea *) palloc(VARHDRSZ + VAULT_VERSION_HEADER + len);
+	SET_VARSIZE(data, VARHDRSZ + VAULT_VERSION_HEADER + len);
+
+	VARDATA(data)[0] = VAULT_VERSION_MARKER;
+	vault_uint32_write(VARDATA(data) + 1, version);
+
+	memcpy(VARDATA(data) + VAULT_VERSION_HEADER, VARDATA_ANY(message), len);
+
+	return data;
+}
+
+
+/*
+ * get the version of the key, and the encrypted message without the version
+ * (a copy, or the data itself when encrypted with the first version)
+ */
+static bytea *
+vault_version_strip(bytea *data, uint32 *version)
+{
+	bytea  *message;
+	Size	len;
+
+	if ((*version = vault_version_get(data)) == 1)
+		return data;
+
+	len = VARSIZE_ANY_EXHDR(data) - VAULT_VERSION_HEADER;
+
+	message = (bytea *) palloc(VARHDRSZ + len);
+	SET_VARSIZE(message, VARHDRSZ + len);
+
+	memcpy(VARDATA(message), VARDATA_ANY(data) + VAULT_VERSION_HEADER, len);
+
+	return message;
+}
+
+
+/* write / read a uint32 value (4B, big endian) */
+static void
+vault_uint32_write(char *ptr, uint32 value)
+{
+	ptr[0] = (char) ((value >> 24) & 0xFF);
+	ptr[1] = (char) ((value >> 16) & 0xFF);
+	ptr[2] = (char) ((value >> 8) & 0xFF);
+	ptr[3] = (char) (value & 0xFF);
+}
+
+
+static uint32
+vault_uint32_read(const char *ptr)
+{
+	const unsigned char *p = (const unsigned char *) ptr;
+
+	return ((uint32) p[0] << 24) | ((uint32) p[1] << 16) |
+		   ((uint32) p[2] << 8) | (uint32) p[3];
+}
+
+
+/*
+ * wipe contents of a varlena value (key, passphrase, ...)
+ */
+static void
+wipe_varlena(struct varlena *value)
+{
+	memset(VARDATA_ANY(value), 0, VARSIZE_ANY_EXHDR(value));
+}
@@ -0,0 +1,402 @@
+/*
+ * derive.c
+ *
+ * Keys derived from a master key in the vault (pg_vault_derive).
+ *
+ * When the keys differ only mechanically (e.g. a separate key for each
+ * tenant), it's not necessary to add all of them to the vault. Instead, a
+ * single master key is added, and the keys are derived from it on demand,
+ * using HKDF (RFC 5869) with SHA-256, and the context (e.g. the tenant ID)
+ * as the "info" parameter. So the vault needs a single item no matter how
+ * many tenants there are, and adding a tenant needs no vault write at all.
+ *
+ * The derivation needs two HMAC calls, so the derived keys are cached in a
+ * small backend-local LRU cache (pg_vault.derive_cache_size entries). Each
+ * entry keeps a copy of the master key it was derived from, and it's used
+ * only while the master key remains the same (it may be deleted and added
+ * again with the same ID).
+ *
+ * The derived keys belong to a version of the master key - rotating the
+ * master key changes all the derived keys. The data encrypted with derived
+ * keys stores the version of the master key (just like with regular keys),
+ * so that it can be decrypted with the matching version.
+ */
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "access/hash.h"
+#include "lib/ilist.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "vault.h"
+
+/* length of the derived keys (the output of SHA-256) */
+#define VAULT_DERIVED_KEY_LENGTH	32
+
+int			pgvault_derive_cache_size = 1024;
+
+/*
+ * The cache is keyed by the master key (ID and version) and hash of the
+ * context. The context itself is stored in the entry, so that a different
+ * context with the same hash is not mistaken for the cached one.
+ */
+typedef struct VaultDeriveKey
+{
+	char		master[MAX_ID_LENGTH];	/* zero-padded ID of the master key */
+	uint32		version;				/* version of the master key */
+	uint32		hash;					/* hash of the context */
+} VaultDeriveKey;
+
+typedef struct VaultDeriveEntry
+{
+	VaultDeriveKey	key;			/* hash key */
+	text		   *context;		/* copy of the context */
+	bytea		   *master;			/* copy of the master key */
+	bytea		   *derived;		/* the derived key */
+	text		   *passphrase;		/* passphrase for pgcrypto (or NULL) */
+	dlist_node		lru_node;		/* position in the LRU list */
+} VaultDeriveEntry;
+
+static HTAB		   *vault_derive_cache = NULL;
+static dlist_head	vault_derive_lru = DLIST_STATIC_INIT(vault_derive_lru);
+static int			vault_derive_nentries = 0;
+
+static struct varlena *vault_derive(const char *master_id, text *context,
+									uint32 *version, bool passphrase);
+static bytea *vault_hkdf(const bytea *master, text *context);
+static void vault_derive_cache_key(VaultDeriveKey *key, const char *master_id,
+								   uint32 version, text *context);
+static VaultDeriveEntry *vault_derive_find(const char *master_id, uint32 version,
+										   const bytea *master, text *context);
+static VaultDeriveEntry *vault_derive_store(const char *master_id, uint32 version,
+											const bytea *master, text *context,
+											bytea *derived);
+static void vault_derive_evict(VaultDeriveEntry *entry);
+static bool vault_varlena_equal(const struct varlena *a, const struct varlena *b);
+static struct varlena *vault_varlena_copy(const struct varlena *value);
+static void vault_varlena_free(struct varlena *value);
+
+Datum derive_key(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(derive_key);
+
+/*
+ * derive a key from a master key in the vault
+ *
+ * - master_id (TEXT)
+ * - context (TEXT)
+ *
+ * Returns the key derived from the current version of the master key, or
+ * NULL if there's no such master key.
+ */
+Datum
+derive_key(PG_FUNCTION_ARGS)
+{
+	bytea	   *key;
+	bytea	   *result;
+	uint32		version = 0;
+
+	key = vault_derive_key(text_to_cstring(PG_GETARG_TEXT_PP(0)),
+						   PG_GETARG_TEXT_PP(1), &version);
+
+	if (key == NULL)
+		PG_RETURN_NULL();
+
+	/* the result has to be a copy, but at least it gets wiped */
+	result = (bytea *) vault_copy_wiped((struct varlena *) key);
+
+	vault_varlena_free((struct varlena *) key);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+
+/*
+ * derive a key from the master key (a particular version, or the current one
+ * for 0, and the version is set), returning a copy the caller should wipe
+ *
+ * Returns NULL when there's no such master key (or version of it).
+ */
+bytea *
+vault_derive_key(const char *master_id, text *context, uint32 *version)
+{
+	return (bytea *) vault_derive(master_id, context, version, false);
+}
+
+
+/*
+ * passphrase for pgcrypto for the derived key (see vault_derive_key), cached
+ * along with the derived key
+ *
+ * The passphrase is the hex encoding of the derived key, built explicitly by
+ * vault_key_passphrase (not by byteaout), so the cached value can't depend
+ * on the bytea_output of the session that happened to build it.
+ */
+text *
+vault_derive_passphrase(const char *master_id, text *context, uint32 *version)
+{
+	return (text *) vault_derive(master_id, context, version, true);
+}
+
+
+/*
+ * lookup the derived key (or its passphrase) in the cache, or derive it from
+ * the master key and cache it
+ */
+static struct varlena *
+vault_derive(const char *master_id, text *context, uint32 *version, bool passphrase)
+{
+	const bytea	   *master;
+	bytea		   *derived;
+	struct varlena *result;
+	VaultDeriveEntry *entry;
+
+	if ((master = vault_borrow_key_version(master_id, version)) == NULL)
+		return NULL;
+
+	if ((entry = vault_derive_find(master_id, *version, master, context)) == NULL)
+	{
+		derived = vault_hkdf(master, context);
+
+		entry = vault_derive_store(master_id, *version, master, context, derived);
+
+		/* the cache is disabled, so just use the derived key */
+		if (entry == NULL)
+		{
+			if (! passphrase)
+				return (struct varlena *) derived;
+
+			result = (struct varlena *) vault_key_passphrase(derived);
+
+			vault_varlena_free((struct varlena *) derived);
+
+			return result;
+		}
+
+		vault_varlena_free((struct varlena *) derived);
+	}
+
+	if (! passphrase)
+		return vault_varlena_copy((struct varlena *) entry->derived);
+
+	/* build the passphrase on first use (independent of bytea_output) */
+	if (entry->passphrase == NULL)
+	{
+		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		entry->passphrase = vault_key_passphrase(entry->derived);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return vault_varlena_copy((struct varlena *) entry->passphrase);
+}
+
+
+/*
+ * derive the key using HKDF-SHA256 from the master key, with the context
+ * as the "info" (and no salt)
+ *
+ * The derived key has the length of the hash, so the expansion needs just
+ * a single block, i.e. HMAC(PRK, info | 0x01).
+ */
+static bytea *
+vault_hkdf(const bytea *master, text *context)
+{
+	bytea	   *salt;
+	bytea	   *prk;
+	bytea	   *info;
+	bytea	   *derived;
+	Size		len = VARSIZE_ANY_EXHDR(context);
+
+	/* HKDF-Extract, the default salt is a string of zeros (of hash length) */
+	salt = (bytea *) palloc0(VARHDRSZ + VAULT_DERIVED_KEY_LENGTH);
+	SET_VARSIZE(salt, VARHDRSZ + VAULT_DERIVED_KEY_LENGTH);
+
+	prk = vault_hmac((bytea *) master, salt);
+
+	/* HKDF-Expand */
+	info = (bytea *) palloc(VARHDRSZ + len + 1);
+	SET_VARSIZE(info, VARHDRSZ + len + 1);
+
+	memcpy(VARDATA(info), VARDATA_ANY(context), len);
+	VARDATA(info)[len] = 0x01;
+
+	derived = vault_hmac(info, prk);
+
+	vault_varlena_free((struct varlena *) prk);
+
+	pfree(info);
+	pfree(salt);
+
+	return derived;
+}
+
+
+/*
+ * build the hash key for the backend-local cache
+ */
+static void
+vault_derive_cache_key(VaultDeriveKey *key, const char *master_id, uint32 version,
+					   text *context)
+{
+	memset(key, 0, sizeof(VaultDeriveKey));
+	strlcpy(key->master, master_id, MAX_ID_LENGTH);
+
+	key->version = version;
+	key->hash = DatumGetUInt32(hash_any((unsigned char *) VARDATA_ANY(context),
+										VARSIZE_ANY_EXHDR(context)));
+}
+
+
+/*
+ * find the derived key in the backend-local cache (or NULL)
+ *
+ * The entry is discarded if it's for a different context (with the same
+ * hash), or when derived from a different master key.
+ */
+static VaultDeriveEntry *
+vault_derive_find(const char *master_id, uint32 version, const bytea *master,
+				  text *context)
+{
+	VaultDeriveKey		key;
+	VaultDeriveEntry   *entry;
+
+	if (vault_derive_cache == NULL)
+		return NULL;
+
+	vault_derive_cache_key(&key, master_id, version, context);
+
+	entry = (VaultDeriveEntry *) hash_search(vault_derive_cache, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+		return NULL;
+
+	if (! vault_varlena_equal((struct varlena *) entry->context, (struct varlena *) context) ||
+		! vault_varlena_equal((struct varlena *) entry->master, (struct varlena *) master))
+	{
+		vault_derive_evict(entry);
+		return NULL;
+	}
+
+	/* move the entry to the head of the LRU list */
+	dlist_move_head(&vault_derive_lru, &entry->lru_node);
+
+	return entry;
+}
+
+
+/*
+ * store the derived key in the backend-local cache (evicting the least
+ * recently used entry if the cache is full)
+ *
+ * Returns the new cache entry, or NULL if the cache is disabled.
+ */
+static VaultDeriveEntry *
+vault_derive_store(const char *master_id, uint32 version, const bytea *master,
+				   text *context, bytea *derived)
+{
+	VaultDeriveKey		key;
+	VaultDeriveEntry   *entry;
+	MemoryContext		oldcontext;
+	bool				found;
+
+	if (pgvault_derive_cache_size <= 0)
+		return NULL;
+
+	if (vault_derive_cache == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(VaultDeriveKey);
+		ctl.entrysize = sizeof(VaultDeriveEntry);
+
+		vault_derive_cache = hash_create("pg_vault derived keys",
+										 pgvault_derive_cache_size, &ctl,
+										 HASH_ELEM | HASH_BLOBS);
+	}
+
+	/* make space for the new entry (the GUC might have been decreased) */
+	while (vault_derive_nentries >= pgvault_derive_cache_size)
+	{
+		VaultDeriveEntry *victim = dlist_container(VaultDeriveEntry, lru_node,
+												   dlist_tail_node(&vault_derive_lru));
+
+		vault_derive_evict(victim);
+	}
+
+	vault_derive_cache_key(&key, master_id, version, context);
+
+	/* we only get here after a miss, which evicts the entry for the key */
+	entry = (VaultDeriveEntry *) hash_search(vault_derive_cache, &key, HASH_ENTER, &found);
+
+	Assert(! found);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	entry->context = (text *) vault_varlena_copy((struct varlena *) context);
+	entry->master = (bytea *) vault_varlena_copy((struct varlena *) master);
+	entry->derived = (bytea *) vault_varlena_copy((struct varlena *) derived);
+	entry->passphrase = NULL;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	dlist_push_head(&vault_derive_lru, &entry->lru_node);
+	vault_derive_nentries++;
+
+	return entry;
+}
+
+
+/*
+ * remove the entry from the backend-local cache (wiping the keys first)
+ */
+static void
+vault_derive_evict(VaultDeriveEntry *entry)
+{
+	pfree(entry->context);
+
+	vault_varlena_free((struct varlena *) entry->master);
+	vault_varlena_free((struct varlena *) entry->derived);
+
+	if (entry->passphrase != NULL)
+		vault_varlena_free((struct varlena *) entry->passphrase);
+
+	dlist_delete(&entry->lru_node);
+
+	hash_search(vault_derive_cache, &entry->key, HASH_REMOVE, NULL);
+	vault_derive_nentries--;
+}
+
+
+/* are the two varlena values the same? */
+static bool
+vault_varlena_equal(const struct varlena *a, const struct varlena *b)
+{
+	return (VARSIZE_ANY_EXHDR(a) == VARSIZE_ANY_EXHDR(b)) &&
+		   (memcmp(VARDATA_ANY(a), VARDATA_ANY(b), VARSIZE_ANY_EXHDR(a)) == 0);
+}
+
+
+/* copy of the value (in the current memory context) */
+static struct varlena *
+vault_varlena_copy(const struct varlena *value)
+{
+	struct varlena *copy = (struct varlena *) palloc(VARSIZE_ANY(value));
+
+	memcpy(copy, value, VARSIZE_ANY(value));
+
+	return copy;
+}
+
+
+/* wipe and free the value (a key, passphrase, ...) */
+static void
+vault_varlena_free(struct varlena *value)
+{
+	memset(value, 0, VARSIZE_ANY(value));
+	pfree(value);
+}
@@ -0,0 +1,185 @@
+/*
+ * memory.c
+ *
+ * Dedicated memory for the vault storage (pg_vault.dedicated_memory).
+ *
+ * By default the storage is allocated from regular dynamic shared memory,
+ * which may be swapped out (so the keys may end up on disk), and which is
+ * mapped using regular pages. With dedicated memory, the postmaster maps a
+ * separate region at startup (inherited by all the backends), and the DSA
+ * area with the storage is created in place, confined to that region. The
+ * region is
+ *
+ * - locked in memory (mlock), so that it's never swapped out
+ * - excluded from core dumps (MADV_DONTDUMP, where available)
+ * - mapped using huge pages (following huge_pages), to reduce TLB misses
+ * - prefaulted, so that lookups don't hit page faults
+ * - surrounded by inaccessible guard pages, so that an overrun crashes
+ *   instead of reading (or overwriting) the memory next to the keys
+ *
+ * The region is sized by pg_vault.max_size at startup, so in this case
+ * changing max_size requires a restart.
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "storage/pg_shmem.h"
+
+#include "vault.h"
+
+/* huge page size we align the region to (the usual default on x86-64) */
+#define VAULT_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+bool		pgvault_dedicated_memory = false;
+
+/* the region (mapped by the postmaster, inherited by the backends) */
+static char *vault_memory = NULL;
+static Size vault_memory_size = 0;
+
+/* was the region prefaulted in this process? */
+static bool vault_memory_populated = false;
+
+static char *vault_memory_map(Size size, Size align, int flags);
+
+/*
+ * map the dedicated region (called by the postmaster, from shmem startup)
+ *
+ * After a crash restart the region is already mapped, so we just wipe it
+ * (it may still contain keys) and keep using it.
+ */
+void
+vault_memory_init(Size size)
+{
+	Size		pagesize = (Size) sysconf(_SC_PAGESIZE);
+	char	   *ptr = NULL;
+	bool		huge = false;
+
+	if (vault_memory != NULL)
+	{
+		memset(vault_memory, 0, vault_memory_size);
+		return;
+	}
+
+#ifdef EXEC_BACKEND
+	/* the backends would not inherit the mapping */
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("pg_vault.dedicated_memory is not supported on this platform")));
+#endif
+
+#ifdef MAP_HUGETLB
+	if (huge_pages != HUGE_PAGES_OFF)
+	{
+		ptr = vault_memory_map(TYPEALIGN(VAULT_HUGE_PAGE_SIZE, size),
+							   VAULT_HUGE_PAGE_SIZE, MAP_HUGETLB);
+
+		if (ptr != NULL)
+		{
+			size = TYPEALIGN(VAULT_HUGE_PAGE_SIZE, size);
+			huge = true;
+		}
+		else if (huge_pages == HUGE_PAGES_ON)
+			ereport(ERROR,
+					(errmsg("could not map pg_vault memory using huge pages: %m"),
+					 errhint("Set huge_pages to \"try\", or increase the number of huge pages.")));
+	}
+#endif
+
+	if (ptr == NULL)
+	{
+		size = TYPEALIGN(pagesize, size);
+		ptr = vault_memory_map(size, pagesize, 0);
+	}
+
+	if (ptr == NULL)
+		ereport(ERROR,
+				(errmsg("could not map pg_vault memory (%zu bytes): %m", size)));
+
+	/*
+	 * Keep the region out of swap. That also faults it in, so the postmaster
+	 * holds all the pages (the backends still have to populate their page
+	 * tables, see vault_memory_get). Huge pages are never swapped out, but
+	 * we lock them anyway.
+	 */
+	if (mlock(ptr, size) != 0)
+		ereport(ERROR,
+				(errmsg("could not lock pg_vault memory (%zu bytes): %m", size),
+				 errhint("Increase the limit on locked memory (RLIMIT_MEMLOCK), or disable pg_vault.dedicated_memory.")));
+
+#ifdef MADV_DONTDUMP
+	/* the flag is inherited by the backends, so no keys in core dumps */
+	(void) madvise(ptr, size, MADV_DONTDUMP);
+#endif
+
+	vault_memory = ptr;
+	vault_memory_size = size;
+
+	elog(DEBUG1, "pg_vault dedicated memory mapped (%zu bytes, huge pages %s)",
+		 size, (huge) ? "on" : "off");
+}
+
+
+/*
+ * the dedicated region, or NULL when not enabled
+ *
+ * The first call in a backend prefaults the region (if supported), so that
+ * the lookups don't need to populate the page tables one page at a time.
+ */
+void *
+vault_memory_get(Size *size)
+{
+	if (vault_memory == NULL)
+		return NULL;
+
+#ifdef MADV_POPULATE_WRITE
+	if (! vault_memory_populated)
+		(void) madvise(vault_memory, vault_memory_size, MADV_POPULATE_WRITE);
+#endif
+
+	vault_memory_populated = true;
+
+	*size = vault_memory_size;
+
+	return vault_memory;
+}
+
+
+/*
+ * map a shared region of the given size, aligned and with guard pages
+ *
+ * We reserve a bit more address space than needed (inaccessible), and map
+ * the region in the middle of it, so that there's at least one guard page
+ * on each side. Returns NULL (with errno set) on failure.
+ */
+static char *
+vault_memory_map(Size size, Size align, int flags)
+{
+	Size		pagesize = (Size) sysconf(_SC_PAGESIZE);
+	Size		reserved = size + align + 2 * pagesize;
+	char	   *base;
+	char	   *ptr;
+
+	base = mmap(NULL, reserved, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (base == MAP_FAILED)
+		return NULL;
+
+	ptr = (char *) TYPEALIGN(align, base + pagesize);
+
+	if (mmap(ptr, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED | flags, -1, 0) == MAP_FAILED)
+	{
+		int		save_errno = errno;
+
+		munmap(base, reserved);
+
+		errno = save_errno;
+		return NULL;
+	}
+
+	return ptr;
+}
@@ -1,466 +1,5351 @@
 #include "postgres.h"
 #include "miscadmin.h"
 #include "storage/ipc.h"
+#include "storage/proc.h"
+#include "access/xact.h"
 
 #include "utils/guc.h"
 #include "storage/lwlock.h"
 #include "access/htup_details.h"
+#include "access/hash.h"
+#include "port/atomics.h"
+#include "lib/ilist.h"
 
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/dsa.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "catalog/pg_type.h"
+#include "portability/instr_time.h"
 
 #include "funcapi.h"
 
+#include "vault.h"
+
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
 /* private functions */
+static void pgvault_shmem_request(void);
 static void pgvault_shmem_startup(void);
 
 #define SEGMENT_NAME	"pgvault"
 
-#define	MAX_ID_LENGTH		64
-#define	MAX_COMMENT_LENGTH	255
-#define	MAX_KEY_LENGTH		1024
+static int  pgvault_mem_max_size  = (16*1024);	/* max size of the vault storage (kB) */
+static int  pgvault_cache_size    = 64;			/* number of keys cached in each backend */
+static int  pgvault_max_databases = 64;			/* number of vault partitions */
+static int  pgvault_stripes       = 16;			/* number of stripes in a partition */
 
-static int  pgvault_mem_max_size  = (1024*1024); /* 1MB by default, plenty of space for passwords */
+char	   *pgvault_wallet_path = NULL;				/* location of the wallet file */
 
 /* Saved hook values in case of unload */
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
 void		_PG_init(void);
 void		_PG_fini(void);
 
 /*
- * This is a fixed-length structure, as it makes it easier to allocate and copy.
- * It might be made more space efficient by using regular pointers etc. The other
- * benefit is that this makes the capacity of the vault deterministic.
+ * Expected average size of the item data (key, ID and comment), used to
+ * decide how many items to allocate in the shared segment. Typical keys
+ * (e.g. 32B AES keys with a short ID and no comment) fit into this easily.
+ */
+#define	VAULT_ITEM_AVG_SIZE	48
+
+/*
+ * Initial size of the storage of each stripe. When it gets full, we allocate
+ * a new storage (twice as large) and copy the items into it. The total size
+ * of all the storages is limited by max_size.
+ */
+#define VAULT_INITIAL_SIZE	(8 * 1024)
+
+/* index of the slot of this process among the readers (see VaultReaderData) */
+#if (PG_VERSION_NUM >= 170000)
+#define VaultMyReaderSlot()	(MyProcNumber)
+#else
+#define VaultMyReaderSlot()	(MyProc->pgprocno)
+#endif
+
+/*
+ * A small fixed-length header of an item, with the actual data stored in the
+ * arena (at the end of the shared segment). The data are stored at 'offset'
+ * (which is MAXALIGNed) in this order:
+ *
+ * - key data (bytea, including the varlena header)
+ * - ID of the key (\0-terminated string)
+ * - comment of the key (\0-terminated string, empty when NULL)
+ *
+ * The headers are fixed-length, as it makes it easier to allocate and copy
+ * them, and the index may reference them directly.
+ *
+ * The header only has the fields needed by lookups (matching the ID and the
+ * version, and copying the key), so that it's only 16B and four headers fit
+ * into a cache line. The fields used only by writers, statistics and the
+ * backend worker are in a separate array of VaultItemColdData (with the same
+ * indexes), so that the lookups don't need to pull those into cache. That
+ * also means flushing the usage counters does not invalidate the cache lines
+ * with the headers in other backends.
+ *
+ * A key may have multiple versions (see pg_vault_rotate_key), each one being
+ * a separate item with the same ID. The latest version is the current one,
+ * the older ones are marked as retired - those are used only to decrypt data
+ * encrypted with them, and lookups by ID simply skip them.
+ */
+typedef struct VaultItemData
+{
+	uint32	offset;			/* offset of the item data in the arena */
+	uint32	version;		/* version of the key (1, 2, ...) */
+	uint16	key_len;		/* length of the key (including varlena header) */
+	uint16	id_len;			/* length of the ID (without the \0) */
+	uint16	comment_len;	/* length of the comment (without the \0) */
+	uint16	flags;			/* VAULT_ITEM_* flags */
+} VaultItemData;
+
+/* an older version of the key (not the current one) */
+#define VAULT_ITEM_RETIRED	0x0001
+
+typedef VaultItemData* VaultItem;
+
+/* the rarely used part of the item (see VaultItemData) */
+typedef struct VaultItemColdData
+{
+	pg_atomic_uint32	uses;	/* number of uses (see vault_stats_flush) */
+	uint32	slot;			/* slot of the item (see VaultSlotData) */
+	TimestampTz	expires;	/* expiration of keys from the backend (0 - never) */
+} VaultItemColdData;
+
+typedef VaultItemColdData* VaultItemCold;
+
+/*
+ * Bucket of the hash index on key IDs. The index is an open-addressing hash
+ * table with linear probing, stored right after the item arrays. We keep
+ * the full hash value in the bucket, so that most mismatches are detected
+ * without touching the item (and the ID in the arena) at all.
+ *
+ * The item is stored as (index + 1), so that a zeroed bucket is empty. Each
+ * bucket is also tagged with the epoch of the vault it was filled in, and
+ * buckets from earlier epochs are considered empty too. This way delete_keys
+ * resets the index simply by incrementing the epoch, without touching the
+ * buckets at all (those are zeroed later by the scrubber).
+ */
+typedef struct VaultBucketData
+{
+	uint32	hash;		/* hash of the key ID */
+	uint32	item;		/* index of the item + 1 (0 means empty bucket) */
+	uint32	epoch;		/* epoch of the vault when the bucket was filled */
+} VaultBucketData;
+
+typedef VaultBucketData* VaultBucket;
+
+/*
+ * Slot of an item, referenced by key handles (see pg_vault_key_handle). The
+ * items move around (delete_key moves the last item into the hole), but the
+ * slot stays the same, so the handle is stable while the key exists. Each
+ * time a slot gets assigned to a new key it gets a new tag, so that handles
+ * of deleted keys can be detected. Free slots are linked into a list.
+ *
+ * Only slots below nslots are in use (or free), so delete_keys resets the
+ * slots simply by resetting nslots, and the tags are never reused as the
+ * counter is not reset (it's carried over to the new storage too).
+ */
+typedef struct VaultSlotData
+{
+	uint32	item;		/* index of the item + 1 (0 means free slot) */
+	uint32	tag;		/* tag of the slot (changes whenever assigned) */
+	uint32	next;		/* next free slot + 1 (0 means end of the list) */
+} VaultSlotData;
+
+typedef VaultSlotData* VaultSlot;
+
+/*
+ * The items are also kept in an ordered index - an array of item indexes,
+ * sorted by the key ID (and version), for listing and deleting keys with a
+ * given prefix (see pg_vault_list_keys). The first nitems entries are valid,
+ * so delete_keys resets it simply by resetting nitems. IDs are compared
+ * byte by byte (i.e. the "C" collation).
+ *
+ * The index is used only while holding the locks, lock-free readers never
+ * look at it. Adding keys merges the new items into the index, deleting a
+ * key has to shift the rest of the array, but that's just a memmove of a
+ * much smaller array than the items.
+ */
+
+/*
+ * A key handle is a 64-bit value, with the stripe, slot and the tag. It's
+ * valid only in the database it was obtained in, and until a restart.
+ */
+#define VaultHandleMake(stripe, slot, tag) 	((int64) (((uint64) (stripe) << 56) | ((uint64) (slot) << 32) | (uint64) (tag)))
+#define VaultHandleStripe(handle)	((int) (((uint64) (handle) >> 56) & 0x7F))
+#define VaultHandleSlot(handle)		((uint32) (((uint64) (handle) >> 32) & 0xFFFFFF))
+#define VaultHandleTag(handle)		((uint32) ((uint64) (handle) & 0xFFFFFFFF))
+
+/* is the bucket empty (never used, or filled before the last delete_keys) */
+#define VaultBucketIsEmpty(vault, bucket) \
+	(((bucket)->item == 0) || ((bucket)->epoch != (vault)->epoch))
+
+/*
+ * A stripe of a partition, with keys whose IDs hash to it. Each stripe has
+ * its own lock and storage (with an index), so that writes to one key don't
+ * block access to keys in other stripes.
+ */
+typedef struct VaultStripeData {
+
+	LWLock		   *lock;		/* LWLock guarding the stripe (pg_vault tranche) */
+
+	/*
+	 * Incremented before and after every change of the stripe contents (so
+	 * it's odd while the change is in progress). It serves two purposes -
+	 * readers use it as a sequence lock, to search the stripe without taking
+	 * the LWLock at all (retrying if the stripe changed in the meantime), and
+	 * backends use it to cheaply check that keys in their local cache are
+	 * still valid. Replacing the storage is a change too.
+	 */
+	pg_atomic_uint32	generation;
+
+	/*
+	 * The current storage (an atomic, so that lock-free readers don't see
+	 * a torn value). Set before the partition gets assigned to a database.
+	 */
+	pg_atomic_uint64	storage;
+
+	/*
+	 * storages replaced by larger ones, to be freed once no reader can be
+	 * looking at them (the latest one, linked to the older ones)
+	 */
+	dsa_pointer		retired;
+
+	/*
+	 * number of keys cached from the external backend (i.e. with expiration),
+	 * so that vault_expire_keys can skip the stripe without locking it
+	 */
+	pg_atomic_uint32	nexpiring;
+
+} VaultStripeData;
+
+typedef VaultStripeData* VaultStripe;
+
+/*
+ * Usage statistics of a partition (see pg_vault_stats). Backends accumulate
+ * the counters locally, and only add them to these shared counters once in
+ * a while (see vault_stats_flush), so that lookups don't contend on them.
+ */
+typedef struct VaultStatsData {
+
+	pg_atomic_uint64	lookups;		/* number of key lookups */
+	pg_atomic_uint64	misses;			/* lookups of keys not in the vault */
+	pg_atomic_uint64	cache_hits;		/* lookups served by the backend cache */
+	pg_atomic_uint64	adds;			/* number of keys added */
+	pg_atomic_uint64	deletes;		/* number of keys deleted */
+	pg_atomic_uint64	lock_waits;		/* lock acquisitions that had to wait */
+	pg_atomic_uint64	lock_wait_time;	/* time spent waiting for locks (us) */
+
+} VaultStatsData;
+
+/*
+ * A partition of the vault, with keys of a single database, split into
+ * stripes (pg_vault.stripes). Databases do not interfere with each other
+ * at all. Partitions are assigned to databases on first use, and stay
+ * assigned until a restart.
+ */
+typedef struct VaultPartitionData {
+
+	Oid				dbid;		/* database (InvalidOid - unassigned) */
+
+	VaultStatsData	stats;		/* usage statistics */
+
+	VaultStripeData	stripes[FLEXIBLE_ARRAY_MEMBER];
+
+} VaultPartitionData;
+
+typedef VaultPartitionData* VaultPartition;
+
+/*
+ * The fixed part of the vault, in the main shared memory segment (followed
+ * by the partitions). The items themselves are kept in a storage allocated
+ * from dynamic shared memory (DSA), so that it can grow as needed, without
+ * a restart. The DSA area is created by the first backend using the vault,
+ * and shared by all the partitions.
+ */
+typedef struct VaultControlData {
+
+	LWLock		   *lock;		/* guards the DSA area and partition assignment */
+	int				tranche_id;	/* tranche of the DSA area */
+
+	bool			area_created;	/* was the DSA area created already? */
+	dsa_handle		area;			/* DSA area with the storage */
+
+	Latch		   *scrub_latch;	/* latch of the scrubber (or NULL) */
+
+	/*
+	 * Storages replaced by larger ones may still be read by lock-free
+	 * readers, so they are freed only once all the readers moved on. The
+	 * epoch is incremented whenever a storage gets retired, and readers
+	 * announce the epoch they started reading in (see vault_read_begin) in
+	 * their slot. The slots are allocated in the area, when creating it.
+	 */
+	pg_atomic_uint64	reclaim_epoch;	/* current reclamation epoch */
+	dsa_pointer			readers;		/* reader slots (VaultReaderData) */
+	int					nreaders;		/* number of reader slots */
+
+	int				npartitions;	/* number of partitions */
+	int				nstripes;		/* number of stripes in each partition */
+
+} VaultControlData;
+
+typedef VaultControlData* VaultControl;
+
+/*
+ * Slot of a process reading stripes without the lock, one for each PGPROC.
+ * The epoch is 0 when the process is not reading. Padded to a cache line,
+ * so that the readers don't contend on their slots.
+ */
+typedef union VaultReaderData {
+
+	pg_atomic_uint64	epoch;		/* reclamation epoch (or 0) */
+	char				pad[PG_CACHE_LINE_SIZE];
+
+} VaultReaderData;
+
+typedef VaultReaderData* VaultReader;
+
+/* size of a partition, and of the whole fixed part of the vault */
+#define VaultPartitionSize(nstripes) \
+	MAXALIGN(offsetof(VaultPartitionData, stripes) + (nstripes) * sizeof(VaultStripeData))
+
+#define VaultControlSize(npartitions, nstripes) \
+	(MAXALIGN(sizeof(VaultControlData)) + (npartitions) * VaultPartitionSize(nstripes))
+
+/* the partitions are stored right after the control struct */
+#define VaultGetPartition(control, i) \
+	((VaultPartition) ((char *) (control) + MAXALIGN(sizeof(VaultControlData)) + \
+					   (i) * VaultPartitionSize((control)->nstripes)))
+
+/* storage of the vault items (allocated in DSA) */
+typedef struct VaultInfoData {
+
+	Size			size;		/* size of the storage */
+	int				maxitems;	/* max number of items we can keep */
+	int				nbuckets;	/* number of hash buckets (power of 2) */
+	Size			arena_offset;	/* start of the arena (from the vault) */
+	Size			arena_size;		/* size of the arena */
+
+	/*
+	 * delete_keys does not wipe the memory, it only increments the epoch
+	 * (which invalidates all the hash buckets) and resets the counters. The
+	 * data are wiped later by the scrubber (a background worker), a chunk at
+	 * a time. The range [scrub_offset, scrub_end) of the arena and the
+	 * buckets from scrub_bucket still need to be scrubbed. The scrubber
+	 * never touches the arena below arena_used, as that's live data again.
+	 */
+	uint32			epoch;			/* incremented by delete_keys */
+	Size			scrub_offset;	/* next position in the arena to scrub */
+	Size			scrub_end;		/* end of the arena range to scrub */
+	int				scrub_bucket;	/* next bucket to scrub */
+
+	uint32			last_tag;	/* last tag assigned to a slot */
+
+	/* set when the storage is replaced by a larger one (see vault_reclaim) */
+	uint64			retired_epoch;	/* epoch the storage got retired in */
+	dsa_pointer		retired_next;	/* storage retired before this one */
+
+	/* everything from here is reset by delete_keys */
+	int				nitems;		/* number of items in the vault */
+	Size			arena_used;	/* space allocated from the arena */
+	Size			arena_free;	/* space freed by deleted items (holes) */
+	int				nslots;		/* number of slots used (or free) */
+	int				free_slot;	/* first free slot + 1 (0 means none) */
+
+	/* the arrays (items, cold items, buckets, ...) and the arena follow */
+
+} VaultInfoData;
+
+typedef VaultInfoData*	VaultInfo;
+
+/*
+ * Number of attempts to read the vault without locking before falling back
+ * to the LWLock (e.g. when there's a long-running write in progress).
+ */
+#define VAULT_READ_RETRIES	100
+
+/* how much memory to scrub at once (while holding the lock) */
+#define VAULT_SCRUB_CHUNK	(64 * 1024)
+
+/*
+ * The item headers, the cold parts of the items and the hash index start at
+ * a cache line boundary (relative to the storage, which is allocated as whole
+ * pages), so that a cache line never holds parts of two different arrays.
+ */
+#define VAULT_ITEMS_OFFSET	CACHELINEALIGN(sizeof(VaultInfoData))
+
+#define VaultColdOffset(maxitems) \
+	CACHELINEALIGN(VAULT_ITEMS_OFFSET + (maxitems) * sizeof(VaultItemData))
+
+#define VaultBucketsOffset(maxitems) \
+	CACHELINEALIGN(VaultColdOffset(maxitems) + (maxitems) * sizeof(VaultItemColdData))
+
+/* the item headers are stored right after the storage header */
+#define VaultItems(vault) \
+	((VaultItem)((char*)(vault) + VAULT_ITEMS_OFFSET))
+
+/* the cold parts of the items are stored after the headers */
+#define VaultColdItems(vault) \
+	((VaultItemCold)((char*)(vault) + VaultColdOffset((vault)->maxitems)))
+
+/* the cold part of the item with the given index */
+#define VaultItemGetCold(vault, index)	(&VaultColdItems(vault)[index])
+
+/* the hash index is stored after the cold parts of the items */
+#define VaultBuckets(vault) \
+	((VaultBucket)((char*)(vault) + VaultBucketsOffset((vault)->maxitems)))
+
+/* the item referenced by a (non-empty) bucket */
+#define VaultBucketItem(vault, bucket) \
+	(&VaultItems(vault)[VaultBuckets(vault)[bucket].item - 1])
+
+/* the slots are stored after the hash index */
+#define VaultSlots(vault) \
+	((VaultSlot)((char*)VaultBuckets(vault) + (vault)->nbuckets * sizeof(VaultBucketData)))
+
+/* the ordered index is stored after the slots */
+#define VaultOrder(vault) \
+	((uint32 *)((char*)VaultSlots(vault) + (vault)->maxitems * sizeof(VaultSlotData)))
+
+/* the arena with item data is stored after the ordered index */
+#define VaultArena(vault)	((char*)(vault) + (vault)->arena_offset)
+
+/* pointers to the item data in the arena */
+#define VaultItemKey(vault, item)		(VaultArena(vault) + (item)->offset)
+#define VaultItemId(vault, item)		(VaultItemKey(vault, item) + (item)->key_len)
+#define VaultItemComment(vault, item)	(VaultItemId(vault, item) + (item)->id_len + 1)
+
+/* space used by the item in the arena */
+#define VaultItemSize(item) \
+	MAXALIGN((Size) (item)->key_len + (item)->id_len + 1 + (item)->comment_len + 1)
+
+/* used to sort items by offset, when compacting the arena */
+typedef struct VaultArenaItem
+{
+	uint32	offset;		/* offset of the item data */
+	int		item;		/* index of the item */
+} VaultArenaItem;
+
+/* pointer to the fixed part of the vault (in the main shared memory) */
+static VaultControl vault_control = NULL;
+
+/* the DSA area with the vault storage (attached on first use) */
+static dsa_area *vault_area = NULL;
+
+/* partition for the current database (assigned on first use) */
+static VaultPartition vault_partition = NULL;
+
+/* stripe of the partition we're working with (see vault_select) */
+static VaultStripe vault_stripe = NULL;
+
+/*
+ * pointer to the current storage of the stripe (it may change whenever we
+ * don't hold the lock, see vault_refresh)
+ */
+static VaultInfo vault_info = NULL;
+
+/* slot announcing the lock-free reads of this process (see vault_read_begin) */
+static pg_atomic_uint64 *vault_reader = NULL;
+
+/* state of a stripe modified by vault_add_keys */
+typedef struct VaultStripeWrite
+{
+	int				nentries;	/* number of new keys in the stripe */
+	Size			space;		/* space needed for the new keys */
+	dsa_pointer		storage;	/* new (larger) storage, if needed */
+	VaultArenaItem *sorted;		/* space for compaction, if needed */
+	uint32		   *added;		/* new items (for the ordered index) */
+} VaultStripeWrite;
+
+/*
+ * buffer for a key read from the vault (it's accessed through the varlena
+ * macros, so it has to be aligned like a varlena)
+ */
+typedef union VaultKeyBuffer
+{
+	char	data[MAX_KEY_LENGTH];
+	int32	align;
+} VaultKeyBuffer;
+
+/* info about a key returned by list_keys (without the key data) */
+typedef struct VaultKeyInfo
+{
+	char   *id;			/* ID of the key */
+	int		length;		/* length of the key data */
+	char   *comment;	/* comment of the key */
+	uint32	uses;		/* number of uses of the key */
+	uint32	version;	/* version of the key */
+} VaultKeyInfo;
+
+/*
+ * Statistics accumulated by this backend, not yet added to the shared
+ * counters of the partition. The uses of individual keys are counted in a
+ * small hash table (keyed by zero-padded key ID, just like the cache), as
+ * the lock-free lookups must not write into the storage.
+ */
+typedef struct VaultStatsCounters
+{
+	uint64	lookups;
+	uint64	misses;
+	uint64	cache_hits;
+	uint64	adds;
+	uint64	deletes;
+	uint64	lock_waits;
+	uint64	lock_wait_time;
+} VaultStatsCounters;
+
+typedef struct VaultStatsKeyEntry
+{
+	char	id[MAX_ID_LENGTH];	/* hash key (zero-padded key ID) */
+	uint32	uses;				/* uses not yet added to the item */
+} VaultStatsKeyEntry;
+
+/* flush the local statistics after this many operations (or used keys) */
+#define VAULT_STATS_BATCH		256
+#define VAULT_STATS_MAX_KEYS	64
+
+static VaultStatsCounters vault_stats_pending;
+static HTAB	   *vault_stats_keys = NULL;
+static int		vault_stats_nops = 0;
+static bool		vault_stats_registered = false;
+
+static bool vault_attach_area(bool create);
+static bool vault_attach(bool create);
+static bool vault_attach_database(Oid dbid, bool create);
+static VaultPartition vault_find_partition(Oid dbid);
+static bool vault_scrub_stripe(void);
+static void vault_reclaim(void);
+static uint64 vault_readers_oldest(void);
+static int vault_stripe_index(uint32 hash);
+static void vault_select(int stripe);
+static void vault_refresh(void);
+static bool vault_lock(int stripe, LWLockMode mode, bool create);
+static bool vault_lock_all(LWLockMode mode, bool create);
+static void vault_unlock_all(void);
+static void vault_acquire(LWLock *lock, LWLockMode mode);
+static void vault_stats_use(const char *id);
+static void vault_stats_done(void);
+static void vault_stats_flush(bool keys);
+static void vault_stats_exit(int code, Datum arg);
+static VaultKeyInfo *vault_list_keys(const char *prefix, int *nkeys);
+static void vault_storage_layout(Size size, int *maxitems, int *nbuckets,
+								 Size *arena_offset);
+static void vault_storage_init(VaultInfo storage, Size size);
+static dsa_pointer vault_storage_alloc(int nitems, Size space);
+static Size vault_size_limit(void);
+static void vault_storage_copy(VaultInfo storage);
+static uint32 vault_hash_id(const char *id);
+static int vault_index_find(const char *id, uint32 hash);
+static int vault_index_find_version(const char *id, uint32 hash, uint32 version);
+static int vault_index_search(const char *id, uint32 hash, bool current, uint32 version);
+static bool vault_item_valid(VaultItem item);
+static void vault_arena_compact(VaultArenaItem *items);
+static int vault_arena_cmp(const void *a, const void *b);
+static int vault_entry_cmp(const void *a, const void *b);
+static bool vault_read_key(const char *id, uint32 hash, char *buffer,
+						   uint32 *version);
+static bytea *vault_lookup(const char *id, uint32 hash, int64 handle,
+						   uint32 *generation, uint32 *version);
+static void vault_read_begin(void);
+static void vault_read_end(void);
+static void vault_write_begin(void);
+static void vault_write_end(void);
+static void vault_index_insert(uint32 hash, int item);
+static void vault_index_delete(int bucket);
+static void vault_index_move(int olditem, int newitem);
+static int vault_order_cmp(VaultItem item, const char *id, int len, uint32 version);
+static int vault_order_item_cmp(const void *a, const void *b);
+static int vault_order_search(const char *id, int len, uint32 version);
+static void vault_order_merge(uint32 *added, int nadded);
+static void vault_order_delete(int item);
+static void vault_order_move(int olditem, int newitem);
+static bool vault_order_prefix(VaultItem item, const char *prefix, int len);
+static void vault_slot_assign(int item);
+static void vault_slot_release(uint32 slot);
+static bool vault_read_handle(int64 handle, char *buffer, uint32 *version);
+static void vault_delete_item(int bucket);
+static bool vault_replace_key(Oid dbid, VaultEntry *entry);
+static void vault_delete_all(void);
+static int vault_delete_prefix(const char *prefix);
+static void vault_secure_adopt(struct varlena *value);
+static void vault_copy_wipe(void *arg);
+
+/*
+ * Backend-local cache of recently used keys.
+ *
+ * Each cached key is valid for a particular generation of its stripe, and
+ * gets discarded whenever the generation counter of the stripe changes. That
+ * makes a cache hit rather cheap - a single atomic read, no locking at all.
+ * Writes to the vault are expected to be rare, so we don't mind discarding
+ * all the cached keys from a modified stripe (even those not modified).
+ *
+ * The cache is bounded by pg_vault.cache_size, and when full we evict the
+ * least recently used key.
+ *
+ * Besides the key itself, we also cache the passphrase derived from it for
+ * pgcrypto (built on first use by the encrypt/decrypt functions), so that
+ * it's not rebuilt for each row.
+ *
+ * Only the current version of a key is cached. The older versions are used
+ * only to decrypt data not re-encrypted yet, so those are looked up in the
+ * vault every time (the lookup is still lock-free).
+ *
+ * The key and passphrase may be borrowed (see vault_borrow_key) until the
+ * end of the statement, so if such entry gets evicted before that, the
+ * memory is handed over to the secure memory context, and wiped later.
+ */
+typedef struct VaultCacheEntry
+{
+	char		id[MAX_ID_LENGTH];	/* hash key (zero-padded key ID) */
+	bytea	   *key;				/* copy of the key (in TopMemoryContext) */
+	text	   *passphrase;			/* passphrase for pgcrypto (or NULL) */
+	uint32		version;			/* version of the key (the current one) */
+	uint32		generation;			/* generation of the stripe */
+	uint64		borrowed;			/* vault_secure_epoch when last borrowed */
+	dlist_node	lru_node;			/* position in the LRU list */
+} VaultCacheEntry;
+
+static HTAB		   *vault_cache = NULL;
+static dlist_head	vault_cache_lru = DLIST_STATIC_INIT(vault_cache_lru);
+static int			vault_cache_nentries = 0;
+
+static bytea *vault_fetch_key(const char *id, uint32 *generation, uint32 *version);
+static bytea *vault_fetch_local(const char *id, uint32 *generation, uint32 *version);
+static bytea *vault_fetch_version(const char *id, uint32 version);
+static bytea *vault_fetch_handle(int64 handle, uint32 *version);
+static VaultCacheEntry *vault_cache_find(const char *id, uint32 generation);
+static bytea *vault_cache_lookup(const char *id, uint32 generation, uint32 *version);
+static VaultCacheEntry *vault_cache_store(const char *id, bytea *key, uint32 version,
+										  uint32 generation);
+static VaultCacheEntry *vault_cache_get(const char *id, bytea **key, uint32 *version);
+static void vault_cache_evict(VaultCacheEntry *entry);
+static void vault_cache_release(VaultCacheEntry *entry);
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+
+	/* check that we can initialize the shared segment */
+	if (! process_shared_preload_libraries_in_progress) {
+		elog(ERROR, "pg_vault needs to be loaded using shared_preload_libraries");
+		return;
+	}
+
+	/* Define custom GUC variables. */
+
+	/* How large the vault may grow (the storage is allocated as needed, so
+	 * this does not reserve any memory). */
+	DefineCustomIntVariable("pg_vault.max_size",
+							"maximum amount of memory used by pg_vault",
+							NULL,
+							&pgvault_mem_max_size,
+							(16*1024),
+							(VAULT_INITIAL_SIZE / 1024), (1024*1024),
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* How many keys to keep in the backend-local cache (0 disables the cache). */
+	DefineCustomIntVariable("pg_vault.cache_size",
+							"number of keys cached in each backend",
+							NULL,
+							&pgvault_cache_size,
+							64,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* How many derived keys to keep in the backend-local cache (0 disables it). */
+	DefineCustomIntVariable("pg_vault.derive_cache_size",
+							"number of derived keys cached in each backend",
+							NULL,
+							&pgvault_derive_cache_size,
+							1024,
+							0, INT_MAX,
+							PGC_SUSET,
+							0,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* How many databases may have keys in the vault (each gets a partition). */
+	DefineCustomIntVariable("pg_vault.max_databases",
+							"number of databases with keys in the vault",
+							NULL,
+							&pgvault_max_databases,
+							64,
+							1, 1024,
+							PGC_POSTMASTER,
+							0,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* How many stripes (with separate locks) to split each partition into. */
+	DefineCustomIntVariable("pg_vault.stripes",
+							"number of lock stripes in each vault partition",
+							NULL,
+							&pgvault_stripes,
+							16,
+							1, 64,
+							PGC_POSTMASTER,
+							0,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* Where to save the wallet with keys (relative to the data directory). */
+	DefineCustomStringVariable("pg_vault.wallet",
+							   "location of the wallet file (save_keys/load_keys)",
+							   NULL,
+							   &pgvault_wallet_path,
+							   "pg_vault.wallet",
+							   PGC_SIGHUP,
+							   0,
+#if (PG_VERSION_NUM >= 90100)
+							   NULL,
+#endif
+							   NULL,
+							   NULL);
+
+	/* Library implementing the external key backend (empty - none). */
+	DefineCustomStringVariable("pg_vault.backend",
+							   "library implementing the external key backend",
+							   NULL,
+							   &pgvault_backend,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+#if (PG_VERSION_NUM >= 90100)
+							   NULL,
+#endif
+							   NULL,
+							   NULL);
+
+	/* How long to cache keys fetched from the backend. */
+	DefineCustomIntVariable("pg_vault.backend_ttl",
+							"how long to cache keys fetched from the external backend",
+							NULL,
+							&pgvault_backend_ttl,
+							300,
+							1, (INT_MAX / 1000),
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+#if (PG_VERSION_NUM >= 90100)
+							NULL,
+#endif
+							NULL,
+							NULL);
+
+	/* Keep the storage in a dedicated region, locked in memory. */
+	DefineCustomBoolVariable("pg_vault.dedicated_memory",
+							 "keep the vault storage in dedicated memory, locked and using huge pages",
+							 NULL,
+							 &pgvault_dedicated_memory,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+#if (PG_VERSION_NUM >= 90100)
+							 NULL,
+#endif
+							 NULL,
+							 NULL);
+
+	/* Passphrase encrypting the keys shipped to standbys (empty - not shipped). */
+	DefineCustomStringVariable("pg_vault.wal_passphrase",
+							   "passphrase encrypting the keys written to WAL for standbys",
+							   NULL,
+							   &pgvault_wal_passphrase,
+							   "",
+							   PGC_SIGHUP,
+							   GUC_SUPERUSER_ONLY,
+#if (PG_VERSION_NUM >= 90100)
+							   NULL,
+#endif
+							   NULL,
+							   NULL);
+
+	EmitWarningsOnPlaceholders("pg_vault");
+
+	/* the standbys replay the changes of the vault from WAL */
+	vault_replication_register();
+
+	/* the scrubber wipes the memory released by delete_keys */
+	vault_scrubber_register();
+
+	/* the backend worker fetches keys from the external backend */
+	if (vault_backend_enabled())
+		vault_backend_register();
+
+	/* Install hooks. */
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pgvault_shmem_request;
+#else
+	pgvault_shmem_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = pgvault_shmem_startup;
+
+}
+
+
+/*
+ * Module unload callback
+ */
+void
+_PG_fini(void)
+{
+	/* Uninstall hooks. */
+#if (PG_VERSION_NUM >= 150000)
+	shmem_request_hook = prev_shmem_request_hook;
+#endif
+	shmem_startup_hook = prev_shmem_startup_hook;
+}
+
+
+/*
+ * Request additional shared resources.  (These are no-ops if we're not in
+ * the postmaster process.)  We'll allocate or attach to the shared
+ * resources in pgvault_shmem_startup(). Only the fixed part of the vault
+ * lives in the main segment, the storage is allocated in DSA.
+ */
+static void
+pgvault_shmem_request(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(VaultControlSize(pgvault_max_databases, pgvault_stripes));
+	RequestAddinShmemSpace(vault_backend_shmem_size());
+
+	/* one lock for the control struct, one for each stripe and one for the backend queue */
+	RequestNamedLWLockTranche("pg_vault", 2 + pgvault_max_databases * pgvault_stripes);
+}
+
+
+/* 
+ * Probably the most important part of the startup - initializes the
+ * memory in shared memory segment (creates and initializes the
+ * VaultControl data structure). The storage itself is created later,
+ * by the first backend using the vault (see vault_attach).
+ * 
+ * This is called from a shmem_startup_hook (see _PG_init). */
+static
+void pgvault_shmem_startup() {
+
+	bool		found = false;
+	Size		size;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	elog(DEBUG1, "initializing pg_vault segment");
+
+	/*
+	 * Create or attach to the shared memory state
+	 */
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	size = VaultControlSize(pgvault_max_databases, pgvault_stripes);
+
+	vault_control = (VaultControl)ShmemInitStruct(SEGMENT_NAME, size, &found);
+
+	/* Was the shared memory segment already initialized? */
+	if (! found) {
+
+		int				i,
+						j;
+		LWLockPadded   *locks = GetNamedLWLockTranche("pg_vault");
+
+		/* nope - first time through, so initialize */
+		memset(vault_control, 0, size);
+
+		vault_control->lock = &locks[0].lock;
+		vault_control->tranche_id = LWLockNewTrancheId();
+
+		vault_control->npartitions = pgvault_max_databases;
+		vault_control->nstripes = pgvault_stripes;
+
+		/* epoch 0 marks idle readers */
+		pg_atomic_init_u64(&vault_control->reclaim_epoch, 1);
+		vault_control->readers = InvalidDsaPointer;
+
+		for (i = 0; i < vault_control->npartitions; i++)
+		{
+			VaultPartition	partition = VaultGetPartition(vault_control, i);
+
+			partition->dbid = InvalidOid;
+
+			pg_atomic_init_u64(&partition->stats.lookups, 0);
+			pg_atomic_init_u64(&partition->stats.misses, 0);
+			pg_atomic_init_u64(&partition->stats.cache_hits, 0);
+			pg_atomic_init_u64(&partition->stats.adds, 0);
+			pg_atomic_init_u64(&partition->stats.deletes, 0);
+			pg_atomic_init_u64(&partition->stats.lock_waits, 0);
+			pg_atomic_init_u64(&partition->stats.lock_wait_time, 0);
+
+			for (j = 0; j < vault_control->nstripes; j++)
+			{
+				VaultStripe	stripe = &partition->stripes[j];
+
+				stripe->lock = &locks[1 + i * vault_control->nstripes + j].lock;
+
+				pg_atomic_init_u32(&stripe->generation, 0);
+				pg_atomic_init_u64(&stripe->storage, InvalidDsaPointer);
+				stripe->retired = InvalidDsaPointer;
+				pg_atomic_init_u32(&stripe->nexpiring, 0);
+			}
+		}
+
+		/* the dedicated region for the storage (the area is created later) */
+		if (pgvault_dedicated_memory)
+			vault_memory_init((Size) pgvault_mem_max_size * 1024);
+
+		elog(DEBUG1, "shared memory segment for pg_vault successfully created");
+
+	}
+
+	/* the queue of the backend worker (with the last lock of the tranche) */
+	vault_backend_shmem_init(&GetNamedLWLockTranche("pg_vault")[1 + pgvault_max_databases * pgvault_stripes].lock);
+
+	LWLockRelease(AddinShmemInitLock);
+
+}
+
+
+/*
+ * attach to the DSA area with the vault storage (creating it if requested)
+ *
+ * Returns false if the area does not exist yet. The mapping is kept until
+ * the backend exits. With dedicated memory the area is created in place,
+ * in the region mapped by the postmaster (see memory.c).
+ */
+static bool
+vault_attach_area(bool create)
+{
+	MemoryContext	oldcontext;
+	dsa_area	   *area = NULL;
+	void		   *place;
+	Size			place_size;
+
+	if (vault_area != NULL)
+		return true;
+
+	LWLockRegisterTranche(vault_control->tranche_id, "pg_vault");
+
+	place = vault_memory_get(&place_size);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	LWLockAcquire(vault_control->lock, LW_EXCLUSIVE);
+
+	if (vault_control->area_created)
+		area = (place) ? dsa_attach_in_place(place, NULL) : dsa_attach(vault_control->area);
+	else if (create)
+	{
+		if (place)
+			area = dsa_create_in_place(place, place_size, vault_control->tranche_id, NULL);
+		else
+		{
+			area = dsa_create(vault_control->tranche_id);
+			vault_control->area = dsa_get_handle(area);
+		}
+
+		dsa_pin(area);
+
+		/* a reader slot for every process (see vault_read_begin) */
+		vault_control->nreaders = ProcGlobal->allProcCount;
+		vault_control->readers =
+			dsa_allocate_extended(area, vault_control->nreaders * sizeof(VaultReaderData),
+								  DSA_ALLOC_ZERO);
+
+		vault_control->area_created = true;
+	}
+
+	if (area != NULL)
+	{
+		VaultReader		readers;
+
+		/* there's no DSM segment to release the area on detach */
+		if (place)
+			on_shmem_exit(dsa_on_shmem_exit_release_in_place, PointerGetDatum(place));
+
+		dsa_pin_mapping(area);
+
+		/* a previous process with the slot may have failed while reading */
+		readers = (VaultReader) dsa_get_address(area, vault_control->readers);
+		vault_reader = &readers[VaultMyReaderSlot()].epoch;
+		pg_atomic_write_u64(vault_reader, 0);
+
+		/* the limit applies to all the storages (the GUC may change later) */
+		dsa_set_size_limit(area, vault_size_limit());
+	}
+
+	LWLockRelease(vault_control->lock);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	vault_area = area;
+
+	return (area != NULL);
+}
+
+
+/*
+ * attach to the partition of the current database (assigning a partition
+ * to it, with a new storage for each stripe, if requested)
+ *
+ * Has to be called before accessing the vault, without holding the lock.
+ * Returns false if there's no partition for the database, i.e. there are
+ * no keys in the vault.
+ */
+static bool
+vault_attach(bool create)
+{
+	if (vault_partition != NULL)
+		return true;
+
+	Assert(OidIsValid(MyDatabaseId));
+
+	return vault_attach_database(MyDatabaseId, create);
+}
+
+
+/*
+ * attach to the partition of an arbitrary database (see vault_attach)
+ *
+ * Used directly only by the backend worker, which is not connected to any
+ * database, and caches keys for all of them.
+ */
+static bool
+vault_attach_database(Oid dbid, bool create)
+{
+	VaultPartition	partition;
+
+	if (! vault_attach_area(create))
+		return false;
+
+	/* maybe some other backend assigned the partition already */
+	if ((partition = vault_find_partition(dbid)) != NULL)
+	{
+		vault_partition = partition;
+		return true;
+	}
+
+	if (! create)
+		return false;
+
+	LWLockAcquire(vault_control->lock, LW_EXCLUSIVE);
+
+	/* check again, now that we hold the lock */
+	if ((partition = vault_find_partition(dbid)) == NULL)
+		partition = vault_find_partition(InvalidOid);
+
+	if ((partition != NULL) && (partition->dbid == InvalidOid))
+	{
+		int			i;
+
+		for (i = 0; i < vault_control->nstripes; i++)
+		{
+			dsa_pointer	storage;
+
+			storage = dsa_allocate_extended(vault_area, VAULT_INITIAL_SIZE,
+											DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+
+			/* out of memory, so release the storages allocated so far */
+			if (! DsaPointerIsValid(storage))
+			{
+				while (--i >= 0)
+				{
+					dsa_free(vault_area, pg_atomic_read_u64(&partition->stripes[i].storage));
+					pg_atomic_write_u64(&partition->stripes[i].storage, InvalidDsaPointer);
+				}
+
+				LWLockRelease(vault_control->lock);
+
+				elog(ERROR, "cannot add a key - the vault is full (see pg_vault.max_size)");
+			}
+
+			vault_storage_init((VaultInfo) dsa_get_address(vault_area, storage),
+							   VAULT_INITIAL_SIZE);
+
+			pg_atomic_write_u64(&partition->stripes[i].storage, storage);
+		}
+
+		/* lock-free readers must not see the partition before the storage */
+		pg_write_barrier();
+
+		partition->dbid = dbid;
+	}
+
+	LWLockRelease(vault_control->lock);
+
+	if (partition == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("no free vault partition for the database"),
+				 errhint("Increase pg_vault.max_databases.")));
+
+	vault_partition = partition;
+
+	return true;
+}
+
+
+/*
+ * find the partition assigned to the database (or a free partition, for
+ * InvalidOid)
+ *
+ * The assignment happens only once, so we don't need the lock here. We may
+ * miss a partition assigned concurrently, but that's the same as if we got
+ * here a bit earlier.
+ */
+static VaultPartition
+vault_find_partition(Oid dbid)
+{
+	int		i;
+
+	for (i = 0; i < vault_control->npartitions; i++)
+	{
+		VaultPartition	partition = VaultGetPartition(vault_control, i);
+
+		if (partition->dbid == dbid)
+		{
+			pg_read_barrier();
+			return partition;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * stripe for a key ID with the given hash
+ *
+ * The low bits of the hash are used by the index within the stripe, so we
+ * mix the hash first (otherwise all keys in a stripe would share them).
+ */
+static int
+vault_stripe_index(uint32 hash)
+{
+	return DatumGetUInt32(hash_uint32(hash)) % vault_control->nstripes;
+}
+
+
+/*
+ * switch to a stripe of the current partition
+ *
+ * This does not acquire the lock, nor does it update vault_info (the
+ * caller needs to call vault_refresh, once it's safe).
+ */
+static void
+vault_select(int stripe)
+{
+	vault_stripe = &vault_partition->stripes[stripe];
+}
+
+
+/*
+ * make vault_info point to the current storage of the stripe
+ *
+ * The storage may be replaced by a larger one at any time we don't hold the
+ * lock, so we need to do this after acquiring the lock (or after reading the
+ * generation, when reading the stripe without the lock).
+ */
+static void
+vault_refresh(void)
+{
+	vault_info = (VaultInfo) dsa_get_address(vault_area,
+											 pg_atomic_read_u64(&vault_stripe->storage));
+}
+
+
+/*
+ * acquire the lock of a stripe, and make sure we're looking at the current
+ * storage
+ *
+ * Returns false (without acquiring the lock) if there's no partition for
+ * the current database, and we were not asked to create it.
+ */
+static bool
+vault_lock(int stripe, LWLockMode mode, bool create)
+{
+	if (! vault_attach(create))
+		return false;
+
+	vault_select(stripe);
+
+	vault_acquire(vault_stripe->lock, mode);
+
+	vault_refresh();
+
+	return true;
+}
+
+
+/*
+ * acquire the locks of all stripes (in a fixed order, to prevent deadlocks)
+ *
+ * Used by operations on all the keys in the vault (those need a consistent
+ * view of all the stripes). The caller then needs to switch to each stripe
+ * using vault_select and vault_refresh.
+ */
+static bool
+vault_lock_all(LWLockMode mode, bool create)
+{
+	int		i;
+
+	if (! vault_attach(create))
+		return false;
+
+	for (i = 0; i < vault_control->nstripes; i++)
+		vault_acquire(vault_partition->stripes[i].lock, mode);
+
+	return true;
+}
+
+
+/*
+ * release the locks of all stripes
+ */
+static void
+vault_unlock_all(void)
+{
+	int		i;
+
+	for (i = 0; i < vault_control->nstripes; i++)
+		LWLockRelease(vault_partition->stripes[i].lock);
+}
+
+
+/*
+ * acquire a stripe lock, measuring how long we had to wait for it
+ *
+ * We try to get the lock without waiting first, so that we only need to
+ * look at the clock when there actually is contention.
+ */
+static void
+vault_acquire(LWLock *lock, LWLockMode mode)
+{
+	instr_time	start,
+				duration;
+
+	if (LWLockConditionalAcquire(lock, mode))
+		return;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	LWLockAcquire(lock, mode);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	vault_stats_pending.lock_waits++;
+	vault_stats_pending.lock_wait_time += INSTR_TIME_GET_MICROSEC(duration);
+}
+
+
+/*
+ * How many items fit into a storage of the given size - each item needs
+ * space for the item header (and the cold part), a slot, an entry in the
+ * ordered index, at least two hash buckets (to keep the load factor of the
+ * index at or below 0.5) and the data in the arena (we assume average size
+ * of the data). The number of buckets is rounded up to a power of 2, and
+ * the arrays are aligned to cache lines, so we may need to give up a few
+ * items.
+ */
+static void
+vault_storage_layout(Size size, int *maxitems, int *nbuckets, Size *arena_offset)
+{
+	Size	available = size - VAULT_ITEMS_OFFSET - 2 * PG_CACHE_LINE_SIZE;
+
+	*maxitems = available / (sizeof(VaultItemData) + sizeof(VaultItemColdData) +
+							 2 * sizeof(VaultBucketData) + sizeof(VaultSlotData) +
+							 sizeof(uint32) + VAULT_ITEM_AVG_SIZE);
+
+	while (true)
+	{
+		*nbuckets = 1;
+		while (*nbuckets < 2 * (*maxitems))
+			*nbuckets <<= 1;
+
+		/* whatever remains is used as an arena for the item data */
+		*arena_offset = MAXALIGN(VaultBucketsOffset(*maxitems) +
+								 (*nbuckets) * sizeof(VaultBucketData) +
+								 (*maxitems) * (sizeof(VaultSlotData) + sizeof(uint32)));
+
+		if (*arena_offset + (*maxitems) * VAULT_ITEM_AVG_SIZE <= size)
+			break;
+
+		(*maxitems)--;
+	}
+}
+
+
+/*
+ * initialize a new (zeroed) storage of the given size
+ */
+static void
+vault_storage_init(VaultInfo storage, Size size)
+{
+	vault_storage_layout(size, &storage->maxitems, &storage->nbuckets,
+						 &storage->arena_offset);
+
+	storage->size = size;
+	storage->arena_size = size - storage->arena_offset;
+
+	/* the storage is zeroed, so there's nothing to scrub */
+	storage->scrub_bucket = storage->nbuckets;
+
+	/*
+	 * Start the tags at a random-ish value, so that handles from before a
+	 * restart are unlikely to match (the copies continue from the old tag).
+	 */
+	storage->last_tag = (uint32) GetCurrentTimestamp();
+}
+
+
+/*
+ * limit on the memory used by all the storages together
+ *
+ * With dedicated memory the area can't grow beyond the region (the extra
+ * segments would be regular DSM, not locked), no matter what max_size is.
+ */
+static Size
+vault_size_limit(void)
+{
+	Size		size;
+
+	if (vault_memory_get(&size) != NULL)
+		return size;
+
+	return (Size) pgvault_mem_max_size * 1024;
+}
+
+
+/*
+ * allocate a new storage, large enough for the given number of items and
+ * amount of item data (the caller holds the lock in exclusive mode)
+ *
+ * The size of the current storage is doubled until everything fits, but
+ * it may not exceed max_size. Returns InvalidDsaPointer when that's not
+ * possible, or when we fail to allocate the memory (the vault is full).
+ * The DSA area enforces max_size for all the storages together.
+ */
+static dsa_pointer
+vault_storage_alloc(int nitems, Size space)
+{
+	Size		max_size = vault_size_limit();
+	Size		size = vault_info->size;
+	int			maxitems;
+	int			nbuckets;
+	Size		arena_offset;
+	dsa_pointer	storage;
+
+	/* already at the limit (maybe max_size got lowered since) */
+	if (size >= max_size)
+		return InvalidDsaPointer;
+
+	while (size < max_size)
+	{
+		size = Min(2 * size, max_size);
+
+		vault_storage_layout(size, &maxitems, &nbuckets, &arena_offset);
+
+		if ((nitems <= maxitems) && (arena_offset + space <= size))
+			break;
+	}
+
+	/* we've reached the limit, and it's still not enough */
+	if ((nitems > maxitems) || (arena_offset + space > size))
+		return InvalidDsaPointer;
+
+	/* max_size may have changed since we attached to the area */
+	dsa_set_size_limit(vault_area, vault_size_limit());
+
+	storage = dsa_allocate_extended(vault_area, size,
+									DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+
+	if (DsaPointerIsValid(storage))
+		vault_storage_init((VaultInfo) dsa_get_address(vault_area, storage), size);
+
+	return storage;
+}
+
+
+/*
+ * copy all the items from the current storage into a new one (compacting
+ * the arena, and building a new index)
+ *
+ * The caller holds the lock in exclusive mode, and the write has to be in
+ * progress already (the new storage is not visible to others yet, but the
+ * caller is about to make it visible).
+ */
+static void
+vault_storage_copy(VaultInfo storage)
+{
+	int			i;
+	Size		offset = 0;
+	VaultInfo	old = vault_info;
+
+	for (i = 0; i < old->nitems; i++)
+	{
+		VaultItem	from = &VaultItems(old)[i];
+		VaultItem	to = &VaultItems(storage)[i];
+		Size		size = VaultItemSize(from);
+
+		memcpy(to, from, sizeof(VaultItemData));
+		memcpy(VaultItemGetCold(storage, i), VaultItemGetCold(old, i),
+			   sizeof(VaultItemColdData));
+		to->offset = offset;
+
+		memcpy(VaultItemKey(storage, to), VaultItemKey(old, from), size);
+
+		offset += size;
+	}
+
+	storage->nitems = old->nitems;
+	storage->arena_used = offset;
+
+	/* the items keep their positions, so the slots may be copied as is */
+	memcpy(VaultSlots(storage), VaultSlots(old), old->nslots * sizeof(VaultSlotData));
+
+	/* and the same for the ordered index */
+	memcpy(VaultOrder(storage), VaultOrder(old), old->nitems * sizeof(uint32));
+
+	storage->nslots = old->nslots;
+	storage->free_slot = old->free_slot;
+	storage->last_tag = old->last_tag;
+
+	/* the index is built in the new storage from scratch */
+	vault_info = storage;
+
+	for (i = 0; i < storage->nitems; i++)
+	{
+		VaultItem	item = &VaultItems(storage)[i];
+
+		vault_index_insert(DatumGetUInt32(hash_any((unsigned char *) VaultItemId(storage, item),
+												   item->id_len)), i);
+	}
+
+	vault_info = old;
+}
+
+Datum add_key(PG_FUNCTION_ARGS);
+Datum add_keys(PG_FUNCTION_ARGS);
+Datum delete_key(PG_FUNCTION_ARGS);
+Datum rotate_key(PG_FUNCTION_ARGS);
+Datum delete_key_version(PG_FUNCTION_ARGS);
+Datum lookup_key(PG_FUNCTION_ARGS);
+Datum lookup_keys(PG_FUNCTION_ARGS);
+Datum list_keys(PG_FUNCTION_ARGS);
+Datum delete_keys(PG_FUNCTION_ARGS);
+Datum delete_keys_prefix(PG_FUNCTION_ARGS);
+Datum vault_stats(PG_FUNCTION_ARGS);
+Datum key_handle(PG_FUNCTION_ARGS);
+Datum lookup_handle(PG_FUNCTION_ARGS);
+Datum key_stats(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(add_key);
+PG_FUNCTION_INFO_V1(add_keys);
+PG_FUNCTION_INFO_V1(delete_key);
+PG_FUNCTION_INFO_V1(rotate_key);
+PG_FUNCTION_INFO_V1(delete_key_version);
+PG_FUNCTION_INFO_V1(lookup_key);
+PG_FUNCTION_INFO_V1(lookup_keys);
+PG_FUNCTION_INFO_V1(list_keys);
+PG_FUNCTION_INFO_V1(delete_keys);
+PG_FUNCTION_INFO_V1(delete_keys_prefix);
+PG_FUNCTION_INFO_V1(vault_stats);
+PG_FUNCTION_INFO_V1(key_handle);
+PG_FUNCTION_INFO_V1(lookup_handle);
+PG_FUNCTION_INFO_V1(key_stats);
+
+/*
+ * add a key to the vault
+ *
+ * TODO maybe use a 'replace' option to replace existing keys
+ *
+ * - id  (TEXT)
+ * - key (BYTEA)
+ * - comment (TEXT)
+ */
+Datum
+add_key(PG_FUNCTION_ARGS)
+{
+	VaultEntry	entry;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key ID must not be NULL");
+
+	if (PG_ARGISNULL(1))
+		elog(ERROR, "key data must not be NULL");
+
+	entry.id		= text_to_cstring(PG_GETARG_TEXT_P(0));
+	entry.key		= PG_GETARG_BYTEA_P(1);
+	entry.comment	= NULL;
+	entry.expires	= 0;
+	entry.version	= 0;
+
+	if (! PG_ARGISNULL(2))
+		entry.comment = text_to_cstring(PG_GETARG_TEXT_P(2));
+
+	/* with an external backend, the vault is only a cache */
+	if (vault_backend_enabled())
+		vault_backend_store(&entry);
+	else
+	{
+		vault_add_keys(&entry, 1);
+		vault_log_keys(&entry, 1, false);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * add many keys to the vault at once (all or nothing)
+ *
+ * - ids (TEXT[])
+ * - keys (BYTEA[])
+ * - comments (TEXT[], may be NULL)
+ *
+ * The arrays have to be of the same length. All the keys are validated
+ * first, and then added under a single acquisition of the lock, so that
+ * provisioning many keys does not block the readers repeatedly.
+ */
+Datum
+add_keys(PG_FUNCTION_ARGS)
+{
+	int			i;
+	Datum	   *ids,
+			   *keys,
+			   *comments = NULL;
+	bool	   *ids_nulls,
+			   *keys_nulls,
+			   *comments_nulls = NULL;
+	int			nids,
+				nkeys,
+				ncomments;
+	VaultEntry *entries;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key IDs must not be NULL");
+
+	if (PG_ARGISNULL(1))
+		elog(ERROR, "key data must not be NULL");
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), TEXTOID, -1, false, 'i',
+					  &ids, &ids_nulls, &nids);
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), BYTEAOID, -1, false, 'i',
+					  &keys, &keys_nulls, &nkeys);
+
+	if (nids != nkeys)
+		elog(ERROR, "number of key IDs and keys does not match (%d != %d)", nids, nkeys);
+
+	if (! PG_ARGISNULL(2))
+	{
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(2), TEXTOID, -1, false, 'i',
+						  &comments, &comments_nulls, &ncomments);
+
+		if (nids != ncomments)
+			elog(ERROR, "number of key IDs and comments does not match (%d != %d)", nids, ncomments);
+	}
+
+	entries = (VaultEntry *) palloc0(Max(1, nids) * sizeof(VaultEntry));
+
+	for (i = 0; i < nids; i++)
+	{
+		if (ids_nulls[i])
+			elog(ERROR, "key ID must not be NULL");
+
+		if (keys_nulls[i])
+			elog(ERROR, "key data must not be NULL");
+
+		entries[i].id = TextDatumGetCString(ids[i]);
+		entries[i].key = DatumGetByteaP(keys[i]);
+
+		if ((comments != NULL) && (! comments_nulls[i]))
+			entries[i].comment = TextDatumGetCString(comments[i]);
+	}
+
+	/* the backend stores the keys one by one (so not all or nothing) */
+	if (vault_backend_enabled())
+	{
+		for (i = 0; i < nids; i++)
+			vault_backend_store(&entries[i]);
+	}
+	else
+	{
+		vault_add_keys(entries, nids);
+		vault_log_keys(entries, nids, false);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * add keys to the vault (used by add_key and when loading the wallet)
+ *
+ * Either all the keys are added, or none of them (e.g. when one of the IDs
+ * is not unique, or when there's not enough space for all of them). All the
+ * validation that does not need the vault is done before taking the locks.
+ * Then we lock all the stripes the keys belong to, check them and allocate
+ * everything we might need, and only then add the keys (as a single write
+ * in each stripe).
+ *
+ * The versions of the keys are resolved while holding the locks (see
+ * VAULT_VERSION_NEXT), and the actual versions are set in the entries.
+ */
+void
+vault_add_keys(VaultEntry *entries, int nentries)
+{
+	int		i,
+			j,
+			k;
+	int		duplicate = -1;
+	int		missing = -1;
+
+	bool	vault_is_full	= false;
+
+	uint32		   *hashes;
+	int			   *stripes;
+	VaultItemData  *headers;
+	VaultStripeWrite *writes;
+
+	if (nentries == 0)
+		return;
+
+	hashes = (uint32 *) palloc(nentries * sizeof(uint32));
+	stripes = (int *) palloc(nentries * sizeof(int));
+	headers = (VaultItemData *) palloc(nentries * sizeof(VaultItemData));
+
+	for (i = 0; i < nentries; i++)
+	{
+		char   *id = entries[i].id;
+		char   *comment = entries[i].comment;
+		bytea  *key = entries[i].key;
+
+		vault_check_entry(&entries[i]);
+
+		hashes[i] = vault_hash_id(id);
+		stripes[i] = vault_stripe_index(hashes[i]);
+
+		/* the item header (except for the offset, assigned later) */
+		headers[i].offset = 0;
+		headers[i].key_len = VARSIZE_ANY(key);
+		headers[i].id_len = strlen(id);
+		headers[i].comment_len = (comment != NULL) ? strlen(comment) : 0;
+		headers[i].flags = 0;
+		headers[i].version = 0;
+	}
+
+	/* the IDs (and versions) have to be unique within the batch too */
+	if (nentries > 1)
+	{
+		VaultEntry **sorted = (VaultEntry **) palloc(nentries * sizeof(VaultEntry *));
+
+		for (i = 0; i < nentries; i++)
+			sorted[i] = &entries[i];
+
+		qsort(sorted, nentries, sizeof(VaultEntry *), vault_entry_cmp);
+
+		for (i = 1; i < nentries; i++)
+			if (vault_entry_cmp(&sorted[i-1], &sorted[i]) == 0)
+				elog(ERROR, "the supplied key ID '%s' is not unique", sorted[i]->id);
+
+		pfree(sorted);
+	}
+
+	vault_attach(true);
+
+	/* how many keys go to each stripe, and how much space they need */
+	writes = (VaultStripeWrite *) palloc0(vault_control->nstripes * sizeof(VaultStripeWrite));
+
+	for (i = 0; i < nentries; i++)
+	{
+		writes[stripes[i]].nentries++;
+		writes[stripes[i]].space += VaultItemSize(&headers[i]);
+	}
+
+	/* lock the stripes we're going to modify (in a fixed order) */
+	for (j = 0; j < vault_control->nstripes; j++)
+		if (writes[j].nentries > 0)
+			vault_acquire(vault_partition->stripes[j].lock, LW_EXCLUSIVE);
+
+	/* do the checks here, but report the errors outside the locked section */
+
+	/* are the key IDs unique? (and which versions do we add) */
+	for (i = 0; i < nentries; i++)
+	{
+		int		current;
+
+		vault_select(stripes[i]);
+		vault_refresh();
+
+		current = vault_index_find(entries[i].id, hashes[i]);
+
+		if (entries[i].version == 0)
+		{
+			headers[i].version = 1;
+
+			if (current >= 0)
+				duplicate = i;
+		}
+		else if (entries[i].version == VAULT_VERSION_NEXT)
+		{
+			/* there has to be a version to follow */
+			if (current < 0)
+				missing = i;
+			else
+				headers[i].version = VaultBucketItem(vault_info, current)->version + 1;
+		}
+		else
+		{
+			headers[i].version = entries[i].version;
+
+			if (vault_index_find_version(entries[i].id, hashes[i], entries[i].version) >= 0)
+				duplicate = i;
+		}
+
+		if ((duplicate >= 0) || (missing >= 0))
+			break;
+	}
+
+	/*
+	 * Is there space for the new items (both headers and data) in each of
+	 * the stripes? Maybe there's enough space in the holes left by deleted
+	 * items, otherwise we need to grow the storage (which compacts the arena
+	 * too). We allocate everything before starting the writes, as we must
+	 * not fail after that.
+	 */
+	for (j = 0; (j < vault_control->nstripes) && (duplicate < 0) && (missing < 0) && (! vault_is_full); j++)
+	{
+		Size	used;
+
+		if (writes[j].nentries == 0)
+			continue;
+
+		vault_select(j);
+		vault_refresh();
+
+		writes[j].added = (uint32 *) palloc(writes[j].nentries * sizeof(uint32));
+
+		used = vault_info->arena_used - vault_info->arena_free;
+
+		if ((vault_info->nitems + writes[j].nentries > vault_info->maxitems) ||
+			(used + writes[j].space > vault_info->arena_size))
+		{
+			writes[j].storage = vault_storage_alloc(vault_info->nitems + writes[j].nentries,
+													used + writes[j].space);
+
+			if (! DsaPointerIsValid(writes[j].storage))
+				vault_is_full = true;
+		}
+		else if (vault_info->arena_used + writes[j].space > vault_info->arena_size)
+			writes[j].sorted = (VaultArenaItem *) palloc(Max(1, vault_info->nitems) *
+														 sizeof(VaultArenaItem));
+	}
+
+	/* the keys can be added only if the IDs are unique and there's enough space */
+	for (j = 0; (j < vault_control->nstripes) && (duplicate < 0) && (missing < 0) && (! vault_is_full); j++)
+	{
+		VaultInfo	old = NULL;
+		dsa_pointer	old_storage;
+
+		if (writes[j].nentries == 0)
+			continue;
+
+		vault_select(j);
+		vault_refresh();
+
+		old_storage = pg_atomic_read_u64(&vault_stripe->storage);
+
+		vault_write_begin();
+
+		if (writes[j].sorted != NULL)
+			vault_arena_compact(writes[j].sorted);
+
+		/* switch to the new storage (the readers are retrying now) */
+		if (DsaPointerIsValid(writes[j].storage))
+		{
+			old = vault_info;
+
+			vault_storage_copy((VaultInfo) dsa_get_address(vault_area, writes[j].storage));
+
+			pg_atomic_write_u64(&vault_stripe->storage, writes[j].storage);
+			vault_refresh();
+		}
+
+		for (i = 0, k = 0; i < nentries; i++)
+		{
+			VaultItem	item = &VaultItems(vault_info)[vault_info->nitems];
+			VaultItemCold	cold = VaultItemGetCold(vault_info, vault_info->nitems);
+			int			current;
+
+			if (stripes[i] != j)
+				continue;
+
+			/* the latest version is the current one, the others are retired */
+			if ((current = vault_index_find(entries[i].id, hashes[i])) >= 0)
+			{
+				VaultItem	other = VaultBucketItem(vault_info, current);
+
+				if (other->version < headers[i].version)
+					other->flags |= VAULT_ITEM_RETIRED;
+				else
+					headers[i].flags |= VAULT_ITEM_RETIRED;
+			}
+
+			/* allocate space in the arena */
+			headers[i].offset = vault_info->arena_used;
+			vault_info->arena_used += VaultItemSize(&headers[i]);
+
+			/* copy the fields into the structure */
+			memcpy(item, &headers[i], sizeof(VaultItemData));
+
+			pg_atomic_init_u32(&cold->uses, 0);
+			cold->expires = entries[i].expires;
+
+			if (cold->expires != 0)
+				pg_atomic_fetch_add_u32(&vault_stripe->nexpiring, 1);
+
+			vault_slot_assign(vault_info->nitems);
+
+			/* the space may not be scrubbed yet (after delete_keys) */
+			memset(VaultItemKey(vault_info, item), 0, VaultItemSize(item));
+
+			memcpy(VaultItemKey(vault_info, item), entries[i].key, item->key_len);
+			memcpy(VaultItemId(vault_info, item), entries[i].id, item->id_len);
+
+			if (entries[i].comment != NULL)
+				memcpy(VaultItemComment(vault_info, item), entries[i].comment, item->comment_len);
+
+			vault_index_insert(hashes[i], vault_info->nitems);
+
+			writes[j].added[k++] = vault_info->nitems;
+
+			vault_info->nitems++;
+		}
+
+		vault_order_merge(writes[j].added, k);
+
+		vault_write_end();
+
+		/*
+		 * Wipe the data in the old storage (but keep the header, so that
+		 * readers still looking at it don't get confused) and retire it.
+		 * Readers that announced an earlier epoch may still be looking at
+		 * it, so it's freed later (with storages retired earlier, if no one
+		 * can see those anymore). The new storage was published before the
+		 * epoch gets incremented, so readers announcing the new epoch can't
+		 * see the old one.
+		 */
+		if (old != NULL)
+		{
+			memset(VaultItems(old), 0, old->size - VAULT_ITEMS_OFFSET);
+
+			old->retired_epoch = pg_atomic_add_fetch_u64(&vault_control->reclaim_epoch, 1);
+			old->retired_next = vault_stripe->retired;
+
+			vault_stripe->retired = old_storage;
+
+			vault_reclaim();
+		}
+	}
+
+	/* if we failed, release the storages allocated so far */
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		if ((duplicate >= 0 || missing >= 0 || vault_is_full) && DsaPointerIsValid(writes[j].storage))
+			dsa_free(vault_area, writes[j].storage);
+
+		if (writes[j].nentries > 0)
+			LWLockRelease(vault_partition->stripes[j].lock);
+
+		if (writes[j].added != NULL)
+			pfree(writes[j].added);
+
+		if (writes[j].sorted != NULL)
+			pfree(writes[j].sorted);
+	}
+
+	if ((duplicate < 0) && (missing < 0) && (! vault_is_full))
+	{
+		vault_stats_pending.adds += nentries;
+
+		for (i = 0; i < nentries; i++)
+			entries[i].version = headers[i].version;
+	}
+
+	pfree(writes);
+	pfree(hashes);
+	pfree(stripes);
+	pfree(headers);
+
+	vault_stats_done();
+
+	if (duplicate >= 0)
+		elog(ERROR, "the supplied key ID '%s' is not unique", entries[duplicate].id);
+
+	if (missing >= 0)
+		elog(ERROR, "key '%s' does not exist", entries[missing].id);
+
+	if (vault_is_full)
+		elog(ERROR, "cannot add a key - the vault is full (see pg_vault.max_size)");
+}
+
+
+/*
+ * check that the key fits into the size limits (errors out otherwise)
+ */
+void
+vault_check_entry(VaultEntry *entry)
+{
+	if (strlen(entry->id) >= MAX_ID_LENGTH)
+		elog(ERROR, "key ID too long (max=%d len=%ld)", MAX_ID_LENGTH, strlen(entry->id));
+
+	if ((entry->comment != NULL) && (strlen(entry->comment) >= MAX_COMMENT_LENGTH))
+		elog(ERROR, "comment too long (max=%d len=%ld)", MAX_COMMENT_LENGTH, strlen(entry->comment));
+
+	/* the key is stored including the varlena header */
+	if (VARSIZE_ANY(entry->key) > MAX_KEY_LENGTH)
+		elog(ERROR, "key too long (max=%d len=%ld)", MAX_KEY_LENGTH - VARHDRSZ, VARSIZE_ANY_EXHDR(entry->key));
+}
+
+
+/*
+ * get a copy of all the keys in the vault (used when saving the wallet)
+ *
+ * Keys cached from the external backend are not included. The copies are
+ * allocated in the current memory context, and it's up to the caller to
+ * wipe them once not needed.
+ */
+VaultEntry *
+vault_get_keys(int *nentries)
+{
+	int			i,
+				j;
+	int			n = 0;
+	VaultEntry *entries;
+
+	*nentries = 0;
+
+	/* no partition for this database, so no keys */
+	if (! vault_lock_all(LW_SHARED, false))
+		return (VaultEntry *) palloc0(sizeof(VaultEntry));
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		vault_select(j);
+		vault_refresh();
+
+		*nentries += vault_info->nitems;
+	}
+
+	entries = (VaultEntry *) palloc0(Max(1, *nentries) * sizeof(VaultEntry));
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		vault_select(j);
+		vault_refresh();
+
+		for (i = 0; i < vault_info->nitems; i++)
+		{
+			VaultItem	item = &VaultItems(vault_info)[i];
+
+			/* keys cached from the external backend live there */
+			if (VaultItemGetCold(vault_info, i)->expires != 0)
+				continue;
+
+			entries[n].id = pnstrdup(VaultItemId(vault_info, item), item->id_len);
+			entries[n].comment = pnstrdup(VaultItemComment(vault_info, item), item->comment_len);
+
+			entries[n].key = (bytea *) palloc(item->key_len);
+			memcpy(entries[n].key, VaultItemKey(vault_info, item), item->key_len);
+
+			entries[n].version = item->version;
+
+			n++;
+		}
+	}
+
+	vault_unlock_all();
+
+	*nentries = n;
+
+	return entries;
+}
+
+
+/*
+ * delete a key from the vault
+ *
+ * - id  (TEXT)
+ */
+Datum
+delete_key(PG_FUNCTION_ARGS)
+{
+	int		bucket;
+	char	*id = NULL;
+	uint32	hash;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key ID must not be NULL");
+
+	id	= text_to_cstring(PG_GETARG_TEXT_P(0));
+
+	/* the backend worker also removes the cached copy */
+	if (vault_backend_enabled())
+	{
+		vault_backend_remove(id);
+		PG_RETURN_VOID();
+	}
+
+	hash = vault_hash_id(id);
+
+	/* no partition for this database, so no keys */
+	if (! vault_lock(vault_stripe_index(hash), LW_EXCLUSIVE, false))
+		PG_RETURN_VOID();
+
+	/* all the versions of the key */
+	while ((bucket = vault_index_find_version(id, hash, 0)) >= 0)
+		vault_delete_item(bucket);
+
+	LWLockRelease(vault_stripe->lock);
+
+	vault_stats_done();
+
+	/* the standbys delete the key too */
+	vault_log_delete(id, 0);
+
+	/* FIXME Maybe this should report error if the key was not found? */
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * add a new version of an existing key (the new current version)
+ *
+ * - id  (TEXT)
+ * - key (BYTEA)
+ * - comment (TEXT)
+ *
+ * Data encrypted with the older versions can still be decrypted (the version
+ * is stored in the encrypted data), so the data may be re-encrypted with the
+ * new version incrementally. Returns the new version of the key.
+ */
+Datum
+rotate_key(PG_FUNCTION_ARGS)
+{
+	VaultEntry	entry;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key ID must not be NULL");
+
+	if (PG_ARGISNULL(1))
+		elog(ERROR, "key data must not be NULL");
+
+	/* the backend has no notion of versions */
+	if (vault_backend_enabled())
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("keys from the key backend can't be rotated"),
+				 errhint("Rotate the key in the backend.")));
+
+	entry.id		= text_to_cstring(PG_GETARG_TEXT_P(0));
+	entry.key		= PG_GETARG_BYTEA_P(1);
+	entry.comment	= NULL;
+	entry.expires	= 0;
+	entry.version	= VAULT_VERSION_NEXT;
+
+	if (! PG_ARGISNULL(2))
+		entry.comment = text_to_cstring(PG_GETARG_TEXT_P(2));
+
+	vault_add_keys(&entry, 1);
+	vault_log_keys(&entry, 1, false);
+
+	PG_RETURN_INT32((int32) entry.version);
+}
+
+
+/*
+ * delete an older version of a key from the vault (once there's no data
+ * encrypted with it)
+ *
+ * - id  (TEXT)
+ * - version (INT)
+ *
+ * The current version can't be deleted this way, use pg_vault_delete_key to
+ * delete the whole key. Returns true if the version was deleted.
+ */
+Datum
+delete_key_version(PG_FUNCTION_ARGS)
+{
+	int		bucket;
+	char	*id = NULL;
+	int32	version;
+	uint32	hash;
+	bool	current = false;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key ID must not be NULL");
+
+	if (PG_ARGISNULL(1))
+		elog(ERROR, "key version must not be NULL");
+
+	id = text_to_cstring(PG_GETARG_TEXT_P(0));
+	version = PG_GETARG_INT32(1);
+
+	if (version <= 0)
+		elog(ERROR, "invalid key version %d", version);
+
+	if (vault_backend_enabled())
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("keys from the key backend don't have versions")));
+
+	hash = vault_hash_id(id);
+
+	/* no partition for this database, so no keys */
+	if (! vault_lock(vault_stripe_index(hash), LW_EXCLUSIVE, false))
+		PG_RETURN_BOOL(false);
+
+	if ((bucket = vault_index_find_version(id, hash, (uint32) version)) >= 0)
+	{
+		current = ! (VaultBucketItem(vault_info, bucket)->flags & VAULT_ITEM_RETIRED);
+
+		if (! current)
+			vault_delete_item(bucket);
+	}
+
+	LWLockRelease(vault_stripe->lock);
+
+	vault_stats_done();
+
+	if (current)
+		elog(ERROR, "version %d is the current version of key '%s'", version, id);
+
+	if (bucket < 0)
+		PG_RETURN_BOOL(false);
+
+	vault_log_delete(id, (uint32) version);
+
+	PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * delete the item referenced by the bucket from the current stripe (the
+ * caller holds the lock in exclusive mode)
+ *
+ * The last item is copied to the place of the deleted one, so that the
+ * items remain dense.
+ */
+static void
+vault_delete_item(int bucket)
+{
+	int			i;
+	VaultBucket	buckets = VaultBuckets(vault_info);
+	VaultItem	item;
+
+	i = buckets[bucket].item - 1;
+	item = &VaultItems(vault_info)[i];
+
+	vault_write_begin();
+
+	vault_index_delete(bucket);
+	vault_slot_release(VaultItemGetCold(vault_info, i)->slot);
+	vault_order_delete(i);
+
+	vault_stats_pending.deletes++;
+
+	if (VaultItemGetCold(vault_info, i)->expires != 0)
+		pg_atomic_fetch_sub_u32(&vault_stripe->nexpiring, 1);
+
+	/* wipe the item data, and remember there's a hole in the arena */
+	memset(VaultItemKey(vault_info, item), 0, VaultItemSize(item));
+	vault_info->arena_free += VaultItemSize(item);
+
+	/* consider the last item already deleted */
+	vault_info->nitems--;
+
+	if (i != vault_info->nitems)
+	{
+		memcpy(&VaultItems(vault_info)[i], &VaultItems(vault_info)[vault_info->nitems],
+			   sizeof(VaultItemData));
+		memcpy(VaultItemGetCold(vault_info, i), VaultItemGetCold(vault_info, vault_info->nitems),
+			   sizeof(VaultItemColdData));
+
+		vault_index_move(vault_info->nitems, i);
+		vault_order_move(vault_info->nitems, i);
+		VaultSlots(vault_info)[VaultItemGetCold(vault_info, i)->slot].item = i + 1;
+	}
+
+	memset(&VaultItems(vault_info)[vault_info->nitems], 0, sizeof(VaultItemData));
+	memset(VaultItemGetCold(vault_info, vault_info->nitems), 0, sizeof(VaultItemColdData));
+
+	/* with no items left, the whole arena is free again */
+	if (vault_info->nitems == 0)
+	{
+		vault_info->arena_used = 0;
+		vault_info->arena_free = 0;
+	}
+
+	vault_write_end();
+}
+
+
+/*
+ * cache keys fetched from the external backend in the partition of the
+ * database (called by the backend worker, and when replaying the keys
+ * shipped to a standby, see replication.c)
+ *
+ * The current copies of the keys (if any) are replaced in place, so that
+ * readers always find them (refreshing a key in use must not make lookups
+ * wait for the backend). Only keys that can't be replaced in place (not
+ * cached yet, or with no space for the new data) are removed and added
+ * again, and readers may not find those for a moment - but then they simply
+ * request them from the backend again (and wait for the worker to finish).
+ */
+void
+vault_cache_keys(Oid dbid, VaultEntry *entries, int nentries)
+{
+	int			i;
+	int			nadd = 0;
+	VaultEntry *add = (VaultEntry *) palloc(Max(1, nentries) * sizeof(VaultEntry));
+
+	for (i = 0; i < nentries; i++)
+	{
+		if (vault_replace_key(dbid, &entries[i]))
+			continue;
+
+		vault_uncache_key(dbid, entries[i].id, entries[i].version);
+
+		add[nadd++] = entries[i];
+	}
+
+	if (nadd > 0)
+	{
+		vault_partition = NULL;
+
+		vault_attach_database(dbid, true);
+
+		vault_add_keys(add, nadd);
+
+		vault_stats_flush(true);
+		vault_partition = NULL;
+	}
+
+	pfree(add);
+}
+
+
+/*
+ * replace the cached copy of a key (the data and expiration) in place, in the
+ * partition of the database
+ *
+ * The item keeps its place (and slot, so handles remain valid), all within a
+ * single write, so that lock-free readers see either the old or the new copy.
+ * If the new data does not fit into the space of the old one, it's moved to
+ * the end of the arena (leaving a hole). Returns false if the key is not in
+ * the vault, or if there's not enough space (the caller adds it again then).
+ *
+ * Without a version (0), the key has to have just the first version, which
+ * is what adding it again would produce.
+ */
+static bool
+vault_replace_key(Oid dbid, VaultEntry *entry)
+{
+	int			bucket;
+	int			index = 0;
+	uint32		hash = vault_hash_id(entry->id);
+	VaultItem	item = NULL;
+	VaultItemData	header;
+	bool		replaced = false;
+
+	vault_partition = NULL;
+
+	if (! vault_attach_database(dbid, false))
+		return false;
+
+	vault_lock(vault_stripe_index(hash), LW_EXCLUSIVE, false);
+
+	if (entry->version == 0)
+		bucket = vault_index_find(entry->id, hash);
+	else
+		bucket = vault_index_find_version(entry->id, hash, entry->version);
+
+	if (bucket >= 0)
+	{
+		index = VaultBuckets(vault_info)[bucket].item - 1;
+		item = &VaultItems(vault_info)[index];
+
+		/* the new header (the ID stays the same) */
+		memcpy(&header, item, sizeof(VaultItemData));
+		header.key_len = VARSIZE_ANY(entry->key);
+		header.comment_len = (entry->comment != NULL) ? strlen(entry->comment) : 0;
+
+		/* the new data fits in place, or at the end of the arena */
+		replaced = ((entry->version != 0) || (item->version == 1)) &&
+				   ((VaultItemSize(&header) <= VaultItemSize(item)) ||
+					(vault_info->arena_used + VaultItemSize(&header) <= vault_info->arena_size));
+	}
+
+	if (replaced)
+	{
+		vault_write_begin();
+
+		/* move the data to the end of the arena, or shrink it in place */
+		if (VaultItemSize(&header) > VaultItemSize(item))
+		{
+			header.offset = vault_info->arena_used;
+			vault_info->arena_used += VaultItemSize(&header);
+			vault_info->arena_free += VaultItemSize(item);
+
+			/* the space may not be scrubbed yet (after delete_keys) */
+			memset(VaultItemKey(vault_info, &header), 0, VaultItemSize(&header));
+		}
+		else
+			vault_info->arena_free += VaultItemSize(item) - VaultItemSize(&header);
+
+		/* wipe the old data (the ID moves if the length of the key changed) */
+		memset(VaultItemKey(vault_info, item), 0, VaultItemSize(item));
+
+		memcpy(VaultItemKey(vault_info, &header), entry->key, header.key_len);
+		memcpy(VaultItemId(vault_info, &header), entry->id, header.id_len);
+
+		if (entry->comment != NULL)
+			memcpy(VaultItemComment(vault_info, &header), entry->comment, header.comment_len);
+
+		memcpy(item, &header, sizeof(VaultItemData));
+
+		/* the key may become (or stop being) a key from the backend */
+		if ((VaultItemGetCold(vault_info, index)->expires == 0) && (entry->expires != 0))
+			pg_atomic_fetch_add_u32(&vault_stripe->nexpiring, 1);
+		else if ((VaultItemGetCold(vault_info, index)->expires != 0) && (entry->expires == 0))
+			pg_atomic_fetch_sub_u32(&vault_stripe->nexpiring, 1);
+
+		VaultItemGetCold(vault_info, index)->expires = entry->expires;
+
+		vault_write_end();
+	}
+
+	LWLockRelease(vault_stripe->lock);
+
+	vault_stats_flush(true);
+	vault_partition = NULL;
+
+	return replaced;
+}
+
+
+/*
+ * remove the cached copy of a key from the partition of the database (if
+ * it's cached at all), called by the backend worker and during replay
+ *
+ * Removes the given version of the key, or all the versions (for 0).
+ */
+void
+vault_uncache_key(Oid dbid, const char *id, uint32 version)
+{
+	int		bucket;
+	uint32	hash = vault_hash_id(id);
+
+	vault_partition = NULL;
+
+	if (! vault_attach_database(dbid, false))
+		return;
+
+	vault_lock(vault_stripe_index(hash), LW_EXCLUSIVE, false);
+
+	while ((bucket = vault_index_find_version(id, hash, version)) >= 0)
+		vault_delete_item(bucket);
+
+	LWLockRelease(vault_stripe->lock);
+
+	vault_stats_flush(true);
+	vault_partition = NULL;
+}
+
+
+/*
+ * remove all the keys from the partition of the database (during replay of
+ * pg_vault_delete_keys on a standby)
+ */
+void
+vault_uncache_keys(Oid dbid)
+{
+	vault_partition = NULL;
+
+	if (vault_attach_database(dbid, false))
+		vault_delete_all();
+
+	vault_stats_flush(true);
+	vault_partition = NULL;
+}
+
+
+/*
+ * remove the keys with IDs starting with the prefix from the partition of
+ * the database (during replay of pg_vault_delete_keys on a standby)
+ */
+void
+vault_uncache_prefix(Oid dbid, const char *prefix)
+{
+	vault_partition = NULL;
+
+	if (vault_attach_database(dbid, false))
+		vault_delete_prefix(prefix);
+
+	vault_stats_flush(true);
+	vault_partition = NULL;
+}
+
+
+/*
+ * delete keys cached from the external backend that expired, and return
+ * the keys expiring before the horizon (to be refreshed by the worker)
+ *
+ * A stripe is locked only when it has some keys from the backend at all
+ * (see nexpiring), so that with keys added only locally this is just a quick
+ * check. The counter is read without the lock, but a key added concurrently
+ * is simply handled the next time.
+ */
+VaultBackendKey *
+vault_expire_keys(TimestampTz now, TimestampTz horizon, int *nkeys)
+{
+	int		i,
+			j,
+			k;
+	int		maxkeys = 64;
+	VaultBackendKey *keys;
+
+	keys = (VaultBackendKey *) palloc(maxkeys * sizeof(VaultBackendKey));
+	*nkeys = 0;
+
+	if (! vault_attach_area(false))
+		return keys;
+
+	for (k = 0; k < vault_control->npartitions; k++)
+	{
+		VaultPartition	partition = VaultGetPartition(vault_control, k);
+
+		if (partition->dbid == InvalidOid)
+			continue;
+
+		pg_read_barrier();
+
+		vault_partition = partition;
+
+		for (j = 0; j < vault_control->nstripes; j++)
+		{
+			if (pg_atomic_read_u32(&vault_partition->stripes[j].nexpiring) == 0)
+				continue;
+
+			vault_lock(j, LW_EXCLUSIVE, false);
+
+			/* walk backwards, as deleting an item moves the last one */
+			for (i = vault_info->nitems - 1; i >= 0; i--)
+			{
+				VaultItem	item = &VaultItems(vault_info)[i];
+				VaultItemCold	cold = VaultItemGetCold(vault_info, i);
+				char	   *id = VaultItemId(vault_info, item);
+
+				if ((cold->expires == 0) || (cold->expires > horizon))
+					continue;
+
+				if (cold->expires <= now)
+				{
+					vault_delete_item(vault_index_find(id, vault_hash_id(id)));
+					continue;
+				}
+
+				if (*nkeys == maxkeys)
+				{
+					maxkeys *= 2;
+					keys = (VaultBackendKey *) repalloc(keys, maxkeys * sizeof(VaultBackendKey));
+				}
+
+				keys[*nkeys].dbid = partition->dbid;
+				keys[*nkeys].key = NULL;
+				strlcpy(keys[*nkeys].id, id, MAX_ID_LENGTH);
+
+				(*nkeys)++;
+			}
+
+			LWLockRelease(vault_stripe->lock);
+		}
+
+		vault_stats_flush(true);
+	}
+
+	vault_partition = NULL;
+
+	return keys;
+}
+
+
+/*
+ * lookup a key in the vault
+ */
+Datum
+lookup_key(PG_FUNCTION_ARGS)
+{
+	char		*id = NULL;
+	const bytea	*key = NULL;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key ID must not be NULL");
+
+	/* the same ID as in the previous call in this statement */
+	if (! vault_fn_cache_get(fcinfo, 0, false, NULL, (const struct varlena **) &key))
+	{
+		bytea	*copy;
+		uint32	generation;
+		uint32	version = 0;
+
+		id	= text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+		copy = vault_fetch_key(id, &generation, &version);
+
+		key = (const bytea *) vault_fn_cache_set(fcinfo, 0, false, version,
+												 (struct varlena *) copy);
+
+		if (copy != NULL)
+		{
+			memset(copy, 0, VARSIZE_ANY(copy));
+			pfree(copy);
+		}
+	}
+
+	/* the result has to be a copy, but at least it gets wiped */
+	if (key != NULL)
+		PG_RETURN_BYTEA_P(vault_copy_wiped((const struct varlena *) key));
+
+	PG_RETURN_NULL();
+}
+
+
+/*
+ * get a handle of the key with the given ID
+ *
+ * - id (TEXT)
+ *
+ * The handle may be used instead of the ID (with the overloaded lookup and
+ * encrypt/decrypt functions), and it addresses the key directly, without
+ * hashing and comparing the ID. It remains valid until the key is deleted
+ * (or until a restart). Returns NULL if there's no such key.
+ */
+Datum
+key_handle(PG_FUNCTION_ARGS)
+{
+	char	   *id = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	uint32		hash;
+	int			bucket;
+	int64		handle = 0;
+
+	/* such key can't possibly be in the vault */
+	if (strlen(id) >= MAX_ID_LENGTH)
+		PG_RETURN_NULL();
+
+	hash = vault_hash_id(id);
+
+	/* no partition for this database, so no keys */
+	if (! vault_lock(vault_stripe_index(hash), LW_SHARED, false))
+		PG_RETURN_NULL();
+
+	if ((bucket = vault_index_find(id, hash)) >= 0)
+	{
+		VaultItemCold	cold = VaultItemGetCold(vault_info, VaultBuckets(vault_info)[bucket].item - 1);
+
+		handle = VaultHandleMake(vault_stripe - vault_partition->stripes, cold->slot,
+								 VaultSlots(vault_info)[cold->slot].tag);
+	}
+
+	LWLockRelease(vault_stripe->lock);
+
+	if (bucket < 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(handle);
+}
+
+
+/*
+ * lookup a key by a handle (see key_handle)
+ *
+ * - handle (BIGINT)
+ *
+ * Returns NULL if the handle is not valid (e.g. when the key got deleted).
+ */
+Datum
+lookup_handle(PG_FUNCTION_ARGS)
+{
+	const bytea	*key;
+
+	if (! vault_fn_cache_get(fcinfo, 0, true, NULL, (const struct varlena **) &key))
+	{
+		uint32	version = 0;
+		bytea	*copy = vault_fetch_handle(PG_GETARG_INT64(0), &version);
+
+		key = (const bytea *) vault_fn_cache_set(fcinfo, 0, true, version,
+												 (struct varlena *) copy);
+
+		if (copy != NULL)
+		{
+			memset(copy, 0, VARSIZE_ANY(copy));
+			pfree(copy);
+		}
+	}
+
+	if (key != NULL)
+		PG_RETURN_BYTEA_P(vault_copy_wiped((const struct varlena *) key));
+
+	PG_RETURN_NULL();
+}
+
+
+/*
+ * lookup a key by a handle (see key_handle), returning a copy allocated in
+ * the current memory context, or NULL if the handle is not valid
+ *
+ * The backend-local cache is keyed by IDs, so it's not used here. The
+ * lock-free lookup is cheap, though, as it does not need to search the
+ * index at all.
+ */
+bytea *
+vault_get_key_handle(int64 handle)
+{
+	uint32	version;
+
+	return vault_fetch_handle(handle, &version);
+}
+
+
+/*
+ * lookup a key by a handle (see vault_get_key_handle), also returning the
+ * version of the key the handle references
+ */
+static bytea *
+vault_fetch_handle(int64 handle, uint32 *version)
+{
+	bytea	*key;
+	uint32	generation;
+
+	vault_stats_pending.lookups++;
+
+	/* no partition for this database (or a bogus handle), so no key */
+	if ((VaultHandleStripe(handle) >= vault_control->nstripes) || (! vault_attach(false)))
+	{
+		vault_stats_pending.misses++;
+		vault_stats_done();
+		return NULL;
+	}
+
+	vault_select(VaultHandleStripe(handle));
+
+	*version = 0;
+
+	if ((key = vault_lookup(NULL, 0, handle, &generation, version)) == NULL)
+		vault_stats_pending.misses++;
+
+	vault_stats_done();
+
+	return key;
+}
+
+
+/*
+ * lookup a passphrase for pgcrypto for the key with the given handle
+ */
+text *
+vault_get_passphrase_handle(int64 handle)
+{
+	uint32	version;
+
+	return vault_get_passphrase_handle_version(handle, &version);
+}
+
+
+/*
+ * lookup a passphrase for pgcrypto for the key with the given handle, and
+ * the version of the key (see vault_borrow_key_version)
+ */
+text *
+vault_get_passphrase_handle_version(int64 handle, uint32 *version)
+{
+	bytea	*key;
+	text	*passphrase;
+
+	if ((key = vault_fetch_handle(handle, version)) == NULL)
+		return NULL;
+
+	passphrase = vault_key_passphrase(key);
+
+	memset(key, 0, VARSIZE_ANY(key));
+	pfree(key);
+
+	return passphrase;
+}
+
+
+/*
+ * Per-call-site cache of the resolved key (or passphrase), kept in fn_extra.
+ *
+ * Queries usually pass the same (often constant) key ID for all rows, so we
+ * remember the last ID (or handle) and the value, and reuse it if the next
+ * call is for the same key, within the same statement. That's cheaper than
+ * even the backend-local cache (no string conversion, no hashing), and it
+ * also guarantees that a statement consistently uses the same key, even if
+ * the key is modified in the vault concurrently. Keys not found in the
+ * vault are cached too (as NULL).
+ *
+ * The version of the key is cached too, so that decryption (which needs
+ * the version the data was encrypted with) can reuse the value only when
+ * the version matches.
+ *
+ * The value is wiped when the memory context of the function goes away.
+ */
+typedef struct VaultFnCache
+{
+	TimestampTz		statement;	/* start of the statement (or 0 - invalid) */
+	text		   *id;			/* key ID (for !handle) */
+	int64			handle;		/* key handle (for handle) */
+	struct varlena *value;		/* key or passphrase (or NULL) */
+	uint32			version;	/* version of the key */
+	MemoryContextCallback	callback;	/* wipes the value */
+} VaultFnCache;
+
+static void vault_fn_cache_wipe(void *arg);
+
+/*
+ * get the value cached for the argument (ID or handle) of the call
+ *
+ * Returns false if there's no usable cached value. Otherwise returns true,
+ * with the cached value (or NULL when there was no such key). The value is
+ * not copied, it's valid until the next vault_fn_cache_set for the call
+ * site, and the caller must not modify it.
+ *
+ * With version (optional) set to a non-zero value, only a value for that
+ * version of the key is usable. The version of the cached value is set.
+ */
+bool
+vault_fn_cache_get(FunctionCallInfo fcinfo, int argno, bool handle,
+				   uint32 *version, const struct varlena **value)
+{
+	VaultFnCache *cache;
+
+	/* called directly, without flinfo (e.g. DirectFunctionCall) */
+	if ((fcinfo->flinfo == NULL) || (fcinfo->flinfo->fn_extra == NULL))
+		return false;
+
+	cache = (VaultFnCache *) fcinfo->flinfo->fn_extra;
+
+	if (cache->statement != GetCurrentStatementStartTimestamp())
+		return false;
+
+	if (handle)
+	{
+		if (cache->handle != PG_GETARG_INT64(argno))
+			return false;
+	}
+	else
+	{
+		text   *id = PG_GETARG_TEXT_PP(argno);
+
+		if ((VARSIZE_ANY_EXHDR(id) != VARSIZE_ANY_EXHDR(cache->id)) ||
+			(memcmp(VARDATA_ANY(id), VARDATA_ANY(cache->id), VARSIZE_ANY_EXHDR(id)) != 0))
+			return false;
+	}
+
+	if (version != NULL)
+	{
+		if ((*version != 0) && (*version != cache->version))
+			return false;
+
+		*version = cache->version;
+	}
+
+	*value = cache->value;
+
+	vault_stats_pending.lookups++;
+	vault_stats_pending.cache_hits++;
+
+	return true;
+}
+
+
+/*
+ * remember (a copy of) the value for the argument (ID or handle) of the call
+ *
+ * Returns the cached copy, valid just like the value from vault_fn_cache_get.
+ * Without a call site (e.g. with DirectFunctionCall) the copy is allocated
+ * in the secure memory context instead (see vault_secure_alloc).
+ */
+const struct varlena *
+vault_fn_cache_set(FunctionCallInfo fcinfo, int argno, bool handle,
+				   uint32 version, struct varlena *value)
+{
+	VaultFnCache *cache;
+	MemoryContext oldcontext;
+
+	if (fcinfo->flinfo == NULL)
+	{
+		struct varlena *copy = NULL;
+
+		if (value != NULL)
+		{
+			copy = (struct varlena *) vault_secure_alloc(VARSIZE_ANY(value));
+			memcpy(copy, value, VARSIZE_ANY(value));
+		}
+
+		return copy;
+	}
+
+	if (fcinfo->flinfo->fn_extra == NULL)
+	{
+		cache = (VaultFnCache *) MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+													  sizeof(VaultFnCache));
+
+		cache->callback.func = vault_fn_cache_wipe;
+		cache->callback.arg = cache;
+		MemoryContextRegisterResetCallback(fcinfo->flinfo->fn_mcxt, &cache->callback);
+
+		fcinfo->flinfo->fn_extra = cache;
+	}
+
+	cache = (VaultFnCache *) fcinfo->flinfo->fn_extra;
+
+	/* discard the previous value */
+	vault_fn_cache_wipe(cache);
+
+	if (cache->id != NULL)
+		pfree(cache->id);
+
+	cache->id = NULL;
+	cache->value = NULL;
+	cache->version = version;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	if (handle)
+		cache->handle = PG_GETARG_INT64(argno);
+	else
+	{
+		text   *id = PG_GETARG_TEXT_PP(argno);
+
+		cache->id = (text *) palloc(VARSIZE_ANY(id));
+		memcpy(cache->id, id, VARSIZE_ANY(id));
+	}
+
+	if (value != NULL)
+	{
+		cache->value = (struct varlena *) palloc(VARSIZE_ANY(value));
+		memcpy(cache->value, value, VARSIZE_ANY(value));
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	cache->statement = GetCurrentStatementStartTimestamp();
+
+	return cache->value;
+}
+
+
+/*
+ * wipe the value cached in fn_extra (when replaced, or when the memory
+ * context is reset or deleted)
+ */
+static void
+vault_fn_cache_wipe(void *arg)
+{
+	VaultFnCache *cache = (VaultFnCache *) arg;
+
+	if (cache->value != NULL)
+	{
+		memset(cache->value, 0, VARSIZE_ANY(cache->value));
+		pfree(cache->value);
+		cache->value = NULL;
+	}
+}
+
+
+/*
+ * Secure memory context for copies of keys (and passphrases) that can't be
+ * avoided, e.g. when borrowing a key that is not in the backend-local cache.
+ *
+ * All the chunks are wiped (and the context reset) at the end of the
+ * transaction, or when a new statement starts using the context, so that
+ * the keys don't linger in freed memory. The chunks are tracked in a list,
+ * which may also include memory handed over from the backend-local cache
+ * (keys borrowed in the statement, but evicted since).
+ */
+typedef struct VaultSecureChunk
+{
+	struct VaultSecureChunk *next;
+	void	   *data;			/* the chunk (varlena, for adopted chunks) */
+	Size		len;			/* length of the chunk (0 for adopted) */
+} VaultSecureChunk;
+
+static MemoryContext		vault_secure_context = NULL;
+static VaultSecureChunk	   *vault_secure_chunks = NULL;
+static TimestampTz			vault_secure_statement = 0;
+
+/* incremented whenever the context is reset (0 is never current) */
+static uint64				vault_secure_epoch = 1;
+
+static void vault_secure_begin(void);
+static void vault_secure_reset(void);
+static void vault_secure_xact_callback(XactEvent event, void *arg);
+
+/*
+ * allocate memory for a copy of key data, wiped at the end of the statement
+ * (or transaction)
+ */
+void *
+vault_secure_alloc(Size size)
+{
+	VaultSecureChunk *chunk;
+
+	vault_secure_begin();
+
+	chunk = (VaultSecureChunk *) MemoryContextAlloc(vault_secure_context,
+													MAXALIGN(sizeof(VaultSecureChunk)) + size);
+
+	chunk->data = (char *) chunk + MAXALIGN(sizeof(VaultSecureChunk));
+	chunk->len = size;
+	chunk->next = vault_secure_chunks;
+	vault_secure_chunks = chunk;
+
+	return chunk->data;
+}
+
+
+/*
+ * take over a varlena allocated elsewhere (in TopMemoryContext), so that
+ * it's wiped and freed along with the rest of the secure memory
+ */
+static void
+vault_secure_adopt(struct varlena *value)
+{
+	VaultSecureChunk *chunk;
+
+	vault_secure_begin();
+
+	chunk = (VaultSecureChunk *) MemoryContextAlloc(vault_secure_context,
+													sizeof(VaultSecureChunk));
+
+	chunk->data = value;
+	chunk->len = 0;
+	chunk->next = vault_secure_chunks;
+	vault_secure_chunks = chunk;
+}
+
+
+/*
+ * make sure the secure context exists, and discard chunks from statements
+ * that already finished
+ */
+static void
+vault_secure_begin(void)
+{
+	if (vault_secure_context == NULL)
+	{
+		vault_secure_context = AllocSetContextCreate(TopMemoryContext,
+													 "pg_vault secure",
+													 ALLOCSET_SMALL_SIZES);
+
+		RegisterXactCallback(vault_secure_xact_callback, NULL);
+	}
+
+	if (vault_secure_statement != GetCurrentStatementStartTimestamp())
+	{
+		vault_secure_reset();
+		vault_secure_statement = GetCurrentStatementStartTimestamp();
+	}
+}
+
+
+/*
+ * wipe all the chunks, and reset the context
+ */
+static void
+vault_secure_reset(void)
+{
+	VaultSecureChunk *chunk;
+
+	for (chunk = vault_secure_chunks; chunk != NULL; chunk = chunk->next)
+	{
+		if (chunk->len > 0)
+			memset(chunk->data, 0, chunk->len);
+		else
+		{
+			memset(chunk->data, 0, VARSIZE_ANY(chunk->data));
+			pfree(chunk->data);
+		}
+	}
+
+	vault_secure_chunks = NULL;
+	vault_secure_epoch++;
+
+	if (vault_secure_context != NULL)
+		MemoryContextReset(vault_secure_context);
+}
+
+
+static void
+vault_secure_xact_callback(XactEvent event, void *arg)
+{
+	if ((event == XACT_EVENT_COMMIT) || (event == XACT_EVENT_ABORT) ||
+		(event == XACT_EVENT_PREPARE) || (event == XACT_EVENT_PARALLEL_COMMIT) ||
+		(event == XACT_EVENT_PARALLEL_ABORT))
+	{
+		vault_secure_reset();
+		vault_secure_statement = 0;
+	}
+}
+
+
+/*
+ * copy a key (or passphrase) for a function result
+ *
+ * The result has to live in the current memory context (the executor owns
+ * it), so we can't avoid the copy. But we register a reset callback with
+ * the context, so that the copy is wiped when the context gets reset (e.g.
+ * the per-tuple context), instead of lingering in the freed memory.
+ */
+struct varlena *
+vault_copy_wiped(const struct varlena *value)
+{
+	MemoryContextCallback  *callback;
+	struct varlena		   *copy;
+
+	callback = (MemoryContextCallback *) palloc(MAXALIGN(sizeof(MemoryContextCallback)) +
+												VARSIZE_ANY(value));
+
+	copy = (struct varlena *) ((char *) callback + MAXALIGN(sizeof(MemoryContextCallback)));
+	memcpy(copy, value, VARSIZE_ANY(value));
+
+	callback->func = vault_copy_wipe;
+	callback->arg = copy;
+
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, callback);
+
+	return copy;
+}
+
+
+static void
+vault_copy_wipe(void *arg)
+{
+	memset(arg, 0, VARSIZE_ANY(arg));
+}
+
+
+/*
+ * lookup a key in the vault (used both by the SQL-level lookup and by the
+ * native encrypt/decrypt functions)
+ *
+ * Returns a copy of the key allocated in the current memory context, or
+ * NULL if there's no key with such ID.
+ */
+bytea *
+vault_get_key(const char *id)
+{
+	uint32	generation;
+	uint32	version;
+
+	return vault_fetch_key(id, &generation, &version);
+}
+
+
+/*
+ * lookup a key in the vault (see vault_get_key), also returning the
+ * generation of the stripe the key is consistent with, and the version
+ * of the key (the current one)
+ *
+ * With an external backend, keys not found in the vault are requested from
+ * the backend worker, and once it caches them we simply look again.
+ */
+static bytea *
+vault_fetch_key(const char *id, uint32 *generation, uint32 *version)
+{
+	bytea	*key;
+
+	key = vault_fetch_local(id, generation, version);
+
+	if ((key == NULL) && vault_backend_enabled() && (strlen(id) < MAX_ID_LENGTH))
+	{
+		char   *ids[1];
+
+		ids[0] = (char *) id;
+		vault_backend_fetch(1, ids);
+
+		key = vault_fetch_local(id, generation, version);
+	}
+
+	return key;
+}
+
+
+/*
+ * lookup a key in the vault only (without asking the external backend)
+ */
+static bytea *
+vault_fetch_local(const char *id, uint32 *generation, uint32 *version)
+{
+	bytea	*key = NULL;
+	uint32	hash;
+
+	vault_stats_pending.lookups++;
+
+	/* such key can't possibly be in the vault (or no partition, so no keys) */
+	if ((strlen(id) >= MAX_ID_LENGTH) || (! vault_attach(false)))
+	{
+		vault_stats_pending.misses++;
+		vault_stats_done();
+		return NULL;
+	}
+
+	hash = vault_hash_id(id);
+
+	vault_select(vault_stripe_index(hash));
+
+	/*
+	 * Try the backend-local cache first, the entry has to match the current
+	 * generation of the stripe. If there's a write in progress, we can't
+	 * validate the entry.
+	 */
+	*generation = pg_atomic_read_u32(&vault_stripe->generation);
+
+	if ((*generation % 2) == 0)
+	{
+		if ((key = vault_cache_lookup(id, *generation, version)) != NULL)
+		{
+			vault_stats_pending.cache_hits++;
+			vault_stats_use(id);
+			vault_stats_done();
+			return key;
+		}
+	}
+
+	/* find the matching item and copy the key (without locking) */
+	*version = 0;
+	key = vault_lookup(id, hash, 0, generation, version);
+
+	if (key != NULL)
+	{
+		vault_cache_store(id, key, *version, *generation);
+		vault_stats_use(id);
+	}
+	else
+		vault_stats_pending.misses++;
+
+	vault_stats_done();
+
+	return key;
+}
+
+
+/*
+ * lookup a particular version of a key (bypassing the backend-local cache,
+ * which has only the current versions)
+ *
+ * The external backend has no notion of versions, so it's not asked for
+ * the key. Returns NULL if there's no such version of the key.
+ */
+static bytea *
+vault_fetch_version(const char *id, uint32 version)
+{
+	bytea	*key;
+	uint32	generation;
+	uint32	hash;
+
+	vault_stats_pending.lookups++;
+
+	/* such key can't possibly be in the vault (or no partition, so no keys) */
+	if ((strlen(id) >= MAX_ID_LENGTH) || (! vault_attach(false)))
+	{
+		vault_stats_pending.misses++;
+		vault_stats_done();
+		return NULL;
+	}
+
+	hash = vault_hash_id(id);
+
+	vault_select(vault_stripe_index(hash));
+
+	if ((key = vault_lookup(id, hash, 0, &generation, &version)) != NULL)
+		vault_stats_use(id);
+	else
+		vault_stats_pending.misses++;
+
+	vault_stats_done();
+
+	return key;
+}
+
+
+/*
+ * lookup a passphrase for pgcrypto derived from the key (by the native
+ * encrypt/decrypt functions)
+ *
+ * The passphrase is cached along with the key, so that we don't need to
+ * rebuild it for each row, when encrypting/decrypting many values with
+ * the same key. Returns a copy allocated in the current memory context,
+ * or NULL if there's no key with such ID.
+ */
+text *
+vault_get_passphrase(const char *id)
+{
+	const text *borrowed;
+	text	   *passphrase;
+
+	if ((borrowed = vault_borrow_passphrase(id)) == NULL)
+		return NULL;
+
+	passphrase = (text *) palloc(VARSIZE_ANY(borrowed));
+	memcpy(passphrase, borrowed, VARSIZE_ANY(borrowed));
+
+	return passphrase;
+}
+
+
+/*
+ * borrow a key from the vault, without copying it (if possible)
+ *
+ * Returns the key from the backend-local cache, which remains valid until
+ * the end of the statement (even if the entry gets evicted in the meantime).
+ * If the key can't be cached, it's copied into the secure memory context.
+ * The caller must not modify the key. Returns NULL if there's no such key.
+ */
+const bytea *
+vault_borrow_key(const char *id)
+{
+	uint32	version = 0;
+
+	return vault_borrow_key_version(id, &version);
+}
+
+
+/*
+ * borrow a particular version of a key from the vault (see vault_borrow_key)
+ *
+ * With version set to 0 this borrows the current version, and sets the
+ * version (e.g. to tag data encrypted with the key). Other versions are
+ * not cached, so those are always copied.
+ */
+const bytea *
+vault_borrow_key_version(const char *id, uint32 *version)
+{
+	VaultCacheEntry *entry;
+	bytea	   *key;
+	bytea	   *copy;
+	uint32		current;
+
+	if (((entry = vault_cache_get(id, &key, &current)) != NULL) &&
+		((*version == 0) || (*version == entry->version)))
+	{
+		vault_secure_begin();
+		entry->borrowed = vault_secure_epoch;
+
+		*version = entry->version;
+
+		return entry->key;
+	}
+
+	/* not the version we're looking for */
+	if ((key != NULL) && (*version != 0) && (*version != current))
+	{
+		memset(key, 0, VARSIZE_ANY(key));
+		pfree(key);
+		key = NULL;
+	}
+
+	if ((key == NULL) && (*version != 0))
+		key = vault_fetch_version(id, *version);
+	else if (key != NULL)
+		*version = current;
+
+	if (key == NULL)
+		return NULL;
+
+	copy = (bytea *) vault_secure_alloc(VARSIZE_ANY(key));
+	memcpy(copy, key, VARSIZE_ANY(key));
+
+	memset(key, 0, VARSIZE_ANY(key));
+	pfree(key);
+
+	return copy;
+}
+
+
+/*
+ * borrow a passphrase for pgcrypto derived from the key (see
+ * vault_borrow_key, the same rules apply)
+ */
+const text *
+vault_borrow_passphrase(const char *id)
+{
+	uint32	version = 0;
+
+	return vault_borrow_passphrase_version(id, &version);
+}
+
+
+/*
+ * borrow a passphrase for pgcrypto derived from a particular version of the
+ * key (see vault_borrow_key_version, the same rules apply)
+ */
+const text *
+vault_borrow_passphrase_version(const char *id, uint32 *version)
+{
+	VaultCacheEntry *entry;
+	bytea	   *key;
+	text	   *passphrase;
+	text	   *copy;
+	uint32		current;
+
+	if (((entry = vault_cache_get(id, &key, &current)) != NULL) &&
+		((*version == 0) || (*version == entry->version)))
+	{
+		/* built on first use, and then cached along with the key */
+		if (entry->passphrase == NULL)
+		{
+			passphrase = vault_key_passphrase(entry->key);
+
+			entry->passphrase = (text *) MemoryContextAlloc(TopMemoryContext,
+															VARSIZE_ANY(passphrase));
+			memcpy(entry->passphrase, passphrase, VARSIZE_ANY(passphrase));
+
+			memset(passphrase, 0, VARSIZE_ANY(passphrase));
+			pfree(passphrase);
+		}
+
+		vault_secure_begin();
+		entry->borrowed = vault_secure_epoch;
+
+		*version = entry->version;
+
+		return entry->passphrase;
+	}
+
+	/* not the version we're looking for */
+	if ((key != NULL) && (*version != 0) && (*version != current))
+	{
+		memset(key, 0, VARSIZE_ANY(key));
+		pfree(key);
+		key = NULL;
+	}
+
+	if ((key == NULL) && (*version != 0))
+		key = vault_fetch_version(id, *version);
+	else if (key != NULL)
+		*version = current;
+
+	if (key == NULL)
+		return NULL;
+
+	passphrase = vault_key_passphrase(key);
+
+	copy = (text *) vault_secure_alloc(VARSIZE_ANY(passphrase));
+	memcpy(copy, passphrase, VARSIZE_ANY(passphrase));
+
+	memset(key, 0, VARSIZE_ANY(key));
+	pfree(key);
+
+	memset(passphrase, 0, VARSIZE_ANY(passphrase));
+	pfree(passphrase);
+
+	return copy;
+}
+
+
+/*
+ * get the backend-local cache entry for a key, fetching the key into the
+ * cache first if needed
+ *
+ * Returns NULL if there's no such key, or if the key can't be cached (e.g.
+ * with the cache disabled, or during a concurrent write). In that case the
+ * key is returned in 'key' (a copy in the current memory context), with
+ * the version of the key.
+ */
+static VaultCacheEntry *
+vault_cache_get(const char *id, bytea **key, uint32 *version)
+{
+	VaultCacheEntry *entry;
+	uint32	generation = 1;		/* odd, i.e. can't validate cache entries */
+
+	*key = NULL;
+	*version = 0;
+
+	/* such key can't possibly be in the vault */
+	if (strlen(id) >= MAX_ID_LENGTH)
+		return NULL;
+
+	/* no partition for this database, so no keys (unless in the backend) */
+	if (! vault_attach(false) && ! vault_backend_enabled())
+		return NULL;
+
+	if (vault_partition != NULL)
+	{
+		vault_select(vault_stripe_index(vault_hash_id(id)));
+
+		generation = pg_atomic_read_u32(&vault_stripe->generation);
+	}
+
+	if (((generation % 2) == 0) &&
+		((entry = vault_cache_find(id, generation)) != NULL))
+	{
+		vault_stats_pending.lookups++;
+		vault_stats_pending.cache_hits++;
+		vault_stats_use(id);
+		vault_stats_done();
+
+		return entry;
+	}
+
+	/* this also adds the key to the cache (if possible) */
+	if ((*key = vault_fetch_key(id, &generation, version)) == NULL)
+		return NULL;
+
+	/* the entry (if any) is for the key we just fetched */
+	if ((entry = vault_cache_find(id, generation)) != NULL)
+	{
+		memset(*key, 0, VARSIZE_ANY(*key));
+		pfree(*key);
+		*key = NULL;
+	}
+
+	return entry;
+}
+
+
+/*
+ * State of pg_vault_lookup_many, i.e. keys for all the IDs (resolved on the
+ * first call, returned one by one).
+ */
+typedef struct VaultLookupState
+{
+	int		nkeys;
+	text  **ids;		/* key IDs (as passed in the array) */
+	bytea **keys;		/* keys (NULL when not found) */
+} VaultLookupState;
+
+/*
+ * lookup many keys at once (returns rows with ID and key)
+ *
+ * - ids (TEXT[])
+ *
+ * All the keys are resolved under a single acquisition of the locks, so that
+ * the result is consistent (and it's cheaper than a lock-free lookup for
+ * each key, which needs to deal with concurrent writes). For IDs that are
+ * not in the vault, the key is NULL. NULL IDs are ignored.
+ */
+Datum
+lookup_keys(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		ArrayType  *array;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int			i;
+		char	  **ids;
+		uint32	   *hashes;
+		VaultKeyBuffer	buffer;
+
+		VaultLookupState *state;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		array = PG_GETARG_ARRAYTYPE_P(0);
+
+		deconstruct_array(array, TEXTOID, -1, false, 'i',
+						  &elems, &nulls, &nelems);
+
+		state = (VaultLookupState *) palloc0(sizeof(VaultLookupState));
+		state->ids = (text **) palloc0(nelems * sizeof(text *));
+		state->keys = (bytea **) palloc0(nelems * sizeof(bytea *));
+
+		/* prepare the IDs and hashes outside the locked section */
+		ids = (char **) palloc0(nelems * sizeof(char *));
+		hashes = (uint32 *) palloc0(nelems * sizeof(uint32));
+
+		for (i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				continue;
+
+			state->ids[state->nkeys] = DatumGetTextP(elems[i]);
+			ids[state->nkeys] = text_to_cstring(state->ids[state->nkeys]);
+			hashes[state->nkeys] = vault_hash_id(ids[state->nkeys]);
+
+			state->nkeys++;
+		}
+
+		/* without a partition for this database, all the keys are NULL */
+		if (vault_lock_all(LW_SHARED, false))
+		{
+			for (i = 0; i < state->nkeys; i++)
+			{
+				Size	len;
+				uint32	version;
+
+				/* such key can't possibly be in the vault */
+				if (strlen(ids[i]) >= MAX_ID_LENGTH)
+					continue;
+
+				vault_select(vault_stripe_index(hashes[i]));
+				vault_refresh();
+
+				version = 0;
+
+				if (! vault_read_key(ids[i], hashes[i], buffer.data, &version))
+					continue;
+
+				len = VARSIZE_ANY(buffer.data);
+
+				state->keys[i] = (bytea *) palloc(len);
+				memcpy(state->keys[i], buffer.data, len);
+
+				vault_stats_use(ids[i]);
+			}
+
+			vault_unlock_all();
+		}
+
+		/* request the missing keys from the backend at once, and look again */
+		if (vault_backend_enabled())
+		{
+			int		nmissing = 0;
+			char  **missing = (char **) palloc0(Max(1, state->nkeys) * sizeof(char *));
+
+			for (i = 0; i < state->nkeys; i++)
+				if ((state->keys[i] == NULL) && (strlen(ids[i]) < MAX_ID_LENGTH))
+					missing[nmissing++] = ids[i];
+
+			if (nmissing > 0)
+				vault_backend_fetch(nmissing, missing);
+
+			for (i = 0; (nmissing > 0) && (i < state->nkeys); i++)
+			{
+				uint32	generation;
+				uint32	version;
+
+				if ((state->keys[i] == NULL) && (strlen(ids[i]) < MAX_ID_LENGTH))
+					state->keys[i] = vault_fetch_local(ids[i], &generation, &version);
+			}
+
+			pfree(missing);
+		}
+
+		/* count the misses only now (the keys are set only when found) */
+		vault_stats_pending.lookups += state->nkeys;
+
+		for (i = 0; i < state->nkeys; i++)
+			if (state->keys[i] == NULL)
+				vault_stats_pending.misses++;
+
+		vault_stats_done();
+
+		/* don't leave the key on the stack */
+		memset(buffer.data, 0, MAX_KEY_LENGTH);
+
+		funcctx->max_calls = state->nkeys;
+		funcctx->user_fctx = state;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	tuple;
+		Datum		values[2];
+		bool		nulls[2];
+
+		VaultLookupState *state = (VaultLookupState *) funcctx->user_fctx;
+		bytea	   *key = state->keys[funcctx->call_cntr];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = PointerGetDatum(state->ids[funcctx->call_cntr]);
+
+		if (key != NULL)
+			values[1] = PointerGetDatum(key);
+		else
+			nulls[1] = true;
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* the key got copied into the tuple, so wipe it */
+		if (key != NULL)
+			memset(key, 0, VARSIZE_ANY(key));
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * copy info about all the keys in the vault (without the key data), or
+ * just the keys with IDs starting with the prefix (if not NULL)
+ *
+ * Copy just the info we need, which is much less than the whole vault. The
+ * shared locks only block writers. The matching keys are found using the
+ * ordered index, so with a prefix we don't look at the other keys at all.
+ * Returns NULL when there's no partition for the database (no keys).
+ */
+static VaultKeyInfo *
+vault_list_keys(const char *prefix, int *nkeys)
+{
+	int				i,
+					j,
+					n = 0;
+	int				len = (prefix != NULL) ? strlen(prefix) : 0;
+	int			   *first,
+				   *last;
+	VaultKeyInfo   *keys;
+
+	*nkeys = 0;
+
+	if (! vault_lock_all(LW_SHARED, false))
+		return NULL;
+
+	first = (int *) palloc(vault_control->nstripes * sizeof(int));
+	last = (int *) palloc(vault_control->nstripes * sizeof(int));
+
+	/* range of the ordered index with the matching keys, in each stripe */
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		uint32	   *order;
+
+		vault_select(j);
+		vault_refresh();
+
+		order = VaultOrder(vault_info);
+
+		if (prefix == NULL)
+		{
+			first[j] = 0;
+			last[j] = vault_info->nitems;
+		}
+		else
+		{
+			first[j] = vault_order_search(prefix, len, 0);
+			last[j] = first[j];
+
+			while ((last[j] < vault_info->nitems) &&
+				   vault_order_prefix(&VaultItems(vault_info)[order[last[j]]], prefix, len))
+				last[j]++;
+		}
+
+		*nkeys += (last[j] - first[j]);
+	}
+
+	keys = (VaultKeyInfo *) palloc(Max(1, *nkeys) * sizeof(VaultKeyInfo));
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		uint32	   *order;
+
+		vault_select(j);
+		vault_refresh();
+
+		order = VaultOrder(vault_info);
+
+		for (i = first[j]; i < last[j]; i++)
+		{
+			VaultItem	item = &VaultItems(vault_info)[order[i]];
+
+			keys[n].id = pnstrdup(VaultItemId(vault_info, item), item->id_len);
+			keys[n].length = item->key_len - VARHDRSZ;
+			keys[n].comment = pnstrdup(VaultItemComment(vault_info, item), item->comment_len);
+			keys[n].uses = pg_atomic_read_u32(&VaultItemGetCold(vault_info, order[i])->uses);
+			keys[n].version = item->version;
+
+			n++;
+		}
+	}
+
+	vault_unlock_all();
+
+	pfree(first);
+	pfree(last);
+
+	return keys;
+}
+
+
+/*
+ * list all keys from a vault (without the key data)
+ *
+ * - prefix (TEXT, optional)
+ *
+ * With a prefix, only keys with IDs starting with it are listed.
+ */
+Datum
+list_keys(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+	AttInMetadata   *attinmeta;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL())
+	{
+
+		MemoryContext oldcontext;
+		int				nkeys;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		funcctx->user_fctx = vault_list_keys((PG_NARGS() > 0) ?
+											 text_to_cstring(PG_GETARG_TEXT_PP(0)) : NULL,
+											 &nkeys);
+		funcctx->max_calls = nkeys;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		/*
+		 * generate attribute metadata needed later to produce tuples from raw
+		 * C strings
+		 */
+		attinmeta = TupleDescGetAttInMetadata(tupdesc);
+		funcctx->attinmeta = attinmeta;
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   result;
+		Datum		   values[4];
+		bool			nulls[4];
+
+		VaultKeyInfo   *key = &((VaultKeyInfo *) funcctx->user_fctx)[funcctx->call_cntr];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		/* key ID */
+		values[0] = CStringGetTextDatum(key->id);
+		values[1] = Int32GetDatum(key->length);
+		values[2] = CStringGetTextDatum(key->comment);
+		values[3] = Int32GetDatum((int32) key->version);
+
+		/* Build and return the tuple. */
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		/* make the tuple into a datum */
+		result = HeapTupleGetDatum(tuple);
+
+		/* Here we want to return another item: */
+		SRF_RETURN_NEXT(funcctx, result);
+
+	}
+	else
+	{
+		/* Here we are done returning items and just need to clean up: */
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+
+/*
+ * delete all the keys from a vault
+ *
+ * This only resets the vault logically (so that the exclusive lock is held
+ * only very briefly, no matter how large the segment is) - the index is
+ * invalidated by incrementing the epoch, and the arena is marked as empty.
+ * The memory with the keys is then wiped by the scrubber, in small chunks
+ * (see vault_scrub), and we wake it up right away.
+ */
+Datum
+delete_keys(PG_FUNCTION_ARGS)
+{
+	/* no partition for this database, so no keys */
+	if (vault_attach(false))
+		vault_delete_all();
+
+	vault_stats_done();
+
+	/* the standbys delete the keys too */
+	vault_log_delete_all();
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * delete all the keys with IDs starting with the prefix from a vault
+ *
+ * - prefix (TEXT)
+ *
+ * The keys are found using the ordered index, so this does not need to walk
+ * all the keys in the vault. All versions of the keys are deleted. Returns
+ * the number of deleted keys (counting each version separately).
+ */
+Datum
+delete_keys_prefix(PG_FUNCTION_ARGS)
+{
+	int			ndeleted = 0;
+	char	   *prefix;
+
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "key prefix must not be NULL");
+
+	prefix = text_to_cstring(PG_GETARG_TEXT_P(0));
+
+	/* no partition for this database, so no keys */
+	if (vault_attach(false))
+		ndeleted = vault_delete_prefix(prefix);
+
+	vault_stats_done();
+
+	/* the standbys delete the keys too */
+	vault_log_delete_prefix(prefix);
+
+	PG_RETURN_INT32(ndeleted);
+}
+
+
+/*
+ * delete the keys with IDs starting with the prefix from the current
+ * partition (see delete_keys_prefix)
+ *
+ * In each stripe the matching keys are a contiguous range of the ordered
+ * index. We delete them from the end of the range, because deleting an item
+ * only shifts the entries after it (and the moved item keeps its position).
+ */
+static int
+vault_delete_prefix(const char *prefix)
+{
+	int			j,
+				ndeleted = 0;
+	int			len = strlen(prefix);
+
+	vault_lock_all(LW_EXCLUSIVE, false);
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		uint32	   *order;
+		int			first,
+					last;
+
+		vault_select(j);
+		vault_refresh();
+
+		order = VaultOrder(vault_info);
+
+		first = vault_order_search(prefix, len, 0);
+		last = first;
+
+		while ((last < vault_info->nitems) &&
+			   vault_order_prefix(&VaultItems(vault_info)[order[last]], prefix, len))
+			last++;
+
+		while (last > first)
+		{
+			VaultItem	item = &VaultItems(vault_info)[order[last - 1]];
+			char	   *id = VaultItemId(vault_info, item);
+			int			bucket;
+
+			bucket = vault_index_find_version(id, vault_hash_id(id), item->version);
+
+			Assert(bucket >= 0);
+
+			vault_delete_item(bucket);
+
+			last--;
+			ndeleted++;
+		}
+	}
+
+	vault_unlock_all();
+
+	return ndeleted;
+}
+
+
+/*
+ * delete all the keys from the current partition (see delete_keys)
+ */
+static void
+vault_delete_all(void)
+{
+	int			j;
+	Latch	   *latch;
+
+	vault_lock_all(LW_EXCLUSIVE, false);
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		vault_select(j);
+		vault_refresh();
+
+		vault_stats_pending.deletes += vault_info->nitems;
+
+		vault_write_begin();
+
+		/* all the data up to arena_used may contain keys, so scrub that too */
+		vault_info->scrub_end = Max(vault_info->scrub_end, vault_info->arena_used);
+		vault_info->scrub_offset = 0;
+		vault_info->scrub_bucket = 0;
+
+		/* buckets from the previous epochs are empty */
+		vault_info->epoch++;
+
+		/* reset the counters after 'nitems' (but not the items themselves) */
+		memset((char*)vault_info + offsetof(VaultInfoData, nitems), 0,
+			   sizeof(VaultInfoData) - offsetof(VaultInfoData, nitems));
+
+		pg_atomic_write_u32(&vault_stripe->nexpiring, 0);
+
+		vault_write_end();
+	}
+
+	latch = vault_control->scrub_latch;
+
+	vault_unlock_all();
+
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+
+/*
+ * usage statistics of the vault partition for the current database
+ *
+ * The counters are cumulative since the start (partitions are assigned
+ * until a restart), and include the statistics of this backend. Other
+ * backends add their statistics in batches, so those may lag a bit.
+ */
+Datum
+vault_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	HeapTuple	tuple;
+	Datum		values[12];
+	bool		nulls[12];
+	uint64		lookups,
+				cache_hits;
+	int			j;
+	int			nkeys = 0,
+				maxitems = 0;
+	Size		size = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	memset(values, 0, sizeof(values));
+	memset(nulls, 0, sizeof(nulls));
+
+	/* no partition for this database, so no statistics either */
+	if (! vault_attach(false))
+	{
+		memset(nulls, true, sizeof(nulls));
+		tuple = heap_form_tuple(tupdesc, values, nulls);
+		PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+	}
+
+	vault_stats_flush(true);
+
+	lookups = pg_atomic_read_u64(&vault_partition->stats.lookups);
+	cache_hits = pg_atomic_read_u64(&vault_partition->stats.cache_hits);
+
+	values[0] = Int64GetDatum(lookups);
+	values[1] = Int64GetDatum(pg_atomic_read_u64(&vault_partition->stats.misses));
+	values[2] = Int64GetDatum(cache_hits);
+
+	if (lookups > 0)
+		values[3] = Float8GetDatum((double) cache_hits / lookups);
+	else
+		nulls[3] = true;
+
+	values[4] = Int64GetDatum(pg_atomic_read_u64(&vault_partition->stats.adds));
+	values[5] = Int64GetDatum(pg_atomic_read_u64(&vault_partition->stats.deletes));
+	values[6] = Int64GetDatum(pg_atomic_read_u64(&vault_partition->stats.lock_waits));
+
+	/* in milliseconds, like the timing in pg_stat_statements */
+	values[7] = Float8GetDatum(pg_atomic_read_u64(&vault_partition->stats.lock_wait_time) / 1000.0);
+
+	/* current fill of the stripes (this waits for the writers, not counted) */
+	vault_lock_all(LW_SHARED, false);
+
+	for (j = 0; j < vault_control->nstripes; j++)
+	{
+		vault_select(j);
+		vault_refresh();
+
+		nkeys += vault_info->nitems;
+		maxitems += vault_info->maxitems;
+		size += vault_info->size;
+	}
+
+	vault_unlock_all();
+
+	values[8] = Int32GetDatum(nkeys);
+	values[9] = Int32GetDatum(maxitems);
+	values[10] = Float8GetDatum((double) nkeys / maxitems);
+	values[11] = Int64GetDatum(size);
+
+	tuple = heap_form_tuple(tupdesc, values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+
+/*
+ * list all keys from a vault, with the number of uses
+ *
+ * The uses are counted by lookups of the key (including those served by
+ * the backend cache, but not lookups by handle, which don't know the ID).
+ * Backends add them to the vault in batches, so those may lag a bit (except
+ * for this backend). The counters are reset when the key gets deleted and
+ * added again.
+ */
+Datum
+key_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	TupleDesc	   tupdesc;
+
+	/* init on the first call */
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		int				nkeys;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* make our own uses visible */
+		if (vault_attach(false))
+			vault_stats_flush(true);
+
+		funcctx->user_fctx = vault_list_keys(NULL, &nkeys);
+		funcctx->max_calls = nkeys;
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* switch back to the old context */
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* init the context */
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* check if we have more data */
+	if (funcctx->max_calls > funcctx->call_cntr)
+	{
+		HeapTuple	   tuple;
+		Datum		   values[2];
+		bool			nulls[2];
+
+		VaultKeyInfo   *key = &((VaultKeyInfo *) funcctx->user_fctx)[funcctx->call_cntr];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = CStringGetTextDatum(key->id);
+		values[1] = Int64GetDatum((int64) key->uses);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * wipe a chunk of the memory released by delete_keys (called by the scrubber)
+ *
+ * Returns true if there's more to scrub. We do at most VAULT_SCRUB_CHUNK
+ * bytes at a time, so that the exclusive lock is held only briefly. None of
+ * this is live data, so the generation does not change (the readers see the
+ * same logical contents before and after).
+ *
+ * This also frees the storages replaced by larger ones (those were wiped
+ * when replaced), once no reader can be looking at them (see vault_reclaim).
+ * A reader still holding a retired storage does not count as more work, it
+ * gets freed the next time the scrubber runs.
+ */
+bool
+vault_scrub(void)
+{
+	int		i,
+			j;
+	bool	more = false;
+
+	/* nothing to scrub until someone uses the vault */
+	if (! vault_attach_area(false))
+		return false;
+
+	/*
+	 * The scrubber is not connected to any database, so it simply switches
+	 * between the partitions (and stripes).
+	 */
+	for (i = 0; i < vault_control->npartitions; i++)
+	{
+		vault_partition = VaultGetPartition(vault_control, i);
+
+		if (vault_partition->dbid == InvalidOid)
+			continue;
+
+		pg_read_barrier();
+
+		for (j = 0; j < vault_control->nstripes; j++)
+		{
+			vault_select(j);
+
+			if (vault_scrub_stripe())
+				more = true;
+		}
+	}
+
+	vault_partition = NULL;
+
+	return more;
+}
+
+
+/*
+ * wipe a chunk of the memory in the current stripe
+ */
+static bool
+vault_scrub_stripe(void)
+{
+	bool	more;
+
+	LWLockAcquire(vault_stripe->lock, LW_EXCLUSIVE);
+
+	vault_refresh();
+
+	if (vault_info->scrub_offset < vault_info->scrub_end)
+	{
+		/* the arena up to arena_used has been allocated again */
+		Size	start = Max(vault_info->scrub_offset, vault_info->arena_used);
+		Size	end = Min(start + VAULT_SCRUB_CHUNK, vault_info->scrub_end);
+
+		if (start < end)
+			memset(VaultArena(vault_info) + start, 0, end - start);
+
+		vault_info->scrub_offset = end;
+	}
+	else if (vault_info->scrub_bucket < vault_info->nbuckets)
+	{
+		VaultBucket	buckets = VaultBuckets(vault_info);
+		int			end = Min(vault_info->scrub_bucket + VAULT_SCRUB_CHUNK / sizeof(VaultBucketData),
+							  vault_info->nbuckets);
+		int			i;
+
+		/* only the buckets from the previous epochs (the item goes first) */
+		for (i = vault_info->scrub_bucket; i < end; i++)
+		{
+			if ((buckets[i].item != 0) && (buckets[i].epoch != vault_info->epoch))
+			{
+				buckets[i].item = 0;
+				buckets[i].hash = 0;
+				buckets[i].epoch = 0;
+			}
+		}
+
+		vault_info->scrub_bucket = end;
+	}
+
+	vault_reclaim();
+
+	more = (vault_info->scrub_offset < vault_info->scrub_end) ||
+		   (vault_info->scrub_bucket < vault_info->nbuckets);
+
+	LWLockRelease(vault_stripe->lock);
+
+	return more;
+}
+
+
+/*
+ * free the retired storages of the current stripe no reader can be looking
+ * at anymore (the caller holds the lock in exclusive mode)
+ *
+ * A storage retired in epoch R may still be read by processes that announced
+ * an earlier epoch. The list starts with the latest storage, and the epochs
+ * only increase, so once we find a storage retired no later than the oldest
+ * epoch announced by the readers, that storage and all the older ones can be
+ * freed.
+ */
+static void
+vault_reclaim(void)
+{
+	dsa_pointer	   *prev = &vault_stripe->retired;
+	dsa_pointer		storage = vault_stripe->retired;
+	uint64			oldest;
+
+	if (! DsaPointerIsValid(storage))
+		return;
+
+	oldest = vault_readers_oldest();
+
+	while (DsaPointerIsValid(storage))
+	{
+		VaultInfo	info = (VaultInfo) dsa_get_address(vault_area, storage);
+
+		if (info->retired_epoch <= oldest)
+			break;
+
+		prev = &info->retired_next;
+		storage = info->retired_next;
+	}
+
+	*prev = InvalidDsaPointer;
+
+	while (DsaPointerIsValid(storage))
+	{
+		dsa_pointer	next = ((VaultInfo) dsa_get_address(vault_area, storage))->retired_next;
+
+		dsa_free(vault_area, storage);
+
+		storage = next;
+	}
+}
+
+
+/*
+ * oldest epoch announced by the lock-free readers (PG_UINT64_MAX if there
+ * are no readers at the moment)
+ *
+ * The caller published the storage replacing the retired ones before (and
+ * took the lock since), so a reader either announced its epoch already, or
+ * it will see the new storage - the barrier pairs with vault_read_begin.
+ */
+static uint64
+vault_readers_oldest(void)
+{
+	VaultReader	readers = (VaultReader) dsa_get_address(vault_area,
+														vault_control->readers);
+	uint64		oldest = PG_UINT64_MAX;
+	int			i;
+
+	pg_memory_barrier();
+
+	for (i = 0; i < vault_control->nreaders; i++)
+	{
+		uint64	epoch = pg_atomic_read_u64(&readers[i].epoch);
+
+		if ((epoch != 0) && (epoch < oldest))
+			oldest = epoch;
+	}
+
+	return oldest;
+}
+
+
+/*
+ * set (or reset) the latch the scrubber waits on
+ */
+void
+vault_scrub_set_latch(Latch *latch)
+{
+	LWLockAcquire(vault_control->lock, LW_EXCLUSIVE);
+	vault_control->scrub_latch = latch;
+	LWLockRelease(vault_control->lock);
+}
+
+
+/*
+ * hash of the key ID (used by the hash index)
+ */
+static uint32
+vault_hash_id(const char *id)
+{
+	return DatumGetUInt32(hash_any((const unsigned char *) id, strlen(id)));
+}
+
+
+/*
+ * find the bucket of the hash index referencing item with the given key ID
+ *
+ * Returns index of the bucket, or -1 if there's no such key in the vault.
+ *
+ * This may be called without holding the vault lock, by readers protected
+ * by the generation counter only (see vault_lookup). The vault may be
+ * modified concurrently in that case, so we must not trust the contents
+ * too much - the number of probes is bounded, and item indexes and item
+ * headers are checked before accessing the arena. The result is garbage,
+ * but the caller will notice the generation changed and retry.
+ */
+static int
+vault_index_find(const char *id, uint32 hash)
+{
+	return vault_index_search(id, hash, true, 0);
+}
+
+
+/*
+ * find the bucket referencing a particular version of the key (any version
+ * for version 0), see vault_index_find
+ */
+static int
+vault_index_find_version(const char *id, uint32 hash, uint32 version)
+{
+	return vault_index_search(id, hash, false, version);
+}
+
+
+/*
+ * search the index for the key, matching either the current version, or
+ * the given version (any version for 0)
+ *
+ * All the versions of a key have the same hash, so they're in the same
+ * probe sequence.
+ */
+static int
+vault_index_search(const char *id, uint32 hash, bool current, uint32 version)
+{
+	VaultBucket	buckets = VaultBuckets(vault_info);
+	uint32		mask = vault_info->nbuckets - 1;
+	uint32		bucket = hash & mask;
+	int			nprobes;
+	Size		len = strlen(id);
+
+	/* the load factor is <= 0.5, so there's always an empty bucket */
+	for (nprobes = 0; nprobes < vault_info->nbuckets; nprobes++)
+	{
+		uint32		item = buckets[bucket].item;
+		VaultItem	header;
+
+		if (VaultBucketIsEmpty(vault_info, &buckets[bucket]) ||
+			(item > vault_info->maxitems))
+			break;
+
+		header = &VaultItems(vault_info)[item - 1];
+
+		if ((buckets[bucket].hash == hash) &&
+			(header->id_len == len) && vault_item_valid(header) &&
+			(current ? (! (header->flags & VAULT_ITEM_RETIRED)) :
+					   ((version == 0) || (header->version == version))) &&
+			(memcmp(VaultItemId(vault_info, header), id, len) == 0))
+			return bucket;
+
+		bucket = (bucket + 1) & mask;
+	}
+
+	return -1;
+}
+
+
+/*
+ * check the item header points to data within the arena
+ *
+ * This only matters for readers not holding the vault lock, who may see
+ * the header while it's being modified.
+ */
+static bool
+vault_item_valid(VaultItem item)
+{
+	return ((Size) item->offset + VaultItemSize(item) <= vault_info->arena_size);
+}
+
+
+/*
+ * compact the arena, i.e. move all the item data to the beginning (in the
+ * original order), eliminating holes left by deleted items
+ *
+ * The caller has to hold the lock in exclusive mode, and has to provide
+ * an array large enough to sort all the items, as we must not fail here.
+ */
+static void
+vault_arena_compact(VaultArenaItem *sorted)
+{
+	int		i;
+	Size	offset = 0;
+	char   *arena = VaultArena(vault_info);
+
+	for (i = 0; i < vault_info->nitems; i++)
+	{
+		sorted[i].offset = VaultItems(vault_info)[i].offset;
+		sorted[i].item = i;
+	}
+
+	qsort(sorted, vault_info->nitems, sizeof(VaultArenaItem), vault_arena_cmp);
+
+	for (i = 0; i < vault_info->nitems; i++)
+	{
+		VaultItem	item = &VaultItems(vault_info)[sorted[i].item];
+		Size		size = VaultItemSize(item);
+
+		Assert(item->offset >= offset);
+
+		if (item->offset != offset)
+			memmove(arena + offset, arena + item->offset, size);
+
+		item->offset = offset;
+		offset += size;
+	}
+
+	/* wipe the now unused tail of the arena */
+	memset(arena + offset, 0, vault_info->arena_used - offset);
+
+	vault_info->arena_used = offset;
+	vault_info->arena_free = 0;
+}
+
+
+static int
+vault_arena_cmp(const void *a, const void *b)
+{
+	const VaultArenaItem *ia = (const VaultArenaItem *) a;
+	const VaultArenaItem *ib = (const VaultArenaItem *) b;
+
+	if (ia->offset < ib->offset)
+		return -1;
+	else if (ia->offset > ib->offset)
+		return 1;
+
+	return 0;
+}
+
+
+/* sort entries by ID and version (to find duplicates within a batch) */
+static int
+vault_entry_cmp(const void *a, const void *b)
+{
+	VaultEntry *ea = *(VaultEntry * const *) a;
+	VaultEntry *eb = *(VaultEntry * const *) b;
+	int			r = strcmp(ea->id, eb->id);
+
+	if (r != 0)
+		return r;
+	else if (ea->version < eb->version)
+		return -1;
+	else if (ea->version > eb->version)
+		return 1;
+
+	return 0;
+}
+
+
+/*
+ * copy the key with the given ID into the buffer (MAX_KEY_LENGTH bytes)
+ *
+ * Reads the requested version of the key, or the current one (when version
+ * is 0), and sets the version actually read. Returns false if there's no
+ * such key in the vault. May be called without the lock (the caller has to
+ * check the generation counter then), so we need to make sure we don't run
+ * past the buffer.
+ */
+static bool
+vault_read_key(const char *id, uint32 hash, char *buffer, uint32 *version)
+{
+	int			bucket;
+	uint32		index;
+	VaultItemData	item;
+
+	if (*version == 0)
+		bucket = vault_index_find(id, hash);
+	else
+		bucket = vault_index_find_version(id, hash, *version);
+
+	if (bucket < 0)
+		return false;
+
+	/*
+	 * The bucket may have changed since the search (e.g. by a delete shifting
+	 * the buckets), so check the item again, and work with a copy of the
+	 * header so that what we check is what we use.
+	 */
+	index = VaultBuckets(vault_info)[bucket].item;
+
+	if ((index == 0) || (index > vault_info->maxitems))
+		return false;
+
+	memcpy(&item, &VaultItems(vault_info)[index - 1], sizeof(VaultItemData));
+
+	/* the item is being modified, so it may be garbage */
+	if ((item.key_len > MAX_KEY_LENGTH) || (item.key_len < VARHDRSZ) ||
+		(! vault_item_valid(&item)))
+		return false;
+
+	memcpy(buffer, VaultItemKey(vault_info, &item), item.key_len);
+
+	*version = item.version;
+
+	return true;
+}
+
+
+/*
+ * read the key for a handle from the current stripe into the buffer (and
+ * the version of the key - a handle references a particular version)
+ *
+ * Returns false if the handle is not valid (e.g. the key was deleted). May
+ * be called without the lock, just like vault_read_key, so we need to make
+ * sure we don't look outside the storage.
+ */
+static bool
+vault_read_handle(int64 handle, char *buffer, uint32 *version)
+{
+	uint32		slot = VaultHandleSlot(handle);
+	uint32		index;
+	VaultSlot	slots = VaultSlots(vault_info);
+	VaultItemData	item;
+
+	if ((slot >= vault_info->nslots) || (slot >= vault_info->maxitems))
+		return false;
+
+	/* read the slot just once, it may change under us */
+	index = slots[slot].item;
+
+	if ((index == 0) || (slots[slot].tag != VaultHandleTag(handle)))
+		return false;
+
+	index--;
+
+	if ((index >= vault_info->nitems) || (index >= vault_info->maxitems))
+		return false;
+
+	/*
+	 * Work with a copy of the header, so that what we check is what we use
+	 * (vault_delete_item may be moving another item into the place).
+	 */
+	memcpy(&item, &VaultItems(vault_info)[index], sizeof(VaultItemData));
+
+	/* the item is being modified (or moved), so it may be garbage */
+	if ((VaultItemGetCold(vault_info, index)->slot != slot) ||
+		(item.key_len > MAX_KEY_LENGTH) || (item.key_len < VARHDRSZ) ||
+		(! vault_item_valid(&item)))
+		return false;
+
+	memcpy(buffer, VaultItemKey(vault_info, &item), item.key_len);
+
+	*version = item.version;
+
+	return true;
+}
+
+
+/*
+ * lookup a key in the vault, returning a copy of the key (or NULL)
+ *
+ * The vault is searched without any locking, using the generation counter
+ * as a sequence lock - we remember the generation, search the vault and
+ * then check the generation did not change. If there was a write in
+ * progress (odd generation) or the generation changed, we simply retry.
+ * Writes are expected to be rare, but if we fail too many times we fall
+ * back to the LWLock (in shared mode).
+ *
+ * The generation the result is consistent with is returned, so that the
+ * caller can use it to validate the backend-local cache.
+ *
+ * The key is identified either by the ID (with hash), or by a handle (when
+ * the ID is NULL). For IDs, the version may request a particular version of
+ * the key (0 means the current one). The version of the key found is set.
+ */
+static bytea *
+vault_lookup(const char *id, uint32 hash, int64 handle, uint32 *generation,
+			 uint32 *version)
+{
+	int		retries;
+	bool	found = false;
+	bytea  *key = NULL;
+	VaultKeyBuffer	buffer;
+	uint32	requested = *version;
+
+	/* the caller already attached to the partition, and selected the stripe */
+	Assert(vault_stripe != NULL);
+
+	/* the storage we find can't be freed until we're done */
+	vault_read_begin();
+
+	for (retries = 0; retries < VAULT_READ_RETRIES; retries++)
+	{
+		uint32	before,
+				after;
+
+		before = pg_atomic_read_u32(&vault_stripe->generation);
+
+		/* write in progress, try again */
+		if (before % 2 == 1)
+		{
+			pg_spin_delay();
+			continue;
+		}
+
+		pg_read_barrier();
+
+		/* the storage might have been replaced since the last time */
+		vault_refresh();
+
+		*version = requested;
+
+		if (id != NULL)
+			found = vault_read_key(id, hash, buffer.data, version);
+		else
+			found = vault_read_handle(handle, buffer.data, version);
+
+		pg_read_barrier();
+
+		after = pg_atomic_read_u32(&vault_stripe->generation);
+
+		if (before == after)
+		{
+			*generation = before;
+			break;
+		}
+	}
+
+	vault_read_end();
+
+	/* too many concurrent writes, so wait for them using the lock */
+	if (retries == VAULT_READ_RETRIES)
+	{
+		vault_acquire(vault_stripe->lock, LW_SHARED);
+		vault_refresh();
+
+		*generation = pg_atomic_read_u32(&vault_stripe->generation);
+
+		*version = requested;
+
+		if (id != NULL)
+			found = vault_read_key(id, hash, buffer.data, version);
+		else
+			found = vault_read_handle(handle, buffer.data, version);
+
+		LWLockRelease(vault_stripe->lock);
+	}
+
+	if (found)
+	{
+		Size	len = VARSIZE_ANY(buffer.data);
+
+		key = (bytea *) palloc(len);
+		memcpy(key, buffer.data, len);
+	}
+
+	/* don't leave the key on the stack */
+	memset(buffer.data, 0, MAX_KEY_LENGTH);
+
+	return key;
+}
+
+
+/*
+ * start reading the current stripe without the lock
+ *
+ * Announces the current reclamation epoch in the slot of this process, so
+ * that no storage we may see gets freed until vault_read_end (storages are
+ * freed only while holding the lock, so readers holding it don't need this).
+ * The barrier makes the slot visible before we look for the storage.
+ *
+ * If we fail with an error while reading, we leave the epoch behind. That
+ * only delays freeing the retired storages, until the next read (or until
+ * another process gets the slot).
+ */
+static void
+vault_read_begin(void)
+{
+	pg_atomic_write_u64(vault_reader, pg_atomic_read_u64(&vault_control->reclaim_epoch));
+	pg_memory_barrier();
+}
+
+
+/*
+ * finish reading the current stripe without the lock (the reads of the
+ * storage have to complete before we clear the slot)
+ */
+static void
+vault_read_end(void)
+{
+	pg_memory_barrier();
+	pg_atomic_write_u64(vault_reader, 0);
+}
+
+
+/*
+ * start modifying the vault (the caller holds the lock in exclusive mode)
+ *
+ * Makes the generation odd, so that lock-free readers know they need to
+ * retry. Atomic read-modify-write operations act as full memory barriers,
+ * so the increments can't be reordered with the changes to the vault.
+ */
+static void
+vault_write_begin(void)
+{
+	pg_atomic_fetch_add_u32(&vault_stripe->generation, 1);
+}
+
+
+/*
+ * finish modifying the vault (the generation is even again)
+ */
+static void
+vault_write_end(void)
+{
+	pg_atomic_fetch_add_u32(&vault_stripe->generation, 1);
+}
+
+
+/*
+ * add a new item into the hash index (the ID is known to be unique)
+ */
+static void
+vault_index_insert(uint32 hash, int item)
+{
+	VaultBucket	buckets = VaultBuckets(vault_info);
+	uint32		mask = vault_info->nbuckets - 1;
+	uint32		bucket = hash & mask;
+
+	while (! VaultBucketIsEmpty(vault_info, &buckets[bucket]))
+		bucket = (bucket + 1) & mask;
+
+	buckets[bucket].hash = hash;
+	buckets[bucket].item = item + 1;
+	buckets[bucket].epoch = vault_info->epoch;
+}
+
+
+/*
+ * remove a bucket from the hash index
+ *
+ * With linear probing we can't simply empty the bucket, as that might break
+ * the probe sequence for items stored after it. Instead we shift the later
+ * entries back, so that no tombstones are needed (backward shift deletion).
+ */
+static void
+vault_index_delete(int bucket)
+{
+	VaultBucket	buckets = VaultBuckets(vault_info);
+	uint32		mask = vault_info->nbuckets - 1;
+	uint32		hole = bucket;
+	uint32		next = bucket;
+
+	buckets[hole].hash = 0;
+	buckets[hole].item = 0;
+
+	while (true)
+	{
+		uint32	home;
+
+		next = (next + 1) & mask;
+
+		if (VaultBucketIsEmpty(vault_info, &buckets[next]))
+			break;
+
+		home = buckets[next].hash & mask;
+
+		/*
+		 * Can the entry be moved to the hole? That's possible only if its
+		 * home bucket is not cyclically within (hole, next].
+		 */
+		if ((hole < next) ? (home <= hole || home > next)
+						  : (home <= hole && home > next))
+		{
+			buckets[hole] = buckets[next];
+
+			buckets[next].hash = 0;
+			buckets[next].item = 0;
+
+			hole = next;
+		}
+	}
+}
+
+
+/*
+ * update the hash index after an item got moved to a different position
+ */
+static void
+vault_index_move(int olditem, int newitem)
+{
+	VaultBucket	buckets = VaultBuckets(vault_info);
+	uint32		mask = vault_info->nbuckets - 1;
+	VaultItem	item = &VaultItems(vault_info)[newitem];
+	uint32		bucket = DatumGetUInt32(hash_any((unsigned char *) VaultItemId(vault_info, item),
+												 item->id_len)) & mask;
+
+	while (buckets[bucket].item != olditem + 1)
+	{
+		Assert(! VaultBucketIsEmpty(vault_info, &buckets[bucket]));
+		bucket = (bucket + 1) & mask;
+	}
+
+	buckets[bucket].item = newitem + 1;
+}
+
+
+/*
+ * compare the item with the given ID and version, in the order of the
+ * ordered index
+ */
+static int
+vault_order_cmp(VaultItem item, const char *id, int len, uint32 version)
+{
+	int		r = memcmp(VaultItemId(vault_info, item), id, Min(item->id_len, len));
+
+	if (r != 0)
+		return r;
+	else if (item->id_len != len)
+		return (item->id_len < len) ? -1 : 1;
+	else if (item->version != version)
+		return (item->version < version) ? -1 : 1;
+
+	return 0;
+}
+
+
+/* sort item indexes in the order of the ordered index */
+static int
+vault_order_item_cmp(const void *a, const void *b)
+{
+	VaultItem	ia = &VaultItems(vault_info)[*(const uint32 *) a];
+	VaultItem	ib = &VaultItems(vault_info)[*(const uint32 *) b];
+
+	return vault_order_cmp(ia, VaultItemId(vault_info, ib), ib->id_len, ib->version);
+}
+
+
+/*
+ * position of the first entry in the ordered index not sorting before the
+ * given ID and version (i.e. where such item is, or would be inserted)
+ */
+static int
+vault_order_search(const char *id, int len, uint32 version)
+{
+	uint32	   *order = VaultOrder(vault_info);
+	int			lo = 0,
+				hi = vault_info->nitems;
+
+	while (lo < hi)
+	{
+		int		mid = lo + (hi - lo) / 2;
+
+		if (vault_order_cmp(&VaultItems(vault_info)[order[mid]], id, len, version) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/*
+ * add the new items (already counted in nitems) to the ordered index
+ *
+ * The new items get sorted, and then merged with the existing entries from
+ * the end of the array, so that it's done in place, in a single pass.
  */
-typedef struct VaultItemData
+static void
+vault_order_merge(uint32 *added, int nadded)
 {
-	char	id[MAX_ID_LENGTH];				/* ID of the key (\0-terminated string) */
-	char	comment[MAX_COMMENT_LENGTH];	/* comment of the key (\0-terminated string, may be NULL) */
-	char	key[MAX_KEY_LENGTH];			/* key data */
-} VaultItemData;
+	uint32	   *order = VaultOrder(vault_info);
+	int			i = vault_info->nitems - nadded - 1;
+	int			j = nadded - 1;
+	int			k = vault_info->nitems - 1;
 
-typedef VaultItemData* VaultItem;
+	qsort(added, nadded, sizeof(uint32), vault_order_item_cmp);
 
-/* used to allocate memory in the shared segment */
-typedef struct VaultInfoData {
+	while (j >= 0)
+	{
+		if ((i >= 0) && (vault_order_item_cmp(&order[i], &added[j]) > 0))
+			order[k--] = order[i--];
+		else
+			order[k--] = added[j--];
+	}
+}
 
-	LWLockId		lock;		/* LWLock guarding the vault */
 
-	int				maxitems;	/* max number of items we can keep */
-	int				nitems;		/* number of items in the vault */
-	VaultItemData	items[1];	/* pointer to the first item */
+/*
+ * remove the item from the ordered index (before the item gets wiped)
+ */
+static void
+vault_order_delete(int item)
+{
+	uint32	   *order = VaultOrder(vault_info);
+	VaultItem	header = &VaultItems(vault_info)[item];
+	int			pos;
 
-} VaultInfoData;
+	pos = vault_order_search(VaultItemId(vault_info, header), header->id_len,
+							 header->version);
 
-typedef VaultInfoData*	VaultInfo;
+	Assert((pos < vault_info->nitems) && (order[pos] == item));
 
-/* pointer to the vault structure */
-static VaultInfo vault_info = NULL;
+	memmove(&order[pos], &order[pos + 1],
+			(vault_info->nitems - pos - 1) * sizeof(uint32));
+}
 
-static VaultInfo vault_copy(bool strip_keys);
 
 /*
- * Module load callback
+ * update the ordered index after an item got moved to a different position
+ * (the old position still has to be valid)
  */
-void
-_PG_init(void)
+static void
+vault_order_move(int olditem, int newitem)
 {
+	uint32	   *order = VaultOrder(vault_info);
+	VaultItem	header = &VaultItems(vault_info)[olditem];
+	int			pos;
 
-	/* check that we can initialize the shared segment */
-	if (! process_shared_preload_libraries_in_progress) {
-		elog(ERROR, "pg_vault needs to be loaded using shared_preload_libraries");
-		return;
-	}
-
-	/* Define custom GUC variables. */
-
-	/* How much memory should we preallocate for the dictionaries (limits how many
-	 * dictionaries you can load into the shared segment). */
-	DefineCustomIntVariable("pg_vault.max_size",
-							"amount of memory to pre-allocate for pg_vault",
-							NULL,
-							&pgvault_mem_max_size,
-							(1024*1024),
-							(1024*1024), INT_MAX,
-							PGC_POSTMASTER,
-							GUC_UNIT_BLOCKS,
-#if (PG_VERSION_NUM >= 90100)
-							NULL,
-#endif
-							NULL,
-							NULL);
+	pos = vault_order_search(VaultItemId(vault_info, header), header->id_len,
+							 header->version);
 
-	EmitWarningsOnPlaceholders("pg_vault");
+	Assert((pos < vault_info->nitems) && (order[pos] == olditem));
 
-	/*
-	 * Request additional shared resources.  (These are no-ops if we're not in
-	 * the postmaster process.)  We'll allocate or attach to the shared
-	 * resources in ispell_shmem_startup().
-	 */
-	RequestAddinShmemSpace(pgvault_mem_max_size);
-	RequestAddinLWLocks(1);
+	order[pos] = newitem;
+}
 
-	/* Install hooks. */
-	prev_shmem_startup_hook = shmem_startup_hook;
-	shmem_startup_hook = pgvault_shmem_startup;
 
+/*
+ * does the item ID start with the prefix?
+ */
+static bool
+vault_order_prefix(VaultItem item, const char *prefix, int len)
+{
+	return (item->id_len >= len) &&
+		   (memcmp(VaultItemId(vault_info, item), prefix, len) == 0);
 }
 
 
 /*
- * Module unload callback
+ * assign a slot (with a new tag) to a new item (the caller holds the lock
+ * in exclusive mode, with a write in progress)
+ *
+ * Reuses a free slot if possible. There's always a slot for each item, as
+ * nslots can't exceed the number of items ever present at the same time.
  */
-void
-_PG_fini(void)
+static void
+vault_slot_assign(int item)
 {
-	/* Uninstall hooks. */
-	shmem_startup_hook = prev_shmem_startup_hook;
-}
+	VaultSlot	slots = VaultSlots(vault_info);
+	int			slot;
 
+	if (vault_info->free_slot > 0)
+	{
+		slot = vault_info->free_slot - 1;
+		vault_info->free_slot = slots[slot].next;
+	}
+	else
+		slot = vault_info->nslots++;
 
-/* 
- * Probably the most important part of the startup - initializes the
- * memory in shared memory segment (creates and initializes the
- * VaultInfo data structure).
- * 
- * This is called from a shmem_startup_hook (see _PG_init). */
-static
-void pgvault_shmem_startup() {
+	Assert(slot < vault_info->maxitems);
 
-	bool		found = FALSE;
+	/* zero is not a valid tag, so skip it on wraparound */
+	if (++vault_info->last_tag == 0)
+		vault_info->last_tag++;
 
-	if (prev_shmem_startup_hook)
-		prev_shmem_startup_hook();
+	slots[slot].item = item + 1;
+	slots[slot].tag = vault_info->last_tag;
+	slots[slot].next = 0;
+
+	VaultItemGetCold(vault_info, item)->slot = slot;
+}
 
-	elog(DEBUG1, "initializing pg_vault segment (size: %d B)",
-				 pgvault_mem_max_size);
 
-	/*
-	 * Create or attach to the shared memory state, including hash table
-	 */
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+/*
+ * release a slot of a deleted item (the caller holds the lock in exclusive
+ * mode, with a write in progress)
+ */
+static void
+vault_slot_release(uint32 slot)
+{
+	VaultSlot	slots = VaultSlots(vault_info);
 
-	vault_info = (VaultInfo)ShmemInitStruct(SEGMENT_NAME,
-											pgvault_mem_max_size,
-											&found);
+	slots[slot].item = 0;
+	slots[slot].tag = 0;
+	slots[slot].next = vault_info->free_slot;
 
-	/* Was the shared memory segment already initialized? */
-	if (! found) {
+	vault_info->free_slot = slot + 1;
+}
 
-		/* nope - first time through, so initialize */
-		memset(vault_info, 0, pgvault_mem_max_size);
 
-		vault_info->lock  = LWLockAssign();
+/*
+ * find the entry for a key in the backend-local cache (or NULL)
+ *
+ * The entry has to match the given (current) generation of the stripe the
+ * key belongs to, otherwise it's discarded.
+ */
+static VaultCacheEntry *
+vault_cache_find(const char *id, uint32 generation)
+{
+	char			cache_id[MAX_ID_LENGTH];
+	VaultCacheEntry *entry;
+
+	if (vault_cache == NULL)
+		return NULL;
 
-		/* how many items fit into the vault */
-		vault_info->maxitems = (pgvault_mem_max_size - offsetof(VaultInfoData, items)) / sizeof(VaultItemData);
+	memset(cache_id, 0, MAX_ID_LENGTH);
+	strlcpy(cache_id, id, MAX_ID_LENGTH);
 
-		elog(DEBUG1, "shared memory segment for pg_vault successfully created");
+	entry = (VaultCacheEntry *) hash_search(vault_cache, cache_id, HASH_FIND, NULL);
 
+	/* the stripe changed since the key was cached */
+	if ((entry != NULL) && (entry->generation != generation))
+	{
+		vault_cache_evict(entry);
+		return NULL;
 	}
 
-	LWLockRelease(AddinShmemInitLock);
+	/* move the entry to the head of the LRU list */
+	if (entry != NULL)
+		dlist_move_head(&vault_cache_lru, &entry->lru_node);
 
+	return entry;
 }
 
-Datum add_key(PG_FUNCTION_ARGS);
-Datum delete_key(PG_FUNCTION_ARGS);
-Datum lookup_key(PG_FUNCTION_ARGS);
-Datum list_keys(PG_FUNCTION_ARGS);
-Datum delete_keys(PG_FUNCTION_ARGS);
-Datum save_keys(PG_FUNCTION_ARGS);
-Datum load_keys(PG_FUNCTION_ARGS);
-
-PG_FUNCTION_INFO_V1(add_key);
-PG_FUNCTION_INFO_V1(delete_key);
-PG_FUNCTION_INFO_V1(lookup_key);
-PG_FUNCTION_INFO_V1(list_keys);
-PG_FUNCTION_INFO_V1(delete_keys);
-PG_FUNCTION_INFO_V1(save_keys);
-PG_FUNCTION_INFO_V1(load_keys);
 
 /*
- * add a key to the vault
- *
- * TODO maybe use a 'replace' option to replace existing keys
+ * lookup a key in the backend-local cache
  *
- * - id  (TEXT)
- * - key (BYTEA)
- * - comment (TEXT)
+ * Returns a copy of the key (allocated in the current memory context), or
+ * NULL if the key is not cached (for the given generation of the stripe).
+ * The version of the cached key is set too.
  */
-Datum
-add_key(PG_FUNCTION_ARGS)
+static bytea *
+vault_cache_lookup(const char *id, uint32 generation, uint32 *version)
 {
-	int		i;
-	char	*id			= NULL,
-			*comment	= NULL;
-	bytea	*key		= NULL;
+	VaultCacheEntry *entry;
+	bytea		   *key;
 
-	bool	vault_is_full	= FALSE;
-	bool	key_id_unique	= TRUE;
+	if ((entry = vault_cache_find(id, generation)) == NULL)
+		return NULL;
 
-	if (PG_ARGISNULL(0))
-		elog(ERROR, "key ID must not be NULL");
+	key = (bytea *) palloc(VARSIZE_ANY(entry->key));
+	memcpy(key, entry->key, VARSIZE_ANY(entry->key));
 
-	if (PG_ARGISNULL(1))
-		elog(ERROR, "key data must not be NULL");
+	*version = entry->version;
 
-	id	= text_to_cstring(PG_GETARG_TEXT_P(0));
-	key	= PG_GETARG_BYTEA_P(1);
+	return key;
+}
 
-	if (! PG_ARGISNULL(2))
-		comment = text_to_cstring(PG_GETARG_TEXT_P(2));
 
-	/* check size limits */
-	if (strlen(id) >= MAX_ID_LENGTH)
-		elog(ERROR, "key ID too long (max=%d len=%ld)", MAX_ID_LENGTH, strlen(id));
+/*
+ * store a copy of the key in the backend-local cache (as valid for the
+ * given generation of the stripe)
+ *
+ * If the cache is full, the least recently used key is evicted first.
+ * Returns the new cache entry, or NULL if the cache is disabled.
+ */
+static VaultCacheEntry *
+vault_cache_store(const char *id, bytea *key, uint32 version, uint32 generation)
+{
+	char			cache_id[MAX_ID_LENGTH];
+	VaultCacheEntry *entry;
+	bool			found;
 
-	if ((comment != NULL) && (strlen(comment) >= MAX_COMMENT_LENGTH))
-		elog(ERROR, "comment too long (max=%d len=%ld)", MAX_COMMENT_LENGTH, strlen(comment));
+	if (pgvault_cache_size <= 0)
+		return NULL;
 
-	if (VARSIZE_ANY_EXHDR(key) >= MAX_KEY_LENGTH)
-		elog(ERROR, "key too long (max=%d len=%ld)", MAX_KEY_LENGTH, VARSIZE_ANY_EXHDR(key));
+	if (vault_cache == NULL)
+	{
+		HASHCTL		ctl;
 
-	LWLockAcquire(vault_info->lock, LW_EXCLUSIVE);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = MAX_ID_LENGTH;
+		ctl.entrysize = sizeof(VaultCacheEntry);
 
-	/* do the checks here, but report the errors outside the locked section */
+		vault_cache = hash_create("pg_vault cache", pgvault_cache_size, &ctl,
+								  HASH_ELEM | HASH_BLOBS);
+	}
 
-	/* is the key ID unique? */
-	for (i = 0; i < vault_info->nitems; i++)
+	/* make space for the new entry (the GUC might have been decreased) */
+	while (vault_cache_nentries >= pgvault_cache_size)
 	{
-		if (strcmp(vault_info->items[i].id, id) == 0)
-		{
-			key_id_unique = FALSE;
-			break;
-		}
-	}
+		VaultCacheEntry *victim = dlist_container(VaultCacheEntry, lru_node,
+												  dlist_tail_node(&vault_cache_lru));
 
-	/* is there space for another item? */
-	if (vault_info->nitems >= vault_info->maxitems)
-		vault_is_full = TRUE;
+		vault_cache_evict(victim);
+	}
 
-	/* the key can be added only if the ID is unique and there's enough space */
-	if ((!vault_is_full) && key_id_unique)
-	{
-		/* copy the fields into the structure */
-		memcpy(vault_info->items[vault_info->nitems].id, id, strlen(id));
-		memcpy(vault_info->items[vault_info->nitems].key, key, VARSIZE_ANY(key));
+	memset(cache_id, 0, MAX_ID_LENGTH);
+	strlcpy(cache_id, id, MAX_ID_LENGTH);
 
-		if (comment != NULL)
-			memcpy(vault_info->items[vault_info->nitems].comment, comment, strlen(comment));
+	entry = (VaultCacheEntry *) hash_search(vault_cache, cache_id, HASH_ENTER, &found);
 
-		vault_info->nitems++;
+	/*
+	 * We only store keys after a cache miss, but the cache might have been
+	 * skipped during a concurrent write. So just replace the cached key.
+	 */
+	if (found)
+	{
+		vault_cache_release(entry);
+		dlist_delete(&entry->lru_node);
+		vault_cache_nentries--;
 	}
 
-	LWLockRelease(vault_info->lock);
+	entry->key = (bytea *) MemoryContextAlloc(TopMemoryContext, VARSIZE_ANY(key));
+	memcpy(entry->key, key, VARSIZE_ANY(key));
 
-	if (! key_id_unique)
-		elog(ERROR, "the supplied key ID '%s' is not unique", id);
+	entry->passphrase = NULL;
+	entry->version = version;
+	entry->generation = generation;
+	entry->borrowed = 0;
 
-	if (vault_is_full)
-		elog(ERROR, "cannot add a key - the vault is full");
+	dlist_push_head(&vault_cache_lru, &entry->lru_node);
+	vault_cache_nentries++;
 
-	PG_RETURN_VOID();
+	return entry;
 }
 
 
 /*
- * delete a key from the vault
- *
- * - id  (TEXT)
+ * wipe and release the key (and passphrase) of a cache entry
  */
-Datum
-delete_key(PG_FUNCTION_ARGS)
+static void
+vault_cache_release(VaultCacheEntry *entry)
 {
-	int		i;
-	char	*id = NULL;
+	/* borrowed in this statement, so keep it until the end of it */
+	if (entry->borrowed == vault_secure_epoch)
+	{
+		vault_secure_adopt(entry->key);
 
-	if (PG_ARGISNULL(0))
-		elog(ERROR, "key ID must not be NULL");
+		if (entry->passphrase != NULL)
+			vault_secure_adopt(entry->passphrase);
 
-	id	= text_to_cstring(PG_GETARG_TEXT_P(0));
+		entry->key = NULL;
+		entry->passphrase = NULL;
 
-	LWLockAcquire(vault_info->lock, LW_EXCLUSIVE);
+		return;
+	}
 
-	/* find the matching item and copy the last item to this place */
-	for (i = 0; i < vault_info->nitems; i++)
+	memset(entry->key, 0, VARSIZE_ANY(entry->key));
+	pfree(entry->key);
+
+	if (entry->passphrase != NULL)
 	{
-		if (strcmp(vault_info->items[i].id, id) == 0)
-		{
-			/* consider the last item already deleted */
-			vault_info->nitems--;
+		memset(entry->passphrase, 0, VARSIZE_ANY(entry->passphrase));
+		pfree(entry->passphrase);
+	}
 
-			memcpy(&vault_info->items[i], &vault_info->items[vault_info->nitems],
-				   sizeof(VaultItemData));
+	entry->key = NULL;
+	entry->passphrase = NULL;
+}
 
-			break;
-		}
-	}
 
-	LWLockRelease(vault_info->lock);
+/*
+ * remove the entry from the backend-local cache (wiping the key first)
+ */
+static void
+vault_cache_evict(VaultCacheEntry *entry)
+{
+	vault_cache_release(entry);
 
-	/* FIXME Maybe this should report error if the key was not found? */
+	dlist_delete(&entry->lru_node);
 
-	PG_RETURN_VOID();
+	hash_search(vault_cache, entry->id, HASH_REMOVE, NULL);
+	vault_cache_nentries--;
 }
 
 
 /*
- * lookup a key in the vault
+ * count a use of a key (by this backend)
+ *
+ * The uses are added to the items in the vault by vault_stats_flush, as we
+ * can't modify the storage during lock-free lookups.
  */
-Datum
-lookup_key(PG_FUNCTION_ARGS)
+static void
+vault_stats_use(const char *id)
 {
-	int		i;
-	char	*id = NULL;
-	bytea	*key = NULL;
-
-	if (PG_ARGISNULL(0))
-		elog(ERROR, "key ID must not be NULL");
+	char				stats_id[MAX_ID_LENGTH];
+	VaultStatsKeyEntry *entry;
+	bool				found;
 
-	id	= text_to_cstring(PG_GETARG_TEXT_P(0));
+	if (vault_stats_keys == NULL)
+	{
+		HASHCTL		ctl;
 
-	LWLockAcquire(vault_info->lock, LW_SHARED);
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = MAX_ID_LENGTH;
+		ctl.entrysize = sizeof(VaultStatsKeyEntry);
 
-	/* find the matching item and copy the last item to this place */
-	for (i = 0; i < vault_info->nitems; i++)
-	{
-		if (strcmp(vault_info->items[i].id, id) == 0)
-		{
-			key = (bytea*)palloc(VARSIZE_ANY(vault_info->items[i].key));
-			memcpy(key, vault_info->items[i].key, VARSIZE_ANY(vault_info->items[i].key));
-			break;
-		}
+		vault_stats_keys = hash_create("pg_vault stats", VAULT_STATS_MAX_KEYS, &ctl,
+									   HASH_ELEM | HASH_BLOBS);
 	}
 
-	LWLockRelease(vault_info->lock);
+	memset(stats_id, 0, MAX_ID_LENGTH);
+	strlcpy(stats_id, id, MAX_ID_LENGTH);
 
-	if (key != NULL)
-		PG_RETURN_BYTEA_P(key);
+	entry = (VaultStatsKeyEntry *) hash_search(vault_stats_keys, stats_id, HASH_ENTER, &found);
 
-	PG_RETURN_NULL();
+	if (! found)
+		entry->uses = 0;
+
+	entry->uses++;
 }
 
 
 /*
- * list all keys from a vault (without the key data)
+ * finish an operation on the vault (without holding any locks)
+ *
+ * Adds the local statistics to the shared ones, once in a while.
  */
-Datum
-list_keys(PG_FUNCTION_ARGS)
+static void
+vault_stats_done(void)
 {
-	FuncCallContext *funcctx;
-	TupleDesc	   tupdesc;
-	AttInMetadata   *attinmeta;
-
-	/* init on the first call */
-	if (SRF_IS_FIRSTCALL())
+	/* make sure the counters don't get lost when the backend exits */
+	if (! vault_stats_registered)
 	{
+		before_shmem_exit(vault_stats_exit, (Datum) 0);
+		vault_stats_registered = true;
+	}
 
-		MemoryContext oldcontext;
-
-		funcctx = SRF_FIRSTCALL_INIT();
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-
-		LWLockAcquire(vault_info->lock, LW_EXCLUSIVE);
+	if ((++vault_stats_nops >= VAULT_STATS_BATCH) ||
+		((vault_stats_keys != NULL) &&
+		 (hash_get_num_entries(vault_stats_keys) >= VAULT_STATS_MAX_KEYS)))
+		vault_stats_flush(true);
+}
 
-		/* number of items in the vault */
-		funcctx->max_calls = vault_info->nitems;
-		funcctx->user_fctx = vault_copy(true);
 
-		LWLockRelease(vault_info->lock);
+/*
+ * add the local statistics to the shared counters of the partition
+ *
+ * The uses of individual keys are added to the items, under the shared
+ * lock of the stripe (concurrent readers add them using atomics). Keys
+ * deleted in the meantime are simply skipped. We don't do that with !keys
+ * (at backend exit after an error), as it needs the locks.
+ */
+static void
+vault_stats_flush(bool keys)
+{
+	HASH_SEQ_STATUS		status;
+	VaultStatsKeyEntry *entry;
 
-		/* Build a tuple descriptor for our result type */
-		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-			ereport(ERROR,
-					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-					 errmsg("function returning record called in context "
-							"that cannot accept type record")));
+	/* keep the statistics until there's a partition */
+	if (vault_partition == NULL)
+		return;
 
-		/*
-		 * generate attribute metadata needed later to produce tuples from raw
-		 * C strings
-		 */
-		attinmeta = TupleDescGetAttInMetadata(tupdesc);
-		funcctx->attinmeta = attinmeta;
-		funcctx->tuple_desc = tupdesc;
+	pg_atomic_fetch_add_u64(&vault_partition->stats.lookups, vault_stats_pending.lookups);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.misses, vault_stats_pending.misses);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.cache_hits, vault_stats_pending.cache_hits);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.adds, vault_stats_pending.adds);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.deletes, vault_stats_pending.deletes);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.lock_waits, vault_stats_pending.lock_waits);
+	pg_atomic_fetch_add_u64(&vault_partition->stats.lock_wait_time, vault_stats_pending.lock_wait_time);
 
-		/* switch back to the old context */
-		MemoryContextSwitchTo(oldcontext);
+	memset(&vault_stats_pending, 0, sizeof(VaultStatsCounters));
+	vault_stats_nops = 0;
 
-	}
+	if ((! keys) || (vault_stats_keys == NULL))
+		return;
 
-	/* init the context */
-	funcctx = SRF_PERCALL_SETUP();
+	hash_seq_init(&status, vault_stats_keys);
 
-	/* check if we have more data */
-	if (funcctx->max_calls > funcctx->call_cntr)
+	while ((entry = (VaultStatsKeyEntry *) hash_seq_search(&status)) != NULL)
 	{
-		HeapTuple	   tuple;
-		Datum		   result;
-		Datum		   values[3];
-		bool			nulls[3];
+		uint32	hash = vault_hash_id(entry->id);
+		int		bucket;
 
-		VaultInfo		vault = (VaultInfo)funcctx->user_fctx;
-		VaultItem		item = &(vault->items[funcctx->call_cntr]);
+		vault_select(vault_stripe_index(hash));
 
-		memset(nulls, 0, sizeof(nulls));
-
-		/* key ID */
-		values[0] = CStringGetTextDatum(item->id);
-		// values[1] = Int32GetDatum(VARSIZE_ANY_EXHDR(item->key));
-		values[2] = CStringGetTextDatum(item->comment);
-
-		nulls[1] = true;
+		vault_acquire(vault_stripe->lock, LW_SHARED);
+		vault_refresh();
 
-		/* Build and return the tuple. */
-		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		if ((bucket = vault_index_find(entry->id, hash)) >= 0)
+		{
+			VaultItemCold	cold = VaultItemGetCold(vault_info, VaultBuckets(vault_info)[bucket].item - 1);
 
-		/* make the tuple into a datum */
-		result = HeapTupleGetDatum(tuple);
+			pg_atomic_fetch_add_u32(&cold->uses, entry->uses);
+		}
 
-		/* Here we want to return another item: */
-		SRF_RETURN_NEXT(funcctx, result);
+		LWLockRelease(vault_stripe->lock);
 
-	}
-	else
-	{
-		/* Here we are done returning items and just need to clean up: */
-		SRF_RETURN_DONE(funcctx);
+		hash_search(vault_stats_keys, entry->id, HASH_REMOVE, NULL);
 	}
 }
 
 
 /*
- * delete all the keys from a vault
+ * add the local statistics to the shared ones at backend exit
+ *
+ * Parallel workers exit after each query, so we need to flush the uses of
+ * keys too (unless exiting after an error, when we might hold the locks).
  */
-Datum
-delete_keys(PG_FUNCTION_ARGS)
-{
-	LWLockAcquire(vault_info->lock, LW_EXCLUSIVE);
-
-	/* just zero all the memory after 'nitems' (keep lock / maxitems) */
-	memset((char*)vault_info + offsetof(VaultInfoData, nitems), 0,
-		   pgvault_mem_max_size - offsetof(VaultInfoData, nitems));
-
-	LWLockRelease(vault_info->lock);
-
-	PG_RETURN_VOID();
-}
-
-
-static VaultInfo
-vault_copy(bool strip_keys)
+static void
+vault_stats_exit(int code, Datum arg)
 {
-	int i;
-	VaultInfo copy = palloc0(pgvault_mem_max_size);
-	memcpy(copy, vault_info, pgvault_mem_max_size);
-
-	for (i = 0; i < copy->nitems; i++)
-		memset(copy->items[i].key, 0, MAX_KEY_LENGTH);
-
-	return copy;
+	vault_stats_flush(code == 0);
 }
@@ -0,0 +1,54 @@
+/*
+ * pg_vault.h
+ *
+ * C API of the pg_vault extension, for the native crypto functions and for
+ * other extensions (pg_vault has to be in shared_preload_libraries, so the
+ * functions are available to libraries loaded later).
+ *
+ * The vault_get_* functions return a copy of the key (or passphrase) in
+ * the current memory context, and it's up to the caller to wipe it. The
+ * vault_borrow_* functions return the key without copying it (directly
+ * from the backend-local cache, if possible), and it remains valid until
+ * the end of the statement (or transaction). The caller must not modify
+ * nor free the borrowed key. Copies needed anyway may be allocated using
+ * vault_secure_alloc, and are wiped at the end of the statement too.
+ */
+#ifndef PG_VAULT_H
+#define PG_VAULT_H
+
+#include "fmgr.h"
+
+/* lookup of a key in the vault (returns a copy, or NULL if not found) */
+extern bytea *vault_get_key(const char *id);
+
+/* lookup of a pgcrypto passphrase for the key (cached along with the key) */
+extern text *vault_get_passphrase(const char *id);
+
+/* the same lookups using a key handle (see pg_vault_key_handle) */
+extern bytea *vault_get_key_handle(int64 handle);
+extern text *vault_get_passphrase_handle(int64 handle);
+
+/* lookups without copying the key (valid until the end of the statement) */
+extern const bytea *vault_borrow_key(const char *id);
+extern const text *vault_borrow_passphrase(const char *id);
+
+/*
+ * lookups of a particular version of the key (0 - the current version, and
+ * the version found is set), e.g. to decrypt data encrypted with an older
+ * version of the key
+ */
+extern const bytea *vault_borrow_key_version(const char *id, uint32 *version);
+extern const text *vault_borrow_passphrase_version(const char *id, uint32 *version);
+extern text *vault_get_passphrase_handle_version(int64 handle, uint32 *version);
+
+/*
+ * key derived from a master key in the vault, for the given context (a copy,
+ * or NULL if there's no such master key), see vault_borrow_key_version for
+ * the meaning of the version
+ */
+extern bytea *vault_derive_key(const char *master_id, text *context, uint32 *version);
+
+/* memory for copies of keys, wiped at the end of the statement */
+extern void *vault_secure_alloc(Size size);
+
+#endif	/* PG_VAULT_H */
@@ -0,0 +1,443 @@
+/*
+ * replication.c
+ *
+ * Shipping changes of the vault to physical standbys, through WAL.
+ *
+ * The vault lives in memory only, so a standby would start with an empty
+ * vault, and after a failover the keys would have to be loaded again. So
+ * when pg_vault.wal_passphrase is set, the changes (adding and deleting
+ * keys) are written to WAL as records of a custom resource manager, and
+ * the standbys apply them to their own vault during replay.
+ *
+ * The keys (and IDs) are encrypted with pgcrypto using the passphrase, so
+ * WAL (and the WAL archive) never contains the keys in plain text. The
+ * standbys need the same passphrase, otherwise they skip the records (with
+ * a warning). The records are not transactional, just like the changes of
+ * the vault, and are flushed right away.
+ *
+ * The records are applied in standby mode only - after a crash, the primary
+ * starts with an empty vault as before (replaying just the changes since the
+ * last checkpoint would make the wallet impossible to load). A new standby
+ * only gets the changes made after its base backup, so pg_vault_replicate_keys
+ * writes all the keys of the database, replacing the keys on the standbys.
+ *
+ * Custom resource managers are supported since PostgreSQL 15, on older
+ * releases the changes are not replicated. The logical messages are not
+ * an option - those are not applied by physical standbys at all.
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include "access/xlog.h"
+#include "access/xloginsert.h"
+#if (PG_VERSION_NUM >= 150000)
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "access/xlogrecovery.h"
+#include "lib/stringinfo.h"
+#endif
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "vault.h"
+
+/*
+ * ID of the resource manager. There's no ID reserved for pg_vault, so we use
+ * the experimental one - change it if that conflicts with another extension
+ * (it has to match on the primary and the standbys).
+ */
+#define VAULT_RMGR_ID			128
+
+/* types of the records */
+#define XLOG_VAULT_ADD			0x00	/* keys added */
+#define XLOG_VAULT_REPLACE		0x10	/* all the keys of the database */
+#define XLOG_VAULT_DELETE		0x20	/* key deleted */
+#define XLOG_VAULT_DELETE_ALL	0x30	/* all the keys deleted */
+#define XLOG_VAULT_DELETE_PREFIX	0x40	/* keys with a prefix deleted */
+
+/*
+ * the record, followed by the encrypted keys (or ID of the deleted key, or
+ * the prefix of the deleted keys)
+ */
+typedef struct xl_vault
+{
+	Oid			dbid;			/* database the keys belong to */
+	uint32		version;		/* version of the deleted key (0 - all) */
+} xl_vault;
+
+#define SizeOfVaultRecord	(offsetof(xl_vault, version) + sizeof(uint32))
+
+char	   *pgvault_wal_passphrase = NULL;
+
+static bool vault_log_needed(void);
+static void vault_log_record(uint8 info, uint32 version, bytea *data);
+
+#if (PG_VERSION_NUM >= 150000)
+static void vault_rmgr_redo(XLogReaderState *record);
+static void vault_rmgr_desc(StringInfo buf, XLogReaderState *record);
+static const char *vault_rmgr_identify(uint8 info);
+static void vault_rmgr_startup(void);
+static void vault_rmgr_cleanup(void);
+static void vault_rmgr_apply(uint8 info, xl_vault *xlrec, bytea *data);
+
+static const RmgrData vault_rmgr = {
+	.rm_name = "pg_vault",
+	.rm_redo = vault_rmgr_redo,
+	.rm_desc = vault_rmgr_desc,
+	.rm_identify = vault_rmgr_identify,
+	.rm_startup = vault_rmgr_startup,
+	.rm_cleanup = vault_rmgr_cleanup
+};
+
+/* memory for applying a record (reset after each one) */
+static MemoryContext vault_redo_context = NULL;
+#endif
+
+Datum replicate_keys(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(replicate_keys);
+
+/*
+ * register the resource manager (called from _PG_init)
+ *
+ * That's needed even without the passphrase, so that the standbys (and
+ * tools like pg_waldump) recognize the records.
+ */
+void
+vault_replication_register(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	RegisterCustomRmgr(VAULT_RMGR_ID, &vault_rmgr);
+#endif
+}
+
+
+/*
+ * write all the keys of the database into WAL, replacing the keys on the
+ * standbys (e.g. for a new standby)
+ *
+ * Returns the number of keys.
+ */
+Datum
+replicate_keys(PG_FUNCTION_ARGS)
+{
+	int			nentries;
+	VaultEntry *entries;
+
+#if (PG_VERSION_NUM < 150000)
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("replication of keys requires PostgreSQL 15 or newer")));
+#endif
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("The keys can be replicated only from the primary.")));
+
+	if (! vault_log_needed())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("replication of keys is not enabled"),
+				 errhint("Set pg_vault.wal_passphrase, and wal_level to \"replica\" or higher.")));
+
+	entries = vault_get_keys(&nentries);
+
+	vault_log_keys(entries, nentries, true);
+
+	vault_wipe_entries(entries, nentries);
+
+	PG_RETURN_INT32(nentries);
+}
+
+
+/*
+ * write keys added to the vault into WAL (all - replacing all the keys of
+ * the database)
+ */
+void
+vault_log_keys(VaultEntry *entries, int nentries, bool all)
+{
+	bytea	   *data;
+
+	if (! vault_log_needed())
+		return;
+
+	data = vault_pack_keys(entries, nentries);
+
+	vault_log_record((all) ? XLOG_VAULT_REPLACE : XLOG_VAULT_ADD, 0, data);
+
+	memset(data, 0, VARSIZE(data));
+	pfree(data);
+}
+
+
+/*
+ * write a key deleted from the vault into WAL (a particular version, or all
+ * the versions for 0)
+ */
+void
+vault_log_delete(const char *id, uint32 version)
+{
+	bytea	   *data;
+
+	if (! vault_log_needed())
+		return;
+
+	data = (bytea *) cstring_to_text(id);
+
+	vault_log_record(XLOG_VAULT_DELETE, version, data);
+
+	pfree(data);
+}
+
+
+/*
+ * write deletion of all the keys of the database into WAL
+ */
+void
+vault_log_delete_all(void)
+{
+	if (! vault_log_needed())
+		return;
+
+	vault_log_record(XLOG_VAULT_DELETE_ALL, 0, NULL);
+}
+
+
+/*
+ * write deletion of keys with IDs starting with the prefix into WAL (the
+ * prefix is encrypted, just like the IDs)
+ */
+void
+vault_log_delete_prefix(const char *prefix)
+{
+	bytea	   *data;
+
+	if (! vault_log_needed())
+		return;
+
+	data = (bytea *) cstring_to_text(prefix);
+
+	vault_log_record(XLOG_VAULT_DELETE_PREFIX, 0, data);
+
+	pfree(data);
+}
+
+
+/*
+ * should the changes be written into WAL?
+ *
+ * Changes made on a standby are local (it can't write WAL anyway), and with
+ * wal_level=minimal there are no standbys.
+ */
+static bool
+vault_log_needed(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	return (pgvault_wal_passphrase != NULL) && (pgvault_wal_passphrase[0] != '\0') &&
+		   XLogIsNeeded() && (! RecoveryInProgress());
+#else
+	return false;
+#endif
+}
+
+
+/*
+ * write the record (with the data encrypted, if any), and flush it, so that
+ * it gets to the standbys right away
+ */
+static void
+vault_log_record(uint8 info, uint32 version, bytea *data)
+{
+	xl_vault	xlrec;
+	bytea	   *encrypted = NULL;
+	XLogRecPtr	lsn;
+
+	xlrec.dbid = MyDatabaseId;
+	xlrec.version = version;
+
+	if (data != NULL)
+		encrypted = vault_pgp_encrypt(data, cstring_to_text(pgvault_wal_passphrase));
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, SizeOfVaultRecord);
+
+	if (encrypted != NULL)
+		XLogRegisterData(VARDATA_ANY(encrypted), VARSIZE_ANY_EXHDR(encrypted));
+
+	lsn = XLogInsert(VAULT_RMGR_ID, info);
+
+	XLogFlush(lsn);
+
+	if (encrypted != NULL)
+		pfree(encrypted);
+}
+
+
+#if (PG_VERSION_NUM >= 150000)
+
+/*
+ * apply the record to the vault (on a standby)
+ *
+ * Errors (wrong passphrase, full vault, ...) must not stop the replay, so
+ * we only report them as warnings. The vault releases the locks before
+ * reporting errors, so there's nothing else to clean up.
+ */
+static void
+vault_rmgr_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	xl_vault   *xlrec = (xl_vault *) XLogRecGetData(record);
+	Size		len = XLogRecGetDataLen(record) - SizeOfVaultRecord;
+	MemoryContext	oldcontext;
+
+	/* after a crash the vault starts empty, see the comment at the top */
+	if (! StandbyMode)
+		return;
+
+	if ((pgvault_wal_passphrase == NULL) || (pgvault_wal_passphrase[0] == '\0'))
+	{
+		ereport(WARNING,
+				(errmsg("skipping pg_vault record, pg_vault.wal_passphrase is not set")));
+		return;
+	}
+
+	oldcontext = MemoryContextSwitchTo(vault_redo_context);
+
+	PG_TRY();
+	{
+		bytea	   *data = NULL;
+
+		/* decrypt the data (fails if the passphrase is wrong) */
+		if (len > 0)
+		{
+			bytea	   *encrypted = (bytea *) palloc(VARHDRSZ + len);
+
+			SET_VARSIZE(encrypted, VARHDRSZ + len);
+			memcpy(VARDATA(encrypted), (char *) xlrec + SizeOfVaultRecord, len);
+
+			data = vault_pgp_decrypt(encrypted, cstring_to_text(pgvault_wal_passphrase));
+		}
+
+		vault_rmgr_apply(info, xlrec, data);
+
+		if (data != NULL)
+			memset(data, 0, VARSIZE_ANY(data));
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(vault_redo_context);
+
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(WARNING,
+				(errmsg("could not replay pg_vault record: %s", edata->message)));
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(vault_redo_context);
+}
+
+
+/*
+ * apply the decrypted record to the partition of the database
+ */
+static void
+vault_rmgr_apply(uint8 info, xl_vault *xlrec, bytea *data)
+{
+	int			nentries;
+	VaultEntry *entries;
+	Oid			dbid = xlrec->dbid;
+
+	switch (info)
+	{
+		case XLOG_VAULT_REPLACE:
+			vault_uncache_keys(dbid);
+			/* FALLTHROUGH */
+
+		case XLOG_VAULT_ADD:
+			entries = vault_unpack_keys(data, "WAL record", &nentries);
+
+			/* replaces the keys the standby already has */
+			vault_cache_keys(dbid, entries, nentries);
+
+			vault_wipe_entries(entries, nentries);
+			break;
+
+		case XLOG_VAULT_DELETE:
+			vault_uncache_key(dbid, text_to_cstring((text *) data), xlrec->version);
+			break;
+
+		case XLOG_VAULT_DELETE_ALL:
+			vault_uncache_keys(dbid);
+			break;
+
+		case XLOG_VAULT_DELETE_PREFIX:
+			vault_uncache_prefix(dbid, text_to_cstring((text *) data));
+			break;
+
+		default:
+			elog(PANIC, "vault_rmgr_redo: unknown op code %u", info);
+	}
+}
+
+
+/*
+ * describe the record (only the database, the rest is encrypted)
+ */
+static void
+vault_rmgr_desc(StringInfo buf, XLogReaderState *record)
+{
+	xl_vault   *xlrec = (xl_vault *) XLogRecGetData(record);
+
+	appendStringInfo(buf, "db %u", xlrec->dbid);
+
+	if (xlrec->version != 0)
+		appendStringInfo(buf, " version %u", xlrec->version);
+}
+
+
+static const char *
+vault_rmgr_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_VAULT_ADD:
+			return "ADD";
+		case XLOG_VAULT_REPLACE:
+			return "REPLACE";
+		case XLOG_VAULT_DELETE:
+			return "DELETE";
+		case XLOG_VAULT_DELETE_ALL:
+			return "DELETE_ALL";
+		case XLOG_VAULT_DELETE_PREFIX:
+			return "DELETE_PREFIX";
+	}
+
+	return NULL;
+}
+
+
+static void
+vault_rmgr_startup(void)
+{
+	vault_redo_context = AllocSetContextCreate(TopMemoryContext,
+											   "pg_vault redo",
+											   ALLOCSET_DEFAULT_SIZES);
+}
+
+
+static void
+vault_rmgr_cleanup(void)
+{
+	MemoryContextDelete(vault_redo_context);
+	vault_redo_context = NULL;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * scrubber.c
+ *
+ * Background worker wiping the memory released by pg_vault_delete_keys.
+ *
+ * delete_keys only resets the vault logically (so that it does not hold the
+ * exclusive lock while zeroing a possibly very large segment), and leaves
+ * the old key data in the memory. The scrubber then wipes it in small
+ * chunks, releasing the lock after each one, so that it does not block the
+ * other backends for long. It's woken up by delete_keys, and it also checks
+ * for work regularly (in case it was not running at that moment).
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include <signal.h>
+
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#if (PG_VERSION_NUM >= 100000)
+#include "pgstat.h"
+#endif
+
+#include "vault.h"
+
+/* how often to check for work without being woken up (ms) */
+#define SCRUBBER_NAPTIME	10000
+
+void vault_scrubber_main(Datum arg);
+
+static void vault_scrubber_sigterm(SIGNAL_ARGS);
+static void vault_scrubber_exit(int code, Datum arg);
+
+static volatile sig_atomic_t got_sigterm = false;
+
+/*
+ * register the scrubber (called from _PG_init)
+ */
+void
+vault_scrubber_register(void)
+{
+	BackgroundWorker	worker;
+
+	memset(&worker, 0, sizeof(worker));
+
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 10;
+
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_vault scrubber");
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_vault");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "vault_scrubber_main");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * main loop of the scrubber
+ */
+void
+vault_scrubber_main(Datum arg)
+{
+	pqsignal(SIGTERM, vault_scrubber_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	/* let delete_keys know where to wake us up (and forget it on exit) */
+	before_shmem_exit(vault_scrubber_exit, (Datum) 0);
+	vault_scrub_set_latch(MyLatch);
+
+	while (! got_sigterm)
+	{
+		int		rc;
+
+		/* the lock is released after each chunk */
+		while (! got_sigterm && vault_scrub())
+			CHECK_FOR_INTERRUPTS();
+
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+#if (PG_VERSION_NUM >= 100000)
+					   SCRUBBER_NAPTIME, PG_WAIT_EXTENSION);
+#else
+					   SCRUBBER_NAPTIME);
+#endif
+
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	proc_exit(0);
+}
+
+
+static void
+vault_scrubber_sigterm(SIGNAL_ARGS)
+{
+	int		save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+
+static void
+vault_scrubber_exit(int code, Datum arg)
+{
+	vault_scrub_set_latch(NULL);
+}
@@ -0,0 +1,151 @@
+/*
+ * vault.h
+ *
+ * Declarations shared by the various parts of the pg_vault extension.
+ */
+#ifndef PG_VAULT_VAULT_H
+#define PG_VAULT_VAULT_H
+
+#define	MAX_ID_LENGTH		64
+#define	MAX_COMMENT_LENGTH	255
+#define	MAX_KEY_LENGTH		1024
+
+#include "fmgr.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "utils/timestamp.h"
+
+#include "pg_vault.h"
+
+/* a key to add to the vault, or a copy of a key in the vault */
+typedef struct VaultEntry
+{
+	char	   *id;			/* ID of the key */
+	bytea	   *key;		/* key data */
+	char	   *comment;	/* comment of the key (may be NULL) */
+	TimestampTz	expires;	/* when the cached copy expires (0 - never) */
+	uint32		version;	/* version of the key (see below) */
+} VaultEntry;
+
+/*
+ * Versions of keys added to the vault - 0 adds a new key (version 1, the ID
+ * must not exist yet), VAULT_VERSION_NEXT adds the next version of an existing
+ * key (the new current version), anything else adds that particular version
+ * (e.g. from the wallet). vault_add_keys sets the actual version.
+ */
+#define VAULT_VERSION_NEXT	PG_UINT32_MAX
+
+/*
+ * Interface of an external key backend (pg_vault.backend). The library has
+ * to provide a _PG_vault_backend_init function, filling the callbacks. All
+ * the callbacks are called by the pg_vault backend worker only (never by
+ * the regular backends), and may report failures using ereport(ERROR).
+ */
+
+/* a key to fetch from the external backend */
+typedef struct VaultBackendKey
+{
+	Oid			dbid;			/* database the key belongs to */
+	char		id[MAX_ID_LENGTH];	/* ID of the key */
+	bytea	   *key;			/* key data (set by fetch_cb, NULL if not found) */
+} VaultBackendKey;
+
+typedef struct VaultBackendCallbacks
+{
+	/* called once when the worker starts (optional) */
+	void		(*startup_cb) (void);
+
+	/* fetch a batch of keys at once (required) */
+	void		(*fetch_cb) (int nkeys, VaultBackendKey *keys);
+
+	/* add / delete a key in the backend (optional, for pg_vault_add_key etc.) */
+	void		(*store_cb) (Oid dbid, VaultEntry *entry);
+	void		(*remove_cb) (Oid dbid, const char *id);
+
+	/* called when the worker exits (optional) */
+	void		(*shutdown_cb) (void);
+} VaultBackendCallbacks;
+
+typedef void (*VaultBackendInit) (VaultBackendCallbacks *cb);
+
+/* GUC variables */
+extern char *pgvault_wallet_path;
+extern char *pgvault_backend;
+extern int	pgvault_backend_ttl;
+extern char *pgvault_wal_passphrase;
+
+/* per-call-site cache of the key (or passphrase) for a statement */
+extern bool vault_fn_cache_get(FunctionCallInfo fcinfo, int argno, bool handle,
+							   uint32 *version, const struct varlena **value);
+extern const struct varlena *vault_fn_cache_set(FunctionCallInfo fcinfo, int argno,
+												bool handle, uint32 version,
+												struct varlena *value);
+
+/* copy of a key for a function result, wiped when the memory context is reset */
+extern struct varlena *vault_copy_wiped(const struct varlena *value);
+
+/* adding keys to the vault (all or nothing), getting copies of all keys */
+extern void vault_add_keys(VaultEntry *entries, int nentries);
+extern void vault_check_entry(VaultEntry *entry);
+extern VaultEntry *vault_get_keys(int *nentries);
+
+/* caching of keys from the external backend (used by the backend worker) */
+extern void vault_cache_keys(Oid dbid, VaultEntry *entries, int nentries);
+extern void vault_uncache_key(Oid dbid, const char *id, uint32 version);
+extern void vault_uncache_keys(Oid dbid);
+extern void vault_uncache_prefix(Oid dbid, const char *prefix);
+extern VaultBackendKey *vault_expire_keys(TimestampTz now, TimestampTz horizon,
+										  int *nkeys);
+
+/* incremental wiping of memory released by delete_keys */
+extern bool vault_scrub(void);
+extern void vault_scrub_set_latch(Latch *latch);
+
+/* registration of the scrubber background worker (scrubber.c) */
+extern void vault_scrubber_register(void);
+
+/* dedicated (locked) memory for the storage (memory.c) */
+extern bool pgvault_dedicated_memory;
+
+extern void vault_memory_init(Size size);
+extern void *vault_memory_get(Size *size);
+
+/* external key backend, and the worker talking to it (backend.c) */
+#define vault_backend_enabled()	(pgvault_backend != NULL && pgvault_backend[0] != '\0')
+
+extern Size vault_backend_shmem_size(void);
+extern void vault_backend_shmem_init(LWLock *lock);
+extern void vault_backend_register(void);
+extern void vault_backend_fetch(int nids, char **ids);
+extern void vault_backend_store(VaultEntry *entry);
+extern void vault_backend_remove(const char *id);
+
+/* serialization of keys in the wallet format (wallet.c) */
+extern bytea *vault_pack_keys(VaultEntry *entries, int nentries);
+extern VaultEntry *vault_unpack_keys(bytea *data, const char *what, int *nentries);
+extern void vault_wipe_entries(VaultEntry *entries, int nentries);
+
+/* shipping the changes to standbys through WAL (replication.c) */
+extern void vault_replication_register(void);
+extern void vault_log_keys(VaultEntry *entries, int nentries, bool all);
+extern void vault_log_delete(const char *id, uint32 version);
+extern void vault_log_delete_all(void);
+extern void vault_log_delete_prefix(const char *prefix);
+
+/* conversion of a key to passphrase (crypto.c) */
+extern text *vault_key_passphrase(bytea *key);
+
+/* encryption of arbitrary data with a passphrase (crypto.c) */
+extern bytea *vault_pgp_encrypt(bytea *data, text *passphrase);
+extern bytea *vault_pgp_decrypt(bytea *data, text *passphrase);
+
+/* HMAC-SHA256, using pgcrypto (crypto.c) */
+extern bytea *vault_hmac(bytea *data, bytea *key);
+
+/* keys derived from a master key, cached in the backend (derive.c) */
+extern int	pgvault_derive_cache_size;
+
+extern text *vault_derive_passphrase(const char *master_id, text *context,
+									 uint32 *version);
+
+#endif	/* PG_VAULT_VAULT_H */
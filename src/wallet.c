@@ -0,0 +1,438 @@
+/*
+ * wallet.c
+ *
+ * Saving the keys into an encrypted file (wallet), and loading them back,
+ * e.g. after a restart.
+ *
+ * The wallet is a simple binary format - a header followed by the keys,
+ * each one with a small header (lengths, and the version of the key) and
+ * the data (key, ID, comment).
+ * The whole wallet is then encrypted with pgcrypto, using a passphrase
+ * supplied by the caller (so it's never stored anywhere).
+ *
+ * The wallet uses native byte order, i.e. it's not portable between
+ * different architectures (just like the rest of the data directory).
+ */
+#include "postgres.h"
+#include "miscadmin.h"
+
+#include <sys/stat.h>
+
+#include "storage/fd.h"
+#include "utils/builtins.h"
+
+#include "vault.h"
+
+#define WALLET_MAGIC		"PGVAULT"
+#define WALLET_VERSION		2
+
+/* the first version, without versions of keys (still accepted) */
+#define WALLET_VERSION_1	1
+
+typedef struct WalletHeader
+{
+	char	magic[8];		/* WALLET_MAGIC */
+	uint32	version;		/* WALLET_VERSION */
+	uint32	nkeys;			/* number of keys in the wallet */
+} WalletHeader;
+
+/*
+ * header of each key, followed by the version of the key (uint32, not in
+ * WALLET_VERSION_1), and by the key, ID and comment
+ */
+typedef struct WalletItem
+{
+	uint16	key_len;		/* length of the key (including varlena header) */
+	uint16	id_len;			/* length of the ID */
+	uint16	comment_len;	/* length of the comment */
+} WalletItem;
+
+static void wallet_path(char *path);
+static void wallet_write(bytea *data);
+static bytea *wallet_read(const char *path);
+
+Datum save_keys(PG_FUNCTION_ARGS);
+Datum load_keys(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(save_keys);
+PG_FUNCTION_INFO_V1(load_keys);
+
+/*
+ * save all the keys into the wallet (replacing the existing one)
+ *
+ * - passphrase (TEXT)
+ *
+ * Returns the number of keys saved.
+ */
+Datum
+save_keys(PG_FUNCTION_ARGS)
+{
+	int			nentries;
+	VaultEntry *entries;
+	bytea	   *data;
+	bytea	   *encrypted;
+
+	text	   *passphrase = PG_GETARG_TEXT_PP(0);
+
+	entries = vault_get_keys(&nentries);
+
+	data = vault_pack_keys(entries, nentries);
+
+	vault_wipe_entries(entries, nentries);
+
+	encrypted = vault_pgp_encrypt(data, passphrase);
+
+	memset(data, 0, VARSIZE(data));
+	pfree(data);
+
+	wallet_write(encrypted);
+
+	PG_RETURN_INT32(nentries);
+}
+
+
+/*
+ * load all the keys from the wallet into the vault
+ *
+ * - passphrase (TEXT)
+ *
+ * All the keys are added to the vault at once (all or nothing), so it fails
+ * if any of the keys is already in the vault (the same version of it, to be
+ * precise). Returns the number of keys.
+ */
+Datum
+load_keys(PG_FUNCTION_ARGS)
+{
+	volatile int nentries = 0;
+	bytea	   *encrypted;
+	bytea	   *volatile data = NULL;
+	VaultEntry *volatile entries = NULL;
+	char		path[MAXPGPATH];
+
+	text	   *passphrase = PG_GETARG_TEXT_PP(0);
+
+	wallet_path(path);
+
+	encrypted = wallet_read(path);
+
+	/* wipe the decrypted keys even if adding them to the vault fails */
+	PG_TRY();
+	{
+		VaultEntry *unpacked;
+		int			n;
+
+		/* fails if the passphrase is wrong */
+		data = vault_pgp_decrypt(encrypted, passphrase);
+
+		unpacked = vault_unpack_keys(data, psprintf("wallet \"%s\"", path), &n);
+
+		/* the count first, the catch block wipes the entries using it */
+		nentries = n;
+		entries = unpacked;
+
+		memset(VARDATA_ANY(data), 0, VARSIZE_ANY_EXHDR(data));
+
+		/* add all the keys at once (under a single lock) */
+		vault_add_keys(entries, nentries);
+
+		/* the standbys get the keys too */
+		vault_log_keys(entries, nentries, false);
+	}
+	PG_CATCH();
+	{
+		/* vault_unpack_keys wipes the entries itself when it fails */
+		if (entries != NULL)
+			vault_wipe_entries(entries, nentries);
+
+		if (data != NULL)
+			memset(VARDATA_ANY(data), 0, VARSIZE_ANY_EXHDR(data));
+
+		memset(VARDATA_ANY(encrypted), 0, VARSIZE_ANY_EXHDR(encrypted));
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	vault_wipe_entries(entries, nentries);
+
+	memset(VARDATA_ANY(encrypted), 0, VARSIZE_ANY_EXHDR(encrypted));
+
+	PG_RETURN_INT32(nentries);
+}
+
+
+/*
+ * serialize the keys into the wallet format (not encrypted yet)
+ *
+ * The size is computed first, so that we don't need to enlarge the buffer
+ * (which would leave copies of the keys in the freed memory). It's up to
+ * the caller to wipe the result. Also used for the WAL records shipping the
+ * keys to standbys (see replication.c).
+ */
+bytea *
+vault_pack_keys(VaultEntry *entries, int nentries)
+{
+	int			i;
+	Size		len;
+	bytea	   *data;
+	char	   *ptr;
+	WalletHeader header;
+
+	len = VARHDRSZ + sizeof(WalletHeader);
+
+	for (i = 0; i < nentries; i++)
+		len += sizeof(WalletItem) + sizeof(uint32) + VARSIZE_ANY(entries[i].key) +
+			   strlen(entries[i].id) +
+			   ((entries[i].comment != NULL) ? strlen(entries[i].comment) : 0);
+
+	data = (bytea *) palloc(len);
+	SET_VARSIZE(data, len);
+
+	ptr = VARDATA(data);
+
+	memset(&header, 0, sizeof(WalletHeader));
+	strcpy(header.magic, WALLET_MAGIC);
+	header.version = WALLET_VERSION;
+	header.nkeys = nentries;
+
+	memcpy(ptr, &header, sizeof(WalletHeader));
+	ptr += sizeof(WalletHeader);
+
+	for (i = 0; i < nentries; i++)
+	{
+		WalletItem	item;
+
+		item.key_len = VARSIZE_ANY(entries[i].key);
+		item.id_len = strlen(entries[i].id);
+		item.comment_len = (entries[i].comment != NULL) ? strlen(entries[i].comment) : 0;
+
+		memcpy(ptr, &item, sizeof(WalletItem));
+		ptr += sizeof(WalletItem);
+
+		memcpy(ptr, &entries[i].version, sizeof(uint32));
+		ptr += sizeof(uint32);
+
+		memcpy(ptr, entries[i].key, item.key_len);
+		ptr += item.key_len;
+
+		memcpy(ptr, entries[i].id, item.id_len);
+		ptr += item.id_len;
+
+		if (item.comment_len > 0)
+			memcpy(ptr, entries[i].comment, item.comment_len);
+		ptr += item.comment_len;
+	}
+
+	Assert(ptr == (char *) data + len);
+
+	return data;
+}
+
+
+/*
+ * parse keys serialized by vault_pack_keys (what describes the source, for
+ * the error messages)
+ *
+ * The keys are copied, so the caller may wipe the data right away, and then
+ * the keys using vault_wipe_entries once not needed.
+ */
+VaultEntry *
+vault_unpack_keys(bytea *data, const char *what, int *nentries)
+{
+	int			i;
+	char	   *ptr;
+	char	   *end;
+	VaultEntry *entries;
+	WalletHeader header;
+
+	ptr = VARDATA_ANY(data);
+	end = ptr + VARSIZE_ANY_EXHDR(data);
+
+	if (end - ptr < sizeof(WalletHeader))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_vault %s", what),
+				 errdetail("The data is too short.")));
+
+	memcpy(&header, ptr, sizeof(WalletHeader));
+	ptr += sizeof(WalletHeader);
+
+	if ((strncmp(header.magic, WALLET_MAGIC, sizeof(header.magic)) != 0) ||
+		((header.version != WALLET_VERSION) && (header.version != WALLET_VERSION_1)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_vault %s", what),
+				 errdetail("Unknown wallet format or version %u.", header.version)));
+
+	/* the wallet can't have more keys than bytes */
+	if (header.nkeys > (end - ptr) / sizeof(WalletItem))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_vault %s", what),
+				 errdetail("Invalid number of keys %u.", header.nkeys)));
+
+	entries = (VaultEntry *) palloc0(Max(1, header.nkeys) * sizeof(VaultEntry));
+
+	for (i = 0; i < header.nkeys; i++)
+	{
+		WalletItem	item;
+
+		if (end - ptr < sizeof(WalletItem))
+			break;
+
+		memcpy(&item, ptr, sizeof(WalletItem));
+		ptr += sizeof(WalletItem);
+
+		/* keys from the first version are added as new keys (version 1) */
+		if (header.version != WALLET_VERSION_1)
+		{
+			if (end - ptr < sizeof(uint32))
+				break;
+
+			memcpy(&entries[i].version, ptr, sizeof(uint32));
+			ptr += sizeof(uint32);
+
+			if ((entries[i].version == 0) || (entries[i].version == VAULT_VERSION_NEXT))
+				break;
+		}
+
+		if ((item.key_len < VARHDRSZ) || (item.key_len > MAX_KEY_LENGTH) ||
+			(item.id_len >= MAX_ID_LENGTH) ||
+			(item.comment_len >= MAX_COMMENT_LENGTH) ||
+			(end - ptr < item.key_len + item.id_len + item.comment_len) ||
+			(VARSIZE_ANY(ptr) != item.key_len))
+			break;
+
+		entries[i].key = (bytea *) palloc(item.key_len);
+		memcpy(entries[i].key, ptr, item.key_len);
+		ptr += item.key_len;
+
+		entries[i].id = pnstrdup(ptr, item.id_len);
+		ptr += item.id_len;
+
+		entries[i].comment = pnstrdup(ptr, item.comment_len);
+		ptr += item.comment_len;
+	}
+
+	if ((i < header.nkeys) || (ptr != end))
+	{
+		vault_wipe_entries(entries, i);
+
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_vault %s", what),
+				 errdetail("Invalid key %d.", i)));
+	}
+
+	*nentries = header.nkeys;
+
+	return entries;
+}
+
+
+/*
+ * path of the wallet for the current database
+ *
+ * Each database has its own keys in the vault, so we keep them in separate
+ * wallets too - the configured path with the database OID appended.
+ */
+static void
+wallet_path(char *path)
+{
+	snprintf(path, MAXPGPATH, "%s.%u", pgvault_wallet_path, MyDatabaseId);
+}
+
+
+/*
+ * write the encrypted wallet into the file
+ *
+ * We write the data into a temporary file first, and then rename it,
+ * so that we never leave a partially written wallet behind.
+ */
+static void
+wallet_write(bytea *data)
+{
+	FILE   *file;
+	char	path[MAXPGPATH];
+	char	tmppath[MAXPGPATH];
+
+	wallet_path(path);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	if ((file = AllocateFile(tmppath, PG_BINARY_W)) == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+
+	if (fwrite(VARDATA_ANY(data), 1, VARSIZE_ANY_EXHDR(data), file) != VARSIZE_ANY_EXHDR(data))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+
+	if ((fflush(file) != 0) || (pg_fsync(fileno(file)) != 0))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file \"%s\": %m", tmppath)));
+
+	if (FreeFile(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+
+	(void) durable_rename(tmppath, path, ERROR);
+}
+
+
+/*
+ * read the encrypted wallet from the file
+ */
+static bytea *
+wallet_read(const char *path)
+{
+	FILE	   *file;
+	struct stat	st;
+	bytea	   *data;
+
+	if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+
+	if (fstat(fileno(file), &st) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	data = (bytea *) palloc(VARHDRSZ + st.st_size);
+	SET_VARSIZE(data, VARHDRSZ + st.st_size);
+
+	if (fread(VARDATA(data), 1, st.st_size, file) != st.st_size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+
+	FreeFile(file);
+
+	return data;
+}
+
+
+/*
+ * wipe the copies of keys from the vault
+ */
+void
+vault_wipe_entries(VaultEntry *entries, int nentries)
+{
+	int		i;
+
+	for (i = 0; i < nentries; i++)
+	{
+		if (entries[i].key == NULL)
+			continue;
+
+		memset(entries[i].key, 0, VARSIZE_ANY(entries[i].key));
+		pfree(entries[i].key);
+	}
+
+	pfree(entries);
+}